@@ -0,0 +1,319 @@
+/**************************************************************************
+* SPMatch benchmark. Times each stage of PatchMatch Stereo on the stereo  *
+* pairs of the saved/ directory, for some window sizes and thread counts, *
+* and writes the results as JSON: the time and the pixels per second of   *
+* each stage. Used to catch performance regressions and to size hardware. *
+**************************************************************************/
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <boost/program_options.hpp>
+
+#include "params.hpp"
+#include "stereo.hpp"
+
+// The directory of the stereo pairs. Set by CMake
+#ifndef SPMATCH_DATA_DIR
+#define SPMATCH_DATA_DIR "saved"
+#endif
+
+
+namespace po = boost::program_options;
+using std::string;
+
+
+// A measure of the benchmark
+struct StageTime {
+	string dataset;
+	unsigned window;
+	unsigned threads;
+	string stage;
+	size_t pixels;               // processed by the stage
+	double seconds;
+};
+
+
+/**********************************************************************
+* > struct BenchStages                                                *
+* Access to the private stages of StereoImage (a friend of the class) *
+**********************************************************************/
+struct BenchStages {
+
+	static void fillInvalidPlanes(StereoImage& image, const Image& invalid) {
+		image.fillInvalidPlanes(invalid);
+	}
+
+	static Image wMedianFilter(const StereoImage& image, const Image& disp,
+			const Image& invalid) {
+		return image.wMedianFilterAtDisparity(disp, invalid);
+	}
+};
+
+
+// Forward declarations
+void benchStages(const string& dataDir, const string& dataset,
+		unsigned window, std::vector<StageTime>& results);
+void benchThreads(const string& dataDir, const string& dataset,
+		unsigned window, unsigned threads, std::vector<StageTime>& results);
+void writeJson(std::ostream& out, const std::vector<StageTime>& results);
+
+
+/***************************************************
+* > seconds()                                      *
+* Args:                                            *
+*   task (F): a callable without arguments         *
+*                                                  *
+* Returns:                                         *
+*   (double): the wall-clock time of task(), in s  *
+***************************************************/
+template<typename F>
+double seconds(F task) {
+
+	auto start = std::chrono::steady_clock::now();
+	task();
+	std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+
+// main
+int main(int argc, char *argv[]) {
+
+	// Settings: repeatable and silent
+	params = defaultParams();
+	params.USE_PSEUDORAND = true;
+	params.LOG = 0;
+
+	string dataDir = SPMATCH_DATA_DIR;
+	std::vector<string> datasets = { "cones", "teddy" };
+	std::vector<unsigned> windows = { 11 };
+	std::vector<unsigned> threads = { 1 };
+	if (std::thread::hardware_concurrency() > 1) {
+		threads.push_back(std::thread::hardware_concurrency());
+	}
+	string jsonPath;
+	string median = "exact";
+
+	// parsing the command line
+	po::options_description opts(string() + "SPMatch benchmark\n" +
+			"Usage:\n" +
+			"  spmatch_bench [options]\n");
+	opts.add_options()
+			("help,h", "Help")
+			("data", po::value<string>(&dataDir),
+				"Directory of the <dataset>L.png, <dataset>R.png pairs")
+			("datasets", po::value<std::vector<string>>(&datasets)->multitoken(),
+				"Names of the pairs")
+			("windows,w", po::value<std::vector<unsigned>>(&windows)
+				->multitoken(), "Window sizes")
+			("threads,t", po::value<std::vector<unsigned>>(&threads)
+				->multitoken(), "Thread counts of the whole computation")
+			("iteration,i", po::value<unsigned>(&params.ITERATIONS),
+				"Iterations of the whole computation")
+			("max_d,M", po::value<int>(&params.MAX_D), "Maximum disparity")
+			("median", po::value<string>(&median),
+				"Weighted median of the post processing: exact or histogram")
+			("json,o", po::value<string>(&jsonPath),
+				"The output file. Defaults to the standard output")
+	;
+
+	po::variables_map vMap;
+	po::store(po::parse_command_line(argc, argv, opts), vMap);
+	if (vMap.count("help")) {
+		std::cout << opts << std::endl;
+		return 1;
+	}
+	po::notify(vMap);
+	if (median == "exact" || median == "histogram") {
+		params.MEDIAN = (median == "exact") ? Params::Median::EXACT :
+				Params::Median::HISTOGRAM;
+	} else {
+		throw std::runtime_error("Invalid median: " + median);
+	}
+
+	// run
+	std::vector<StageTime> results;
+	for (const string& dataset: datasets) {
+		for (unsigned window: windows) {
+			std::cerr << dataset << ", window " << window << std::endl;
+			benchStages(dataDir, dataset, window, results);
+			for (unsigned t: threads) {
+				benchThreads(dataDir, dataset, window, t, results);
+			}
+		}
+	}
+
+	if (jsonPath.empty()) {
+		writeJson(std::cout, results);
+	} else {
+		std::ofstream out(jsonPath);
+		if (!out) {
+			throw std::runtime_error("Can't write " + jsonPath);
+		}
+		writeJson(out, results);
+	}
+
+	return 0;
+}
+
+
+/**************************************************************************
+* > benchStages()                                                         *
+* Times each stage of PatchMatch Stereo, one at a time on a single        *
+* thread, on both views: construction, random initialization, the three   *
+* steps of the first iteration (each over all the pixels, in the order of *
+* the sequential sweep), then the three steps of the post processing.     *
+* NOTE: the spatial propagation also computes the first cost of each      *
+*   plane; the view propagation also builds its index.                    *
+*                                                                         *
+* Args:                                                                   *
+*   dataDir (string): directory of the pairs                              *
+*   dataset (string): the name of the pair                                *
+*   window (unsigned): the window size                                    *
+*   results (vector<StageTime>): where the measures are appended          *
+**************************************************************************/
+void benchStages(const string& dataDir, const string& dataset,
+		unsigned window, std::vector<StageTime>& results) {
+
+	params.WINDOW_SIZE = window;
+
+	std::unique_ptr<StereoImage> left, right;
+	double construction = seconds([&] {
+		left.reset(new StereoImage(dataDir + "/" + dataset + "L.png",
+				StereoImage::LEFT));
+		right.reset(new StereoImage(dataDir + "/" + dataset + "R.png",
+				StereoImage::RIGHT));
+	});
+	left->bind(right.get());
+
+	size_t width = left->size().first;
+	size_t height = left->size().second;
+	StereoImage* views[] = { left.get(), right.get() };
+	auto add = [&] (const string& stage, double time) {
+		results.push_back({ dataset, window, 1, stage, 2 * width * height, time });
+	};
+	add("construction", construction);
+
+	// Iteration stages
+	add("setRandomDisparities", seconds([&] {
+		for (StereoImage* view: views) {
+			view->setRandomDisparities();
+		}
+	}));
+	add("spatialPropagation", seconds([&] {
+		for (StereoImage* view: views) {
+			for (size_t h = 0; h < height; ++h) {
+				for (size_t w = 0; w < width; ++w) {
+					view->pixelSpatialPropagation(w, h, 0);
+				}
+			}
+		}
+	}));
+	add("viewPropagation", seconds([&] {
+		for (StereoImage* view: views) {
+			view->clearViewCandidates();
+			for (size_t h = 0; h < height; ++h) {
+				view->indexViewCandidates(h);
+				for (size_t w = 0; w < width; ++w) {
+					view->pixelViewPropagation(w, h);
+				}
+			}
+		}
+	}));
+	add("planeRefinement", seconds([&] {
+		for (StereoImage* view: views) {
+			for (size_t h = 0; h < height; ++h) {
+				for (size_t w = 0; w < width; ++w) {
+					view->planeRefinement(w, h);
+				}
+			}
+		}
+	}));
+
+	// Post processing stages
+	std::vector<Image> invalid;
+	add("getInvalidPixelsMap", seconds([&] {
+		for (StereoImage* view: views) {
+			invalid.push_back(view->getInvalidPixelsMap());
+		}
+	}));
+	add("fillInvalidPlanes", seconds([&] {
+		for (size_t v = 0; v < 2; ++v) {
+			BenchStages::fillInvalidPlanes(*views[v], invalid[v]);
+		}
+	}));
+	add("wMedianFilterAtDisparity", seconds([&] {
+		for (size_t v = 0; v < 2; ++v) {
+			BenchStages::wMedianFilter(*views[v], views[v]->getDisparityMap(),
+					invalid[v]);
+		}
+	}));
+}
+
+
+/*************************************************************************
+* > benchThreads()                                                       *
+* Times the whole computation (StereoImagePair::computeDisparity(), with *
+* params.ITERATIONS iterations) with the given number of threads.        *
+*                                                                        *
+* Args:                                                                  *
+*   dataDir (string), dataset (string), window (unsigned): as in         *
+*       benchStages()                                                    *
+*   threads (unsigned): the number of threads. 0 means all               *
+*   results (vector<StageTime>): where the measure is appended           *
+*************************************************************************/
+void benchThreads(const string& dataDir, const string& dataset,
+		unsigned window, unsigned threads, std::vector<StageTime>& results) {
+
+	params.WINDOW_SIZE = window;
+	params.THREADS = threads;
+
+	StereoImagePair stereo(dataDir + "/" + dataset + "L.png",
+			dataDir + "/" + dataset + "R.png");
+	Image left(dataDir + "/" + dataset + "L.png");
+	size_t pixels = 2 * left.size(0) * left.size(1);
+
+	double time = seconds([&] { stereo.computeDisparity(); });
+	results.push_back({ dataset, window, threads, "computeDisparity", pixels,
+			time });
+}
+
+
+/*************************************************************************
+* > writeJson()                                                          *
+* Writes the measures as a JSON object:                                  *
+* { "hardware_threads": n, "iterations": i, "max_d": d, "results": [     *
+*   { "dataset": ..., "window": ..., "threads": ..., "stage": ...,       *
+*     "pixels": ..., "seconds": ..., "pixels_per_second": ... }, ... ] } *
+*                                                                        *
+* Args:                                                                  *
+*   out (ostream): the output stream                                     *
+*   results (vector<StageTime>): the measures                            *
+*************************************************************************/
+void writeJson(std::ostream& out, const std::vector<StageTime>& results) {
+
+	out << "{\n";
+	out << "  \"hardware_threads\": " << std::thread::hardware_concurrency() <<
+			",\n";
+	out << "  \"iterations\": " << params.ITERATIONS << ",\n";
+	out << "  \"max_d\": " << params.MAX_D << ",\n";
+	out << "  \"results\": [";
+
+	for (size_t i = 0; i < results.size(); ++i) {
+		const StageTime& r = results[i];
+		out << ((i == 0) ? "\n" : ",\n");
+		out << "    { \"dataset\": \"" << r.dataset << "\", \"window\": " <<
+				r.window << ", \"threads\": " << r.threads << ", \"stage\": \"" <<
+				r.stage << "\", \"pixels\": " << r.pixels << ", \"seconds\": " <<
+				r.seconds << ", \"pixels_per_second\": " <<
+				(r.seconds > 0 ? r.pixels / r.seconds : 0) << " }";
+	}
+
+	out << "\n  ]\n}" << std::endl;
+}
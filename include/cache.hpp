@@ -0,0 +1,247 @@
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <memory>
+#include <limits>
+#include <stdexcept>
+#include <atomic>
+
+
+/****************************************************************************
+* > class SlotCache                                                         *
+* A fixed-size, direct-mapped cache of arrays. Each key (e.g. the index of  *
+* a pixel) is mapped to a slot of 'slotLength' elements. Two keys sharing   *
+* the same slot evict each other. The total memory is bounded by the        *
+* 'maxBytes' constructor parameter.                                         *
+* Slots are accessed through a Handle, that locks the slot while in use.    *
+* So the cache can be shared between threads.                               *
+* NOTE: hold at most one Handle for each thread.                            *
+****************************************************************************/
+template<typename T>
+class SlotCache {
+
+	public:
+
+		class Handle;
+
+	private:
+
+		static const size_t NO_KEY;
+
+		size_t slotLength;
+		size_t nSlots;
+
+		std::unique_ptr<T[]> data;   // not initialized: see SlotCache()
+		std::vector<size_t> keys;
+		std::unique_ptr<std::mutex[]> locks;
+
+	public:
+
+		// constr
+		SlotCache(size_t nKeys, size_t slotLength, size_t maxBytes);
+		SlotCache(const SlotCache&) = delete;
+
+		// const methods
+		size_t slots(void) const { return nSlots; }
+		size_t length(void) const { return slotLength; }
+		static size_t slotsFor(size_t nKeys, size_t slotLength, size_t maxBytes);
+
+		// methods
+		Handle get(size_t key);
+		void clear(void);
+};
+
+
+/***************************************************************************
+* > class SlotCache::Handle                                                *
+* The access to a single slot. The slot remains locked until destruction.  *
+* If isNew() is true, the content of the slot is undefined: the owner      *
+* must fill data() before reading from it.                                 *
+***************************************************************************/
+template<typename T>
+class SlotCache<T>::Handle {
+
+	private:
+
+		std::unique_lock<std::mutex> lock;
+		T* ptr;
+		bool fresh;
+
+	public:
+
+		// constr
+		Handle(std::mutex& m, T* ptr, size_t& key, size_t newKey):
+				lock(m), ptr(ptr), fresh(key != newKey) {
+			key = newKey;
+		}
+		Handle(Handle&&) = default;
+
+		// const methods
+		bool isNew(void) const { return fresh; }
+		const T* data(void) const { return ptr; }
+
+		// methods
+		T* data(void) { return ptr; }
+};
+
+
+// > class SlotCache
+
+template<typename T>
+const size_t SlotCache<T>::NO_KEY = std::numeric_limits<size_t>::max();
+
+
+/*************************************************************************
+* > slotsFor()                                                           *
+* Args:                                                                  *
+*   nKeys (size_t): number of distinct keys                              *
+*   slotLength (size_t): number of elements in each slot                 *
+*   maxBytes (size_t): memory cap                                        *
+*                                                                        *
+* Returns:                                                               *
+*   (size_t): the number of slots that fit in maxBytes (at most nKeys)   *
+*************************************************************************/
+template<typename T>
+size_t SlotCache<T>::slotsFor(size_t nKeys, size_t slotLength,
+		size_t maxBytes) {
+
+	size_t slotBytes = slotLength * sizeof(T) + sizeof(size_t) +
+			sizeof(std::mutex);
+	size_t n = maxBytes / slotBytes;
+	return (n < nKeys) ? n : nKeys;
+}
+
+
+/************************************************************************
+* > SlotCache()                                                         *
+* Constructor. Allocates all the slots that fit in maxBytes. No slot is *
+* valid initially, so their elements are not initialized: the memory of *
+* a slot is touched only when it is first used.                         *
+*                                                                       *
+* Args:                                                                 *
+*   nKeys (size_t): number of distinct keys, in [0, nKeys)              *
+*   slotLength (size_t): number of elements in each slot                *
+*   maxBytes (size_t): memory cap                                       *
+************************************************************************/
+template<typename T>
+SlotCache<T>::SlotCache(size_t nKeys, size_t slotLength, size_t maxBytes):
+		slotLength(slotLength),
+		nSlots(slotsFor(nKeys, slotLength, maxBytes)) {
+
+	if (nSlots == 0) {
+		throw std::invalid_argument(
+				"SlotCache(). Not enough memory for a single slot");
+	}
+
+	data.reset(new T[nSlots * slotLength]);
+	keys.assign(nSlots, NO_KEY);
+	locks.reset(new std::mutex[nSlots]);
+}
+
+
+/***********************************************************************
+* > get()                                                              *
+* Returns the slot of 'key', locked. If the slot was owned by another  *
+* key, or never used, the Handle is marked as new.                     *
+*                                                                      *
+* Args:                                                                *
+*   key (size_t): the key to look for                                  *
+*                                                                      *
+* Returns:                                                             *
+*   (Handle): the locked slot                                          *
+***********************************************************************/
+template<typename T>
+typename SlotCache<T>::Handle SlotCache<T>::get(size_t key) {
+
+	size_t slot = key % nSlots;
+	return Handle(locks[slot], &data[slot * slotLength], keys[slot], key);
+}
+
+
+/**********************************************************************
+* > clear()                                                           *
+* Invalidates all the slots, keeping the memory. Used when the cached *
+* values change, e.g. with a new image.                               *
+* NOTE: not thread safe: no Handle can be alive.                      *
+**********************************************************************/
+template<typename T>
+void SlotCache<T>::clear(void) {
+	std::fill(keys.begin(), keys.end(), NO_KEY);
+}
+
+
+/*****************************************************************************
+* > class CostTable                                                          *
+* A table of the matching cost of each pixel at the disparities              *
+* minD + k / steps, for k in [0, (maxD - minD) * steps]: costs at the other  *
+* disparities are linearly interpolated. Entries are computed on first use,  *
+* by any thread. Two threads computing the same entry write the same value,  *
+* so entries are relaxed atomics and there are no locks: at() is cheap       *
+* enough for the inner loop of a window cost.                                *
+* NOTE: costs must be >= 0 or NaN.                                           *
+*****************************************************************************/
+class CostTable {
+
+	private:
+
+		static const float UNKNOWN;
+
+		double minD;
+		unsigned steps;
+		size_t length;               // entries of each key
+		size_t nKeys;
+		std::unique_ptr<std::atomic<float>[]> entries;
+
+	public:
+
+		// constr
+		CostTable(size_t nKeys, int minD, int maxD, unsigned steps);
+		CostTable(const CostTable&) = delete;
+
+		// const methods
+		static size_t bytesFor(size_t nKeys, int minD, int maxD, unsigned steps);
+
+		// methods
+		template<typename F>
+		double at(size_t key, double d, F cost);
+		void clear(void);
+};
+
+
+/*************************************************************************
+* > at()                                                                 *
+* The cost of 'key' at disparity d, interpolated between the two nearest *
+* entries. Missing entries are computed with cost(dk), at their own      *
+* disparity dk.                                                          *
+* NOTE: the arguments are not checked. d must be in [minD, maxD].        *
+*                                                                        *
+* Args:                                                                  *
+*   key (size_t): the key, e.g. the index of a pixel                     *
+*   d (double): the disparity                                            *
+*   cost (F): callable, double(double), the exact cost                   *
+*                                                                        *
+* Returns:                                                               *
+*   (double): the cost. NaN if one of the two entries is NaN             *
+*************************************************************************/
+template<typename F>
+double CostTable::at(size_t key, double d, F cost) {
+
+	double x = (d - minD) * steps;
+	size_t k = std::min(size_t(x), length - 2);
+	double t = x - k;
+
+	std::atomic<float>* entry = &entries[key * length + k];
+	float c[2];
+	for (size_t i = 0; i < 2; ++i) {
+		c[i] = entry[i].load(std::memory_order_relaxed);
+		if (c[i] == UNKNOWN) {
+			c[i] = cost(minD + double(k + i) / steps);
+			entry[i].store(c[i], std::memory_order_relaxed);
+		}
+	}
+
+	return c[0] + t * (c[1] - c[0]);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <vector>
+
+#include "image.hpp"
+
+
+/**************************************************************************
+* > struct DecodedImage                                                   *
+* An image decoded by decodeImage(): 8 bit pixels, interleaved channels   *
+* (Grayscale or RGB), row major, without padding.                         *
+**************************************************************************/
+struct DecodedImage {
+	std::vector<unsigned char> pixels;
+	size_t width = 0;
+	size_t height = 0;
+	size_t channels = 0;
+
+	ImageBuffer buffer(void) const {
+		return { pixels.data(), width, height, channels, width * channels };
+	}
+};
+
+
+// see .cpp
+bool decoderAvailable(void);
+bool decodeImage(const unsigned char* data, size_t size, DecodedImage& out);
+bool decodeImage(const string& path, DecodedImage& out);
+void loadImage(const string& path, DecodedImage& out);
@@ -0,0 +1,71 @@
+
+#pragma once
+
+#include <vector>
+#include <memory>
+
+#include "params.hpp"
+#include "image.hpp"
+#include "stereo.hpp"
+
+
+/****************************************************************************
+* > class Engine                                                            *
+* The library interface of SPMatch: computes disparity maps of images in    *
+* memory, without files. Each engine has its own params, and keeps its      *
+* StereoImagePair (thread pool, images, planes and caches) between calls    *
+* with the same image size: a stream of frames reuses all the buffers.      *
+* NOTE: an engine must be used by one thread at a time. Different engines,  *
+*   on different threads, can run at the same time.                         *
+* See the comments in .cpp file.                                            *
+****************************************************************************/
+class Engine {
+
+	public:
+
+		// The output of compute(): two disparity maps, row-major
+		struct Disparities {
+			size_t width = 0;
+			size_t height = 0;
+			std::vector<float> left;     // disparity of pixel (w,h) at h*width+w
+			std::vector<float> right;
+		};
+
+	private:
+
+		Params settings;
+		std::unique_ptr<StereoImagePair> stereo;   // nullptr: no frame yet
+		size_t width = 0;
+		size_t height = 0;
+		size_t channels = 0;
+
+	private:
+
+		// private static methods
+		static void copyDisparities(const Image& disp, std::vector<float>& out);
+
+		// private methods
+		bool loadFrame(const ImageBuffer& left, const ImageBuffer& right);
+		void run(const ImageBuffer& left, const ImageBuffer& right,
+				Disparities& out, bool warmStart);
+
+	public:
+
+		// constr
+		Engine(void);
+		explicit Engine(const Params& settings);
+		Engine(const Engine&) = delete;
+
+		// const methods
+		const Params& getParams(void) const { return settings; }
+
+		// methods
+		void setParams(const Params& settings);
+		void compute(const ImageBuffer& left, const ImageBuffer& right,
+				Disparities& out);
+		void computeNext(const ImageBuffer& left, const ImageBuffer& right,
+				Disparities& out);
+
+		// operators
+		Engine& operator=(const Engine&) = delete;
+};
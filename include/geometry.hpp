@@ -2,6 +2,8 @@
 #pragma once
 
 #include <iostream>
+#include <random>
+#include <cmath>
 #include <Eigen/Core>
 
 
@@ -102,3 +104,145 @@ class PlaneFunction: public Plane {
 		inline bool areFunctionParams(Vector3d p) const;
 
 };
+
+
+/****************************************************************************
+* > struct CompactPlane                                                     *
+* The disparity function a*x + b*y + c, stored in three floats, with no     *
+* virtual methods. This is the storage type of the planes of each pixel:    *
+* the window costs only need the three coefficients. The normal is decoded  *
+* on demand. Use toFunction() for all the other operations, like sampling.  *
+* See the comments in .cpp file.                                            *
+****************************************************************************/
+struct CompactPlane {
+
+	float a, b, c;
+
+	// construct
+	CompactPlane(void) = default;
+	CompactPlane(float a, float b, float c): a(a), b(b), c(c) {}
+	explicit CompactPlane(const PlaneFunction& f):
+			CompactPlane(f.getFunParams()(0), f.getFunParams()(1),
+					f.getFunParams()(2)) {}
+
+	// const methods
+	PlaneFunction toFunction(void) const { return PlaneFunction(a, b, c); }
+	Vector3d normal(void) const;
+
+	// operator
+	double operator()(double x, double y) const { return a * x + b * y + c; }
+	friend std::ostream& operator<<(std::ostream& out, const CompactPlane& p);
+
+};
+
+
+/*****************************************************************************
+* > class PlaneSampler                                                       *
+* Samples planes in a neighbourhood of a given one, like                     *
+* PlaneFunction::getNeighbourFunction(), in constant time. The normal is     *
+* drawn directly inside the intersection of the cone around the current      *
+* normal and the slope limit: no rejections. The orthonormal frame of the    *
+* current normal is computed once, in setPlane(), and reused by each         *
+* sample(). The random engine is owned by the caller.                        *
+* See the comments in .cpp file.                                             *
+*****************************************************************************/
+class PlaneSampler {
+
+	private:
+
+		// Frame of the current normal m (m_z >= 0): toZ points from m
+		// towards the z axis, side completes the frame
+		Vector3d m;
+		Vector3d toZ;
+		Vector3d side;
+		double mZ;             // cosine of the angle of m with z
+		double sinMZ;          // sine of the same angle
+
+		double cosLimit;       // min n_z of the sampled normals
+		double thetaLimit;     // the same, as an angle from z
+
+	public:
+
+		// construct
+		PlaneSampler(const CompactPlane& plane, double cosLimit);
+
+		// const methods
+		template<typename Engine>
+		CompactPlane sample(Engine& engine, double x, double y,
+				double minZ, double maxZ, double deltaAng) const;
+
+		// other methods
+		void setPlane(const CompactPlane& plane);
+
+};
+
+
+/*****************************************************************************
+* > sample()                                                                 *
+* Returns a random plane: the value at (x,y) is uniform in [minZ, maxZ], the *
+* normal n is at most deltaAng degrees from the current normal, with         *
+* n_z >= cosLimit. The angle from the current normal is sampled as in a      *
+* uniform spherical cap; then the rotation around it is uniform in the arc   *
+* that respects the slope limit. So the distribution is approximately, not   *
+* exactly, uniform in the intersection: denser near the slope limit.         *
+* If the current normal is beyond the slope limit and no rotation of the     *
+* sampled angle meets it, the normal is taken towards z, with the angle      *
+* raised to reach the limit. If the cone can't reach it, the angle is the    *
+* maximum: the closest normal of the cone, and the only case with            *
+* n_z < cosLimit.                                                            *
+*                                                                            *
+* Args:                                                                      *
+*   engine (Engine&): a random engine, as RandomDevice::engine               *
+*   x (double), y (double): the point                                        *
+*   minZ (double), maxZ (double): range of the value at (x,y)                *
+*   deltaAng (double): max angle of the new normal from the current one, in  *
+*       degrees, in (0,90)                                                   *
+*                                                                            *
+* Returns:                                                                   *
+*   (CompactPlane): the new plane                                            *
+*****************************************************************************/
+template<typename Engine>
+CompactPlane PlaneSampler::sample(Engine& engine, double x, double y,
+		double minZ, double maxZ, double deltaAng) const {
+
+	const double PI = std::acos(-1.0);
+	std::uniform_real_distribution<double> uniform01;
+
+	// Angle from m. No normal beyond thetaLimit + alpha can be valid
+	double alpha = std::acos(mZ);          // angle of m from z
+	double thetaMax = deltaAng / 180 * PI;
+	if (thetaMax > thetaLimit + alpha) {
+		thetaMax = thetaLimit + alpha;
+	}
+	double cosTheta = 1 - uniform01(engine) * (1 - std::cos(thetaMax));
+	double sinTheta = std::sqrt(1 - cosTheta * cosTheta);
+
+	// m beyond the limit, and even towards z (phi = 0) too far from it
+	if (alpha > thetaLimit && cosTheta * mZ + sinTheta * sinMZ < cosLimit) {
+		double theta = std::min(thetaMax, alpha - thetaLimit);
+		cosTheta = std::cos(theta);
+		sinTheta = std::sin(theta);
+	}
+
+	// Rotation around m, phi = 0 towards z. Here n_z is
+	// cosTheta * mZ + sinTheta * sinMZ * cos(phi) >= cosLimit
+	double phiMax;
+	double den = sinTheta * sinMZ;
+	if (den < 1e-12) {
+		phiMax = (cosTheta * mZ >= cosLimit) ? PI : 0;
+	} else {
+		double minCos = (cosLimit - cosTheta * mZ) / den;
+		phiMax = (minCos <= -1) ? PI : (minCos >= 1) ? 0 : std::acos(minCos);
+	}
+	double phi = (2 * uniform01(engine) - 1) * phiMax;
+
+	Vector3d n = cosTheta * m +
+			sinTheta * (std::cos(phi) * toZ + std::sin(phi) * side);
+
+	// Plane through (x, y, z) with normal n
+	double z = minZ + uniform01(engine) * (maxZ - minZ);
+	double a = -n(0) / n(2);
+	double b = -n(1) / n(2);
+
+	return CompactPlane(a, b, z - a * x - b * y);
+}
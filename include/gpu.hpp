@@ -0,0 +1,30 @@
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+
+/****************************************************************************
+* > struct GpuView                                                          *
+* A view of a stereo pair, for the GPU backend. Input: the pixels, packed   *
+* as StereoImage::pixels, by rows. Output of gpuMatch(): the plane of each  *
+* pixel (a, b, c; by rows), its window cost, and the invalid pixels of the  *
+* consistency check (non zero).                                             *
+****************************************************************************/
+struct GpuView {
+
+	// Layout of each pixel: as StereoImage::Channel
+	enum Channel { RED, GREEN, BLUE, GRAD_X, GRAD_Y };
+
+	const float* pixels;
+	size_t pixelStride;          // floats of each pixel
+	std::vector<float> planes;
+	std::vector<float> costs;
+	std::vector<unsigned char> invalid;
+};
+
+
+// The GPU backend. See gpu.cpp and, with SPMATCH_CUDA, cuda/gpu.cu
+bool gpuAvailable(void);
+void gpuMatch(size_t width, size_t height, GpuView& left, GpuView& right);
@@ -13,6 +13,20 @@ using std::string;
 using namespace cimg_library;
 
 
+/*************************************************************************
+* > struct ImageBuffer                                                   *
+* An image in memory, not owned: 8 bit pixels, with interleaved channels *
+* (RGB or Grayscale). Each row is 'rowStride' bytes after the previous.  *
+*************************************************************************/
+struct ImageBuffer {
+	const unsigned char* data;
+	size_t width;
+	size_t height;
+	size_t channels;
+	size_t rowStride;            // in bytes; at least width * channels
+};
+
+
 /*******************************************************************
 * > class Image                                                    *
 * A wrapper class for the CImg type.                               *
@@ -36,6 +50,7 @@ class Image {
 
 		// constr
 		explicit Image(const string& imgPath);
+		explicit Image(const ImageBuffer& buffer);
 		explicit Image(size_t width, size_t height, size_t channels);
 		explicit Image(size_t width, size_t height, size_t channels, double val);
 		explicit Image(const Image&) = default;
@@ -52,8 +67,11 @@ class Image {
 		void display(void) const { img.display(); }
 		void write(void) const { img.save(imgPath.c_str()); }
 		Image toGrayscale(void) const;
+		Image resized(size_t width, size_t height) const;
 
 		// methods
+		Image& load(const string& imgPath);
+		Image& load(const ImageBuffer& buffer);
 		Image& setPath(const string& path) { imgPath = path; return *this; }
 		Image& normalize(void) { img.normalize(0, 255); return *this; }
 
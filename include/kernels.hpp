@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+
+#include "params.hpp"
+
+
+// Max number of planes of a WindowTask
+const size_t MAX_WINDOW_PLANES = 8;
+
+
+/*************************************************************************
+* > struct WindowPlane                                                   *
+* A disparity plane d(x,y) = a*x + b*y + c, and its window: planes can   *
+* have windows of different sizes (see Params::RESIZE_WINDOWS).          *
+*************************************************************************/
+struct WindowPlane {
+	double a, b, c;
+	size_t minW, maxW;           // window extremes (included)
+	size_t minH, maxH;
+};
+
+
+/***************************************************************************
+* > struct WindowTask                                                      *
+* The input of a vectorized window cost: the windows of pixel (w,h) in     *
+* this view, matched against the other view with each of the 'nPlanes'     *
+* planes. All the planes are scored in the same pass on the union of their *
+* windows: pixels and weights of this view are loaded once.                *
+* Pixels are packed as in StereoImage::pixels.                             *
+* 'weights' points at the weight of (minW, minH), and each row of weights  *
+* is 'weightsStride' elements after the previous one.                      *
+* The sum of a plane can stop early if its cost can't be lower than        *
+* 'bound'.                                                                 *
+***************************************************************************/
+struct WindowTask {
+	const float* pixels;         // this view
+	const float* otherPixels;    // the other view
+	size_t width;                // of this view
+	size_t otherWidth;           // of the other view
+	const double* weights;
+	size_t weightsStride;
+	size_t minW, maxW;           // union of the windows (included)
+	size_t minH, maxH;
+	size_t nPlanes;              // in [1, MAX_WINDOW_PLANES]
+	WindowPlane planes[MAX_WINDOW_PLANES];
+	int sign;                    // the other pixel is at x + sign * d(x,y)
+	double bound;                // infinity: never stop
+};
+
+
+/*************************************************************************
+* > struct WindowSum                                                     *
+* The output of a vectorized window cost, for each plane: the weighted   *
+* sum of the costs, and the number of pixels with a valid cost. If       *
+* 'outOfBounds' is true, the window met an out-of-bounds pixel with      *
+* OutOfBounds::ERROR, and no sum is valid. If 'stopped' is true for a    *
+* plane, its sums are partial and its cost is not lower than             *
+* WindowTask::bound.                                                     *
+*************************************************************************/
+struct WindowSum {
+	double cost[MAX_WINDOW_PLANES];
+	long count[MAX_WINDOW_PLANES];
+	bool stopped[MAX_WINDOW_PLANES];
+	bool outOfBounds;
+};
+
+
+// A vectorized window cost. See kernels.cpp
+typedef WindowSum (*WindowKernel)(const WindowTask& task);
+
+WindowKernel selectWindowKernel(Params::Kernel choice);
@@ -2,47 +2,165 @@
 #pragma once
 
 #include <random>
+#include <vector>
+#include <cstdint>
 
 #include "params.hpp"
 
 
-/***********************************************************
-* > class RandomDevice                                     *
-* A single-instance class that serves as the global random *
-* numbers generator.                                       *
-***********************************************************/
-class RandomDevice {
+/****************************************************************************
+* > class CounterRandom                                                     *
+* A counter-based random engine, Philox4x32-10 (Salmon et al., "Parallel    *
+* random numbers: as easy as 1, 2, 3"): each block of 4 numbers is a        *
+* function of a 64 bit key and of a 128 bit counter, without a state to     *
+* carry. So a stream is identified by the key and by 3 words of the         *
+* counter (see seek()), and it is the same on any thread, in any order.     *
+* The 4th word counts the blocks of the stream. A UniformRandomBitGenerator *
+* for the distributions of <random>.                                        *
+****************************************************************************/
+class CounterRandom {
+
+	public:
+
+		typedef uint32_t result_type;
+
+	private:
+
+		uint32_t key[2];
+		uint32_t counter[4];
+		uint32_t block[4];           // the numbers of the current block
+		unsigned next;               // the next number in 'block'
 
 	private:
 
-		std::random_device device;
+		// private methods
+		void nextBlock(void);
+
+	public:
+
+		// constr
+		explicit CounterRandom(uint64_t seed = 0) { seek(seed, 0, 0, 0); }
+
+		// static methods
+		static constexpr result_type min(void) { return 0; }
+		static constexpr result_type max(void) { return UINT32_MAX; }
+
+		// methods
+		void seek(uint64_t seed, uint32_t c0, uint32_t c1, uint32_t c2) {
+			key[0] = uint32_t(seed);
+			key[1] = uint32_t(seed >> 32);
+			counter[0] = c0;
+			counter[1] = c1;
+			counter[2] = c2;
+			counter[3] = 0;
+			next = 4;
+		}
+
+		// operators
+		result_type operator()(void) {
+			if (next == 4) { nextBlock(); }
+			return block[next++];
+		}
+};
+
+
+/****************************************************************************
+* > class RandomDevice                                                      *
+* A single-instance class that serves as the global random numbers          *
+* generator. There is one instance for each thread, without locks.          *
+* The engine draws from the stream selected by the last seek(): callers     *
+* select the stream of what they are computing (e.g. a pixel and an         *
+* iteration, see StereoImage::seekRandom()), so the numbers don't depend on *
+* the thread or on the order. Seeds come from newSeed().                    *
+****************************************************************************/
+class RandomDevice {
+
+	public:
+
+		// Seed of params.USE_PSEUDORAND
+		static const uint64_t DEFAULT_SEED = 0x53504d6174636821ULL;
 
 	public:
 
-		std::default_random_engine engine;
+		CounterRandom engine;
 
 	private:
 
 		// Can't instantiate directly
-		RandomDevice(void) {
-			if (!params.USE_PSEUDORAND) {
-				engine.seed(device());
-			}
-		}
+		RandomDevice(void): engine(newSeed()) {}
 
 	public:
 
 		RandomDevice(const RandomDevice&) = delete;
 		void operator=(const RandomDevice&) = delete;
 
-		// Getter of the global object
+		// Getter of the global object of this thread
 		static RandomDevice& getGenerator(void) {
-			static RandomDevice generator;
+			static thread_local RandomDevice generator;
 			return generator;
 		}
+
+		// Selects a stream of the engine of this thread. See CounterRandom
+		static void seek(uint64_t seed, uint32_t c0, uint32_t c1, uint32_t c2) {
+			getGenerator().engine.seek(seed, c0, c1, c2);
+		}
+
+		// A seed: DEFAULT_SEED with params.USE_PSEUDORAND, otherwise random
+		static uint64_t newSeed(void) {
+			if (params.USE_PSEUDORAND) { return DEFAULT_SEED; }
+			std::random_device device;
+			return (uint64_t(device()) << 32) | device();
+		}
 };
 
 
 // see .cpp
 double weightedMedian(const std::vector<double>& values,
 		const std::vector<double>& weights); 
+void boxFilter(const std::vector<float>& in, size_t width, size_t height,
+		unsigned radius, std::vector<float>& out);
+
+
+/****************************************************************************
+* > class JointHistogram                                                    *
+* Joint histogram of (colour, value) pairs, for a constant-time weighted    *
+* median: the values of a window are added and removed as the window        *
+* slides, and the median is computed over the bins, not over the pixels.    *
+* Colours and values are quantized by the caller, into colourBins and       *
+* valueBins bins. The weight of a pixel depends on its colour bin only:     *
+* exp(-|colour - mean|/gamma), where mean is the mean RGB colour of the     *
+* pixels of that bin, in the window. See the comments in .cpp file.         *
+****************************************************************************/
+class JointHistogram {
+
+	public:
+
+		static const size_t BLOCK = 16;  // value bins of each block
+
+	private:
+
+		size_t colourBins;
+		size_t valueBins;
+		size_t blocks;
+
+		std::vector<unsigned> counts;        // colourBins x valueBins
+		std::vector<unsigned> blockCounts;   // colourBins x blocks
+		std::vector<unsigned> colourCounts;
+		std::vector<double> colourSums;      // colourBins x 3 (RGB)
+		std::vector<double> weights;         // of the last median()
+		std::vector<double> sums;            // of the last median()
+
+	public:
+
+		// constr
+		JointHistogram(size_t colourBins, size_t valueBins);
+
+		// const methods
+		bool empty(void) const;
+
+		// methods
+		void reset(size_t colourBins, size_t valueBins);
+		void add(size_t colour, size_t value, const float* rgb);
+		void remove(size_t colour, size_t value, const float* rgb);
+		size_t median(const float* rgb, double gamma);
+};
@@ -0,0 +1,89 @@
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "image.hpp"
+
+
+/****************************************************************************
+* > enum class OutputFormat                                                 *
+* File formats of the floating point maps (disparities, planes and costs).  *
+*   CSV: text, one "w, h, values..." line per pixel, by columns             *
+*   PFM: portable float map, little endian                                  *
+*   RAW: float32 little endian, row-major, channels interleaved, after a    *
+*       RawHeader                                                           *
+*   MMAP: as RAW, written through a memory-mapped file                      *
+****************************************************************************/
+enum class OutputFormat { CSV, PFM, RAW, MMAP };
+
+
+/*************************************************************************
+* > struct RawHeader                                                     *
+* The header of a RAW map: 20 bytes, each field as a little endian       *
+* uint32. The pixels follow: width * height * channels float32.          *
+*************************************************************************/
+struct RawHeader {
+	static const uint32_t MAGIC = 0x524d5053;   // "SPMR" on disk
+	static const uint32_t VERSION = 1;
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t channels;
+};
+
+
+/****************************************************************************
+* > class FloatMap                                                          *
+* A map of float32 values (channels interleaved, row major) for maps too    *
+* big to keep as an Image: in memory, or mapped onto a RAW file, where      *
+* set() writes in place (as writeFloatMap() with MMAP). A mapped map has no *
+* memory of its own: its pages go to the file. See TiledStereo.             *
+****************************************************************************/
+class FloatMap {
+
+	private:
+
+		size_t width = 0;
+		size_t height = 0;
+		size_t channels = 1;
+
+		std::vector<float> values;     // in memory
+		char* mapped = nullptr;        // or the RAW file: header, pixels
+		size_t mappedSize = 0;
+
+	public:
+
+		// constr
+		FloatMap(void) = default;
+		FloatMap(size_t width, size_t height, size_t channels);
+		FloatMap(size_t width, size_t height, size_t channels,
+				const string& rawPath);
+		FloatMap(const FloatMap&) = delete;
+		FloatMap(FloatMap&& other) { *this = std::move(other); }
+		~FloatMap();
+
+		// const methods
+		size_t size(unsigned dim) const;
+		bool isMapped(void) const { return mapped != nullptr; }
+		float get(size_t w, size_t h, size_t c = 0) const;
+
+		// methods
+		void set(size_t w, size_t h, size_t c, float value);
+
+		// operators
+		FloatMap& operator=(const FloatMap&) = delete;
+		FloatMap& operator=(FloatMap&& other);
+};
+
+
+// see .cpp
+string outputExtension(OutputFormat format);
+void writeFloatMap(const Image& map, const string& path, OutputFormat format);
+void writeFloatMap(const FloatMap& map, const string& path,
+		OutputFormat format);
+void writeNormalizedImage(const FloatMap& map, const string& path);
@@ -0,0 +1,155 @@
+
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <future>
+
+#include "params.hpp"
+
+
+/*****************************************************************************
+* > class ThreadPool                                                         *
+* A fixed set of worker threads that run parallel loops. The thread calling  *
+* parallelFor() also works on the loop, so a pool of size 1 has no workers   *
+* and every loop runs sequentially on the calling thread.                    *
+* Workers run each loop with the params of the calling thread.               *
+* Starting a loop doesn't allocate memory: the body is not copied.           *
+* See the comments in .cpp file.                                             *
+*****************************************************************************/
+class ThreadPool {
+
+	private:
+
+		// A loop body, not owned: the callable and a function calling it
+		struct Body {
+			const void* callable;
+			void (*call)(const void* callable, size_t i);
+		};
+
+	private:
+
+		std::vector<std::thread> workers;
+
+		std::mutex mutex;
+		std::condition_variable wakeUp;
+		std::condition_variable done;
+
+		// Current job
+		Body job = { nullptr, nullptr };
+		Params jobParams;            // params of the caller
+		std::atomic<size_t> next;
+		size_t jobEnd = 0;
+		size_t chunk = 1;
+		unsigned generation = 0;     // incremented for each job
+		unsigned running = 0;        // workers still on the current job
+		bool stopping = false;
+		std::exception_ptr error;
+
+	private:
+
+		// private methods
+		void workerLoop(void);
+		void runChunks(void);
+		void runLoop(size_t begin, size_t end, Body body);
+
+	public:
+
+		// constr
+		explicit ThreadPool(unsigned nThreads);
+		ThreadPool(const ThreadPool&) = delete;
+		~ThreadPool();
+
+		// const methods
+		unsigned size(void) const { return workers.size() + 1; }
+
+		// methods
+		template<typename F>
+		void parallelFor(size_t begin, size_t end, const F& body);
+
+		// operators
+		ThreadPool& operator=(const ThreadPool&) = delete;
+};
+
+
+/***************************************************************************
+* > parallelFor()                                                          *
+* Calls body(i) for each i in [begin, end), in parallel. Indices are       *
+* assigned in small chunks, in increasing order, to balance the load.      *
+* Returns when all calls are done. If any call throws, the first exception *
+* is rethrown here.                                                        *
+* NOTE: calling parallelFor() inside body on the same pool is not allowed. *
+*                                                                          *
+* Args:                                                                    *
+*   begin (size_t): the first index                                        *
+*   end (size_t): one past the last index                                  *
+*   body (F): the loop body, a callable with a size_t argument. Not copied *
+***************************************************************************/
+template<typename F>
+void ThreadPool::parallelFor(size_t begin, size_t end, const F& body) {
+
+	runLoop(begin, end, { &body, [] (const void* callable, size_t i) {
+		(*static_cast<const F*>(callable))(i);
+	} });
+}
+
+
+/****************************************************************************
+* > class ProgressCounter                                                   *
+* Counts the items completed by a producer, in order. Items are numbered    *
+* from 0 and can be marked done out of order, but only within a window of   *
+* the next 'window' items. Consumers wait until the first n items are done. *
+* See the comments in .cpp file.                                            *
+****************************************************************************/
+class ProgressCounter {
+
+	private:
+
+		std::mutex mutex;
+		std::condition_variable changed;
+
+		size_t count = 0;            // the first 'count' items are done
+		std::vector<bool> done;      // ring buffer of the next items
+		bool aborted = false;
+
+	public:
+
+		// constr
+		explicit ProgressCounter(size_t window);
+		ProgressCounter(const ProgressCounter&) = delete;
+
+		// methods
+		void markDone(size_t item);
+		void waitFor(size_t n);
+		void abort(void);
+
+		// operators
+		ProgressCounter& operator=(const ProgressCounter&) = delete;
+};
+
+
+/**************************************************************************
+* > asyncWithParams()                                                     *
+* As std::async with std::launch::async, but the task runs with the       *
+* params of the calling thread.                                           *
+*                                                                         *
+* Args:                                                                   *
+*   task (F): a callable without arguments, copied                        *
+*                                                                         *
+* Returns:                                                                *
+*   (future): the result of task()                                        *
+**************************************************************************/
+template<typename F>
+auto asyncWithParams(F task) -> std::future<decltype(task())> {
+
+	Params callerParams = params;
+	return std::async(std::launch::async, [callerParams, task] () mutable {
+		params = callerParams;
+		return task();
+	});
+}
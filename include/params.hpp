@@ -11,19 +11,30 @@ struct Params {
 	// Def
 	enum class OutOfBounds { REPEAT_PIXEL, BLACK_PIXEL, ZERO_COST, ERROR,
 			NAN_COST };
+	enum class Schedule { WAVEFRONT, RED_BLACK };
+	enum class Kernel { AUTO, SCALAR, AVX2, AVX512, NEON };
+	enum class Median { EXACT, HISTOGRAM };
 	
 	// Math constants
 	double ALFA;
 	double TAU_COL;
 	double TAU_GRAD;
 	double GAMMA;
+	double GUIDED_EPS;             // Regularization of the guided filter
 
 	// Range parameters
 	unsigned WINDOW_SIZE;          // Must be an odd number
 	int MIN_D;
 	int MAX_D;
 	unsigned ITERATIONS;
+	unsigned PYRAMID_LEVELS;       // 1 means no pyramid
+	unsigned FINE_ITERATIONS;      // Iterations at full size, with the pyramid
+	unsigned TEMPORAL_ITERATIONS;  // Iterations of the next frames of a video
+	double TEMPORAL_RANDOM;        // Random planes mixed in the next frames
 	double MAX_SLOPE;              // Max slope of the window
+	unsigned REFINE_CANDIDATES;    // Planes tried at each refinement step
+	double CONVERGENCE;            // Stop below this fraction of changed planes
+	bool ACTIVE_PIXELS;            // Revisit only the pixels near a change
 
 	// Flag parameters
 	bool NORMALIZE_GRADIENTS;      // With this false, TAU_GRAD must also change
@@ -32,8 +43,33 @@ struct Params {
 	bool PLANES_SATURATION;
 	bool USE_PSEUDORAND;
 	bool CONST_DISPARITIES;
+	bool COST_VOLUME;              // Initial planes from a filtered cost volume
+	unsigned WEIGHTS_CACHE_MB;     // Memory cap of the weights caches of a pair. 0 is off
+	unsigned COST_CACHE_MB;        // Memory cap of the cost tables of a pair. 0 is off
+	unsigned COST_CACHE_STEPS;     // Entries of the cost table per disparity
+	Kernel KERNEL;                 // Implementation of the window cost
+	Median MEDIAN;                 // Weighted median of the post processing
+	unsigned MEDIAN_BINS;          // Disparity bins of Median::HISTOGRAM
+	bool FUSED_POSTPROCESS;        // Post processing in one pass, confidence
+
+	// Parallel parameters
+	unsigned THREADS;              // 0 means all hardware threads
+	Schedule SCHEDULE;             // Order of the pixels in each iteration
+	bool PARALLEL_VIEWS;           // Process left and right views together
+	bool GPU;                      // Iterations on the GPU. See gpu.hpp
+	unsigned TILE_SIZE;            // Side of the tiles. 0: none. See tiles.hpp
+	unsigned TILE_JOBS;            // Tiles matched at the same time
 	int LOG;                       // {0,...,3}. 0 means off
 
 };
 
-extern Params params;		// defined and set in spmatch.cpp
+// The parameters of the current thread. Threads of a ThreadPool job, and
+// the tasks of asyncWithParams(), take the params of the caller: so that
+// two configurations can run at the same time (see Engine).
+// NOTE: __thread rather than thread_local: Params is trivial, and this
+//   avoids an initialization check at each access.
+extern __thread Params params;      // defined in params.cpp
+
+// see .cpp
+Params defaultParams(void);
+void checkParams(const Params& p);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "image.hpp"
+
+
+/****************************************************************************
+* > struct RemoteResult                                                     *
+* The reply of a remote worker (see remoteCompute()): the row major maps of *
+* the two views, as StereoImagePair::computeDisparity(), and with 'planes'  *
+* getPlanesMaps() and getCostsMaps(). Channels are interleaved.             *
+****************************************************************************/
+struct RemoteResult {
+	size_t width = 0;
+	size_t height = 0;
+	std::vector<float> disparities[2];   // left, right: 1 value per pixel
+	std::vector<float> planes[2];        // 3 values per pixel, if asked
+	std::vector<float> costs[2];         // 1 value per pixel, if asked
+};
+
+
+// see .cpp
+Image toImage(const std::vector<float>& values, size_t width, size_t height,
+		size_t channels);
+RemoteResult remoteCompute(const string& address, const ImageBuffer& left,
+		const ImageBuffer& right, bool planes, size_t w0, size_t h0,
+		size_t frameWidth);
+void serveWorker(unsigned short port, const string& bindAddress);
@@ -0,0 +1,77 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <iostream>
+
+
+/****************************************************************************
+* > class Stats                                                             *
+* Counters and timers of the steps of PatchMatch Stereo, for each view.     *
+* The hooks in the hot paths are compiled only with SPMATCH_STATS (CMake    *
+* option of the same name): see SPMATCH_COUNT. Otherwise, all counters are  *
+* zero and no sweep is recorded.                                            *
+* Each thread adds to its own counters; at the end of each sweep of a view, *
+* the counters of all the threads are summed and the difference from the    *
+* previous sweep of that view is recorded.                                  *
+* NOTE: the statistics are of the whole process: with two engines running   *
+*   at the same time, their sweeps are mixed.                               *
+* See the comments in .cpp file.                                            *
+****************************************************************************/
+class Stats {
+
+	public:
+
+		enum Counter {
+			PIXELS,                  // processed pixels
+			SPATIAL_ACCEPTED,        // pixels changed by each step
+			VIEW_ACCEPTED,
+			REFINEMENT_ACCEPTED,
+			SPATIAL_NS,              // time of each step, in nanoseconds
+			VIEW_NS,
+			REFINEMENT_NS,
+			REFINEMENT_SAMPLES,      // planes sampled by the refinement
+			WINDOW_COSTS,            // calls of pixelWindowCosts()
+			WINDOW_PLANES,           // planes scored by those calls
+			COUNTERS
+		};
+
+		static const char* const COUNTER_NAMES[COUNTERS];
+
+		// A sweep of one view: the counters of that sweep only
+		struct Sweep {
+			unsigned iteration;
+			unsigned view;           // StereoImage::Side
+			size_t width;
+			size_t height;
+			double seconds;          // wall time
+			uint64_t counts[COUNTERS];
+		};
+
+		static const bool ENABLED;   // compiled with SPMATCH_STATS
+
+	private:
+
+		struct ThreadCounters;       // see .cpp
+
+	public:
+
+		// static methods
+		static void add(unsigned view, Counter counter, uint64_t n);
+		static void endSweep(unsigned view, unsigned iteration, size_t width,
+				size_t height, double seconds);
+		static std::vector<Sweep> sweeps(void);
+		static void clear(void);
+		static void printTable(std::ostream& out);
+		static void writeJson(std::ostream& out);
+};
+
+
+// Hot path hooks: Stats::add(), only with SPMATCH_STATS. The arguments are
+// not evaluated otherwise
+#ifdef SPMATCH_STATS
+#define SPMATCH_COUNT(view, counter, n) Stats::add(view, counter, n)
+#else
+#define SPMATCH_COUNT(view, counter, n) ((void)sizeof(n))
+#endif
@@ -1,8 +1,16 @@
 
 #pragma once
 
+#include <memory>
+#include <limits>
+
 #include "image.hpp"
 #include "grid.hpp"
+#include "cache.hpp"
+#include "parallel.hpp"
+#include "kernels.hpp"
+#include "params.hpp"
+#include "gpu.hpp"
 
 
 /******************************************************************************
@@ -19,53 +27,171 @@ class StereoImage {
 
 		enum Side { LEFT, RIGHT };
 
+		// Layout of each pixel in 'pixels'
+		enum Channel { RED, GREEN, BLUE, GRAD_X, GRAD_Y, PIXEL_CHANNELS };
+		static const size_t PIXEL_STRIDE = 8;
+
+	private:
+
+		// The random streams of each pixel. See seekRandom()
+		enum RandomStream { INIT_STREAM, MIX_STREAM, REFINE_STREAM };
+
+		// An instance of windowCost(). See windowCostFor()
+		typedef void (StereoImage::*WindowCostFn)(size_t w, size_t h,
+				const CompactPlane* planes, size_t nPlanes, double bound,
+				double* costs) const;
+
 	private:
 
 		Image image;
-		Image gradientX;
-		Image gradientY;
+
+		// Image and gradients, interleaved. See packPixels()
+		std::vector<float> pixels;
 
 		size_t width;
 		size_t height;
-		Grid<PlaneFunction> disparityPlanes;
+		Grid<CompactPlane> disparityPlanes;
+		Grid<float> planeCosts;       // see planeCost()
 
 		Side side;
 		StereoImage* other = nullptr;	
 
+		// Random numbers: see seekRandom()
+		uint64_t randomSeed;
+		unsigned frame = 0;           // frames loaded after the first
+		size_t originW = 0;           // of this image in the frame, and
+		size_t originH = 0;           // width of the frame: see
+		size_t frameWidth;            // setFrameOrigin()
+
+		// Adaptive weights of each window. See windowWeights()
+		std::unique_ptr<SlotCache<double>> weightsCache;
+
+		// Costs of each pixel at quantized disparities. See windowCost()
+		std::unique_ptr<CostTable> costTable;
+
+		// Vectorized window cost. nullptr: scalar. See pixelWindowCost()
+		WindowKernel windowKernel;
+		WindowCostFn windowCostFn;
+
+		// Columns of the other view matching each pixel, by row.
+		// See indexViewCandidates()
+		std::vector<unsigned> candidatesStart;  // width+1 offsets per row
+		std::vector<unsigned> candidates;       // width entries per row
+		std::vector<char> indexedRows;
+
+		// Pixels to process and pixels changed in the current iteration.
+		// Empty if not used. See resetActivePixels()
+		std::vector<char> activePixels;
+		std::vector<char> changedPixels;
+
+		// Disparities of the planes, for the post processing. Reused by the
+		// next frames. See processFinalDisparityMap()
+		Image disparityMap;
+
+		// Invalid pixels and confidence of the fused post processing.
+		// See checkRow()
+		Image invalidMap;
+		Image confidenceMap;
+
 	private:
 
 		// private const methods
+		const float* pixelAt(size_t w, size_t h) const {
+			return &pixels[(h * width + w) * PIXEL_STRIDE];
+		}
+		template<Params::OutOfBounds OUT_OF_BOUNDS, bool PLANES_SATURATION>
 		double pixelDissimilarity(size_t w, size_t h,
-				const PlaneFunction& disparity) const;
+				const CompactPlane& disparity) const;
 		double adaptiveWeight(size_t w1, size_t h1, size_t w2, size_t h2) const;
-		double pixelWindowCost(size_t w, size_t h, const PlaneFunction& d) const;
+		void windowWeights(size_t w, size_t h, double* weights) const;
+		double pixelWindowCost(size_t w, size_t h, const CompactPlane& d,
+				double bound = std::numeric_limits<double>::infinity()) const;
+		void pixelWindowCosts(size_t w, size_t h, const CompactPlane* planes,
+				size_t nPlanes, double bound, double* costs) const;
+		template<Params::OutOfBounds OUT_OF_BOUNDS, bool PLANES_SATURATION,
+				bool RESIZE_WINDOWS>
+		void windowCost(size_t w, size_t h, const CompactPlane* planes,
+				size_t nPlanes, double bound, double* costs) const;
 		double disparityAt(size_t w, size_t h) const;
-		Image getInvalidPixelsMap(void) const;
-		Image wMedianFilterAtDisparity(const Image& disp, const Image& map) const;
+		CompactPlane randomPlane(size_t w, size_t h) const;
+		bool isActive(size_t w, size_t h, unsigned iteration) const;
+		long viewTarget(size_t oW, size_t h) const;
+		long matchingColumn(size_t w, double d) const;
+		void seekRandom(size_t w, size_t h, RandomStream stream,
+				unsigned round) const;
+		Image wMedianFilterAtDisparity(const Image& disp, const Image& map,
+				ThreadPool* pool = nullptr) const;
+		void wMedianFilterRow(const Image& disp, const Image& map, size_t h,
+				Image& out) const;
+		void histogramMedianRow(const Image& disp, const Image& map, size_t h,
+				const std::vector<unsigned short>& bins,
+				const std::vector<unsigned char>& colours, Image& out) const;
+
+		// private static methods
+		static WindowCostFn windowCostFor(Params::OutOfBounds outOfBounds,
+				bool saturation, bool resize);
+		template<Params::OutOfBounds OUT_OF_BOUNDS>
+		static WindowCostFn windowCostFor(bool saturation, bool resize);
 
 		// private methods
+		void packPixels(void);
+		void frameChanged(void);
+		double planeCost(size_t w, size_t h);
 		void fillInvalidPlanes(const Image& invalid);
 
+		// The benchmark times the private stages too. See bench/bench.cpp
+		friend struct BenchStages;
+
 	public:
 
 		// constr
 		StereoImage(const string& imgPath, Side side);
+		StereoImage(Image&& img, Side side);
 		explicit StereoImage(const StereoImage&) = default;
 		StereoImage(StereoImage&&) = default;
 
 		// const methods
 		void displayGradients(void) const;
 		pair<size_t, size_t> size(void) const { return { width, height }; }
+		Side getSide(void) const { return side; }
 		Image getDisparityMap(void) const;
+		Image getPlanesMap(void) const;
+		Image getCostsMap(void) const;
+		Image getInvalidPixelsMap(void) const;
+		Image getConfidenceMap(void) const { return Image(confidenceMap); }
+		StereoImage downscaled(void) const;
+		double changedFraction(void) const;
+		GpuView toGpuView(void) const;
 
 		// methods
 		void bind(StereoImage* o);
+		void allocateCaches(void);
+		void releaseCaches(void);
+		void setFrameOrigin(size_t w0, size_t h0, size_t frameWidth);
 		void unbind(void);
 		void setRandomDisparities(void);
+		void setAggregatedDisparities(ThreadPool& pool);
+		void upsamplePlanes(const StereoImage& coarse);
+		void loadFrame(const string& imgPath);
+		void loadFrame(const ImageBuffer& frame);
+		void mixRandomPlanes(double fraction);
+		void indexViewCandidates(size_t h);
+		void clearViewCandidates(void);
 		bool pixelSpatialPropagation(size_t w, size_t h, unsigned iteration);
 		bool pixelViewPropagation(size_t w, size_t h);
-		bool planeRefinement(size_t w, size_t h);
-		Image processFinalDisparityMap(void);
+		bool planeRefinement(size_t w, size_t h, unsigned iteration = 0);
+		void processPixel(size_t w, size_t h, unsigned iteration);
+		void resetActivePixels(void);
+		void updateActivePixels(void);
+		void clearChangedPixels(void);
+		void setPlanes(const GpuView& view);
+		Image processFinalDisparityMap(ThreadPool* pool = nullptr);
+		Image processFinalDisparityMap(const Image& invalid,
+				ThreadPool* pool = nullptr);
+		void mapDisparityRow(size_t h);
+		void checkRow(size_t h);
+		void fillRow(size_t h);
+		Image filterFinalDisparityMap(ThreadPool* pool = nullptr);
 };
 
 
@@ -73,10 +199,25 @@ class StereoImage {
 * > class StereoImagePair                                                 *
 * Represents a couple of StereoImages. The method computeDisparity()      *
 * returns two disparity images computed with PatchMatch Stereo algorithm. *
+* With params.PYRAMID_LEVELS > 1, the planes are initialized from a pair  *
+* at half the resolution. See initializePlanes().                         *
 * See .cpp file                                                           *
 **************************************************************************/
 class StereoImagePair {
 	
+	private:
+
+		// Rows synchronization of a sweep with the other view.
+		// See computeDisparity()
+		struct RowSync {
+			ProgressCounter* own;      // rows done by this sweep
+			ProgressCounter* other;    // rows to wait for. nullptr: no wait
+			size_t base;               // the first row of this sweep
+
+			void waitRow(size_t r) const;
+			void doneRow(size_t r) const { own->markDone(base + r); }
+		};
+
 	private:
 
 		StereoImage leftImg;
@@ -85,12 +226,46 @@ class StereoImagePair {
 		size_t width;
 		size_t height;
 
+		ThreadPool pool;
+		std::unique_ptr<ThreadPool> rightPool;   // only with PARALLEL_VIEWS
+
+	private:
+
+		// private methods
+		void sweepView(StereoImage& image, unsigned iteration, ThreadPool& pool,
+				const RowSync* sync = nullptr);
+		void sweepSequential(StereoImage& image, unsigned iteration,
+				const RowSync* sync);
+		void sweepWavefront(StereoImage& image, unsigned iteration,
+				ThreadPool& pool, const RowSync* sync);
+		void sweepRedBlack(StereoImage& image, unsigned iteration,
+				ThreadPool& pool, const RowSync* sync);
+		bool initializePlanes(unsigned levels);
+		void iterate(unsigned iterations);
+		void iterateInParallel(unsigned first, unsigned count);
+		bool hasConverged(void);
+		pair<Image,Image> postProcess(void);
+		pair<Image,Image> processViews(void);
+		pair<Image,Image> processViewsInParallel(void);
+		void postProcessRow(size_t h);
+		pair<Image,Image> processViewsFused(void);
+		pair<Image,Image> computeOnGpu(void);
+
 	public:
 
 		// constr
 		StereoImagePair(const string& leftImgPath, const string& rightImgPath);
-		
+		StereoImagePair(StereoImage&& left, StereoImage&& right);
+
+		// const methods
+		pair<Image,Image> getPlanesMaps(void) const;
+		pair<Image,Image> getCostsMaps(void) const;
+		pair<Image,Image> getConfidenceMaps(void) const;
+
 		// methods
 		pair<Image,Image> computeDisparity(void);
+		void loadFrame(const string& leftImgPath, const string& rightImgPath);
+		void loadFrame(const ImageBuffer& left, const ImageBuffer& right);
+		pair<Image,Image> computeDisparityFromPrevious(void);
 
 };
@@ -0,0 +1,84 @@
+
+#pragma once
+
+#include <vector>
+
+#include "image.hpp"
+#include "decode.hpp"
+#include "output.hpp"
+#include "stereo.hpp"
+
+
+/*****************************************************************************
+* > class TiledStereo                                                        *
+* PatchMatch Stereo on a pair too big for a StereoImagePair: the frame is    *
+* split into tiles of params.TILE_SIZE pixels, each matched as an            *
+* independent pair with a halo around it, and the disparities of the tile    *
+* cores are stitched into the output. Only the 8 bit frames and the outputs  *
+* (float32 FloatMaps, or RAW files: see setOutput()) are kept for the whole  *
+* frame; everything else (gradients, pixels, planes, caches) is allocated    *
+* for one tile at a time, or params.TILE_JOBS tiles running at the same      *
+* time. The tiles can also be sent to remote workers: see setWorkers().      *
+* See the comments in .cpp file.                                             *
+*****************************************************************************/
+class TiledStereo {
+
+	public:
+
+		// A tile: [x0, x1) x [y0, y1), in frame coordinates
+		struct Tile {
+			size_t x0, y0, x1, y1;       // the core, saved in the output
+			size_t hx0, hy0, hx1, hy1;   // the core and its halo, matched
+		};
+
+	private:
+
+		DecodedImage leftFrame;
+		DecodedImage rightFrame;
+
+		size_t width;
+		size_t height;
+
+		// Stitched maps of the two views: left, right. See computeDisparity()
+		bool keepPlanes;
+		FloatMap disparities[2];
+		FloatMap planes[2];             // with keepPlanes
+		FloatMap costs[2];              // with keepPlanes
+
+		std::vector<string> workers;    // "<host>:<port>". See setWorkers()
+		string outputName;              // see setOutput()
+
+	private:
+
+		// private methods
+		ImageBuffer region(const DecodedImage& frame, const Tile& tile) const;
+		FloatMap newMap(size_t channels, const string& suffix) const;
+		void computeTile(const Tile& tile, const string* worker);
+		void stitchTile(const Tile& tile, const pair<Image,Image>& tileDisp,
+				const pair<Image,Image>* tilePlanes,
+				const pair<Image,Image>* tileCosts);
+
+	public:
+
+		// constr
+		TiledStereo(const string& leftImgPath, const string& rightImgPath,
+				bool keepPlanes = false);
+		TiledStereo(const TiledStereo&) = delete;
+
+		// const methods
+		pair<size_t, size_t> size(void) const { return { width, height }; }
+		std::vector<Tile> tiles(void) const;
+		const FloatMap& getDisparityMap(StereoImage::Side side) const {
+			return disparities[side];
+		}
+		const FloatMap& getPlanesMap(StereoImage::Side side) const;
+		const FloatMap& getCostsMap(StereoImage::Side side) const;
+
+		// methods
+		void setWorkers(const std::vector<string>& addresses);
+		void setOutput(const string& name);
+		void computeDisparity(void);
+
+		// operators
+		TiledStereo& operator=(const TiledStereo&) = delete;
+};
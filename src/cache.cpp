@@ -0,0 +1,58 @@
+
+#include "cache.hpp"
+
+
+// > class CostTable
+
+const float CostTable::UNKNOWN = -1;
+
+
+/**********************************************************************
+* > bytesFor()                                                        *
+* Args:                                                               *
+*   nKeys (size_t), minD (int), maxD (int), steps (unsigned): as in   *
+*       CostTable()                                                   *
+*                                                                     *
+* Returns:                                                            *
+*   (size_t): the memory of the table                                 *
+**********************************************************************/
+size_t CostTable::bytesFor(size_t nKeys, int minD, int maxD, unsigned steps) {
+
+	size_t length = size_t(maxD - minD) * steps + 1;
+	return nKeys * length * sizeof(std::atomic<float>);
+}
+
+
+/*************************************************************************
+* > CostTable()                                                          *
+* Constructor. Allocates the whole table. No entry is known initially.   *
+*                                                                        *
+* Args:                                                                  *
+*   nKeys (size_t): number of distinct keys, in [0, nKeys)               *
+*   minD (int), maxD (int): the range of the disparities. minD < maxD    *
+*   steps (unsigned): entries for each unit of disparity                 *
+*************************************************************************/
+CostTable::CostTable(size_t nKeys, int minD, int maxD, unsigned steps):
+		minD(minD), steps(steps),
+		length(size_t(std::max(maxD - minD, 0)) * steps + 1),
+		nKeys(nKeys), entries(new std::atomic<float>[nKeys * length]) {
+
+	if (maxD <= minD || steps == 0) {
+		throw std::invalid_argument("CostTable(). Empty range of disparities");
+	}
+	clear();
+}
+
+
+/**********************************************************************
+* > clear()                                                           *
+* Forgets all the entries, keeping the memory. Used when the costs    *
+* change, e.g. with a new image.                                      *
+* NOTE: not thread safe: no at() can be running.                      *
+**********************************************************************/
+void CostTable::clear(void) {
+
+	for (size_t i = 0; i < nKeys * length; ++i) {
+		entries[i].store(UNKNOWN, std::memory_order_relaxed);
+	}
+}
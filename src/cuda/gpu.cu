@@ -0,0 +1,525 @@
+/****************************************************************************
+* The GPU backend of StereoImagePair::computeDisparity(). Both views are    *
+* uploaded once; random initialization, the iterations and the consistency  *
+* check run on the device, and the planes, their costs and the invalid      *
+* pixels are copied back. The post processing stays on the CPU.             *
+* The iterations follow the checkerboard order of Params::Schedule::        *
+* RED_BLACK: each kernel launch processes the pixels of one colour of one   *
+* view, whose spatial neighbours are all of the other colour. So a launch   *
+* never reads what it writes. The steps of each pixel are those of the      *
+* CPU, with these differences:                                              *
+* - the spatial propagation tries the 4 neighbours at once;                 *
+* - the view propagation tries the plane of the matching pixel of the       *
+*   other view only, instead of all the pixels that match this one;         *
+* - the refinement perturbs the normal inside a cube of half side deltaN,   *
+*   halved at each step like deltaZ, and rejects normals over MAX_SLOPE     *
+*   (in radians there, as in planeRefinement(); in degrees for the random   *
+*   initialization, as setRandomFunction());                                *
+* - each pixel draws from its own counter-based random stream.              *
+* Compiled only with SPMATCH_CUDA. See gpu.hpp.                             *
+****************************************************************************/
+
+#include "gpu.hpp"
+
+#include <cstdint>
+#include <cmath>
+#include <random>
+#include <string>
+#include <stdexcept>
+#include <cuda_runtime.h>
+
+#include "params.hpp"
+
+
+/*****************************************************
+* > check()                                          *
+* Throws a runtime_error if a CUDA call has failed.  *
+*                                                    *
+* Args:                                              *
+*   error (cudaError_t): the result of the call      *
+*   what (string): the operation                     *
+*****************************************************/
+static void check(cudaError_t error, const std::string& what) {
+
+	if (error != cudaSuccess) {
+		throw std::runtime_error("gpuMatch(). " + what + ": " +
+				cudaGetErrorString(error));
+	}
+}
+
+
+/****************************************************************
+* > class DeviceBuffer                                          *
+* An array in device memory. Freed at destruction.              *
+****************************************************************/
+template<typename T>
+class DeviceBuffer {
+
+	private:
+
+		T* ptr = nullptr;
+		size_t n;
+
+	public:
+
+		// constr
+		explicit DeviceBuffer(size_t n): n(n) {
+			check(cudaMalloc(&ptr, n * sizeof(T)), "cudaMalloc");
+		}
+		DeviceBuffer(const DeviceBuffer&) = delete;
+		~DeviceBuffer() { cudaFree(ptr); }
+
+		// methods
+		T* data(void) { return ptr; }
+		void upload(const T* host) {
+			check(cudaMemcpy(ptr, host, n * sizeof(T), cudaMemcpyHostToDevice),
+					"upload");
+		}
+		void download(T* host) const {
+			check(cudaMemcpy(host, ptr, n * sizeof(T), cudaMemcpyDeviceToHost),
+					"download");
+		}
+
+		// operators
+		DeviceBuffer& operator=(const DeviceBuffer&) = delete;
+};
+
+
+namespace {
+
+	// The params used by the device, copied at each gpuMatch()
+	struct Settings {
+		int width, height;
+		float alfa, tauCol, tauGrad, gamma;
+		int window;
+		float minD, maxD;
+		float cosInitSlope;          // min z of the random normals
+		float cosSlope;              // min z of the refined normals
+		bool resizeWindows;
+		bool saturation;
+		bool constDisparities;
+		unsigned iterations;
+		uint64_t seed;
+	};
+
+	// A view on the device
+	struct DeviceView {
+		const float* pixels;
+		size_t stride;               // floats of each pixel
+		float* planes;               // a, b, c
+		float* costs;
+		unsigned char* invalid;
+		int sign;                    // other pixel at x + sign * d
+		unsigned index;              // 0 left, 1 right: random streams
+	};
+
+	// The buffers of a view
+	struct ViewBuffers {
+		DeviceBuffer<float> pixels;
+		DeviceBuffer<float> planes;
+		DeviceBuffer<float> costs;
+		DeviceBuffer<unsigned char> invalid;
+
+		ViewBuffers(size_t n, size_t stride):
+				pixels(n * stride), planes(n * 3), costs(n), invalid(n) {}
+	};
+
+	const unsigned BLOCK_SIDE = 16;
+	const int RED = GpuView::RED;
+	const int GREEN = GpuView::GREEN;
+	const int BLUE = GpuView::BLUE;
+	const int GRAD_X = GpuView::GRAD_X;
+	const int GRAD_Y = GpuView::GRAD_Y;
+}
+
+
+/***************************************************************
+* > struct Random                                              *
+* A counter-based random stream: splitmix64 of a counter, from *
+* a state that mixes the seed, the view, the pixel and the     *
+* launch. No state is kept between kernels.                    *
+***************************************************************/
+struct Random {
+
+	uint64_t state;
+
+	__device__ Random(uint64_t seed, unsigned view, size_t pixel,
+			unsigned launch) {
+		state = seed ^ (uint64_t(view) << 62) ^ (uint64_t(launch) << 40) ^
+				(uint64_t(pixel) * 0x9E3779B97F4A7C15ull);
+	}
+
+	// Uniform in [0,1)
+	__device__ float uniform(void) {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		z = z ^ (z >> 31);
+		return (z >> 40) * (1.0f / 16777216.0f);
+	}
+
+	// Uniform in [min,max)
+	__device__ float uniform(float min, float max) {
+		return min + (max - min) * uniform();
+	}
+};
+
+
+/*******************************************************************
+* > disparityAt()                                                  *
+* The disparity of a plane at (w,h), saturated in [minD, maxD], as *
+* StereoImage::disparityAt().                                      *
+*******************************************************************/
+__device__ float disparityAt(const Settings& s, const float* plane,
+		float w, float h) {
+
+	float d = plane[0] * w + plane[1] * h + plane[2];
+	return fminf(fmaxf(d, s.minD), s.maxD);
+}
+
+
+/**************************************************************************
+* > fromPointAndNormal()                                                  *
+* The plane through (w, h, z) with normal n (n[2] > 0), as a, b, c.       *
+**************************************************************************/
+__device__ void fromPointAndNormal(float w, float h, float z, const float* n,
+		float* plane) {
+
+	plane[0] = -n[0] / n[2];
+	plane[1] = -n[1] / n[2];
+	plane[2] = z + (n[0] * w + n[1] * h) / n[2];
+}
+
+
+/************************************************************************
+* > dissimilarity()                                                     *
+* The pixel cost of StereoImage::pixelDissimilarity(), with             *
+* OutOfBounds::NAN_COST: NaN if the other pixel is out of the image.    *
+************************************************************************/
+__device__ float dissimilarity(const Settings& s, const DeviceView& view,
+		const DeviceView& other, int w, int h, const float* plane) {
+
+	float d = plane[0] * w + plane[1] * h + plane[2];
+	if (s.saturation) {
+		d = fminf(fmaxf(d, s.minD), s.maxD);
+	}
+
+	float qW = w + view.sign * d;
+	if (qW < 0 || qW > s.width - 1) {
+		return NAN;
+	}
+
+	size_t qLow = floorf(qW);
+	size_t qHigh = ceilf(qW);
+	float x = qW - qLow;
+	const float* p = &view.pixels[(size_t(h) * s.width + w) * view.stride];
+	const float* q0 = &other.pixels[(h * s.width + qLow) * other.stride];
+	const float* q1 = &other.pixels[(h * s.width + qHigh) * other.stride];
+
+	float colourDist = 0;
+	for (int c = RED; c <= BLUE; ++c) {
+		colourDist += fabsf(p[c] - (q0[c] * (1 - x) + q1[c] * x));
+	}
+	float gradientDist = fabsf(p[GRAD_X] - (q0[GRAD_X] * (1 - x) + q1[GRAD_X] * x)) +
+			fabsf(p[GRAD_Y] - (q0[GRAD_Y] * (1 - x) + q1[GRAD_Y] * x));
+
+	return (1 - s.alfa) * fminf(colourDist, s.tauCol) +
+			s.alfa * fminf(gradientDist, s.tauGrad);
+}
+
+
+/*************************************************************************
+* > windowCost()                                                         *
+* The window cost of StereoImage::pixelWindowCost(): adaptive weights,   *
+* pixels out of the other view ignored, windows resized by the slope     *
+* with resizeWindows. Stops with 'bound' if the cost can't be lower.     *
+*************************************************************************/
+__device__ float windowCost(const Settings& s, const DeviceView& view,
+		const DeviceView& other, int w, int h, const float* plane,
+		float bound) {
+
+	int halfSideW = s.window / 2;
+	int halfSideH = s.window / 2;
+	if (s.resizeWindows) {
+		float norm = sqrtf(plane[0] * plane[0] + plane[1] * plane[1] + 1);
+		float ncx = plane[0] / norm;
+		float ncy = plane[1] / norm;
+		halfSideW = int(roundf(s.window * sqrtf(1 - ncx * ncx))) / 2;
+		halfSideH = int(roundf(s.window * sqrtf(1 - ncy * ncy))) / 2;
+	}
+	int minW = max(w - halfSideW, 0);
+	int maxW = min(w + halfSideW, s.width - 1);
+	int minH = max(h - halfSideH, 0);
+	int maxH = min(h + halfSideH, s.height - 1);
+
+	const float* p = &view.pixels[(size_t(h) * s.width + w) * view.stride];
+	float total = 0;
+	long count = 0;
+	for (int iH = minH; iH <= maxH; ++iH) {
+		for (int iW = minW; iW <= maxW; ++iW) {
+			float cost = dissimilarity(s, view, other, iW, iH, plane);
+			if (cost != cost) { continue; }   // NaN
+
+			const float* q = &view.pixels[(size_t(iH) * s.width + iW) * view.stride];
+			float colourDist = fabsf(p[RED] - q[RED]) +
+					fabsf(p[GREEN] - q[GREEN]) + fabsf(p[BLUE] - q[BLUE]);
+			total += expf(-colourDist / s.gamma) * cost;
+			++count;
+		}
+
+		long remaining = long(maxH - iH) * (maxW - minW + 1);
+		if (iH < maxH && total >= bound * (count + remaining)) {
+			return bound;
+		}
+	}
+
+	return (count > 0) ? total / count : 300;   // 300: as the CPU, on borders
+}
+
+
+/*****************************************************************
+* > randomPlane()                                                *
+* A random plane at (w,h), as StereoImage::randomPlane().        *
+*****************************************************************/
+__device__ void randomPlane(const Settings& s, Random& random, float w,
+		float h, float* plane) {
+
+	float z = random.uniform(s.minD, s.maxD);
+	if (s.constDisparities) {
+		plane[0] = plane[1] = 0;
+		plane[2] = z;
+		return;
+	}
+
+	float n[3];
+	n[2] = random.uniform(s.cosInitSlope, 1);
+	float phi = random.uniform(-M_PI, M_PI);
+	n[0] = cosf(phi) * sqrtf(1 - n[2] * n[2]);
+	n[1] = sinf(phi) * sqrtf(1 - n[2] * n[2]);
+	fromPointAndNormal(w, h, z, n, plane);
+}
+
+
+/*******************************************************
+* > initKernel()                                       *
+* Random planes of a view and their window costs.      *
+* NOTE: both views must have their pixels, only.       *
+*******************************************************/
+__global__ void initKernel(Settings s, DeviceView view, DeviceView other) {
+
+	int w = blockIdx.x * blockDim.x + threadIdx.x;
+	int h = blockIdx.y * blockDim.y + threadIdx.y;
+	if (w >= s.width || h >= s.height) { return; }
+
+	size_t i = size_t(h) * s.width + w;
+	Random random(s.seed, view.index, i, 0);
+	float* plane = &view.planes[i * 3];
+	randomPlane(s, random, w, h, plane);
+	view.costs[i] = windowCost(s, view, other, w, h, plane, INFINITY);
+}
+
+
+/***************************************************************************
+* > stepKernel()                                                           *
+* Spatial propagation, view propagation and refinement of the pixels of a  *
+* view with (w + h) % 2 == colour.                                         *
+***************************************************************************/
+__global__ void stepKernel(Settings s, DeviceView view, DeviceView other,
+		unsigned colour, unsigned launch) {
+
+	int w = blockIdx.x * blockDim.x + threadIdx.x;
+	int h = blockIdx.y * blockDim.y + threadIdx.y;
+	if (w >= s.width || h >= s.height || (w + h) % 2 != int(colour)) { return; }
+
+	size_t i = size_t(h) * s.width + w;
+	float plane[3] = { view.planes[i * 3], view.planes[i * 3 + 1],
+			view.planes[i * 3 + 2] };
+	float cost = view.costs[i];
+
+	auto test = [&] (const float* candidate) {
+		float candidateCost = windowCost(s, view, other, w, h, candidate, cost);
+		if (candidateCost < cost) {
+			cost = candidateCost;
+			for (int k = 0; k < 3; ++k) { plane[k] = candidate[k]; }
+		}
+	};
+
+	// Spatial propagation: the 4 neighbours
+	const int dW[] = { -1, 1, 0, 0 };
+	const int dH[] = { 0, 0, -1, 1 };
+	for (int n = 0; n < 4; ++n) {
+		int nW = w + dW[n];
+		int nH = h + dH[n];
+		if (nW >= 0 && nW < s.width && nH >= 0 && nH < s.height) {
+			test(&view.planes[(size_t(nH) * s.width + nW) * 3]);
+		}
+	}
+
+	// View propagation: the plane of the matching pixel
+	int oW = lroundf(w + view.sign * disparityAt(s, plane, w, h));
+	if (oW >= 0 && oW < s.width) {
+		test(&other.planes[(size_t(h) * s.width + oW) * 3]);
+	}
+
+	// Refinement
+	Random random(s.seed, view.index, i, launch);
+	float deltaZ = (s.maxD - s.minD) / 2;
+	float deltaN = 1;
+	while (deltaZ > 0.1f) {
+		float z = disparityAt(s, plane, w, h);
+		z = fminf(fmaxf(z + random.uniform(-deltaZ, deltaZ), s.minD), s.maxD);
+
+		float norm = sqrtf(plane[0] * plane[0] + plane[1] * plane[1] + 1);
+		float n[3] = { -plane[0] / norm, -plane[1] / norm, 1 / norm };
+		for (int k = 0; k < 3; ++k) {
+			n[k] += random.uniform(-deltaN, deltaN);
+		}
+		norm = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		if (norm > 0 && n[2] / norm >= s.cosSlope) {
+			for (int k = 0; k < 3; ++k) { n[k] /= norm; }
+			float candidate[3];
+			fromPointAndNormal(w, h, z, n, candidate);
+			test(candidate);
+		}
+
+		deltaZ /= 2;
+		deltaN /= 2;
+	}
+
+	for (int k = 0; k < 3; ++k) { view.planes[i * 3 + k] = plane[k]; }
+	view.costs[i] = cost;
+}
+
+
+/**************************************************************************
+* > consistencyKernel()                                                   *
+* The invalid pixels of a view, as StereoImage::getInvalidPixelsMap():    *
+* projected out of the other view, or with a disparity that differs by    *
+* more than 1 from the disparity of the matching pixel.                   *
+**************************************************************************/
+__global__ void consistencyKernel(Settings s, DeviceView view,
+		DeviceView other) {
+
+	int w = blockIdx.x * blockDim.x + threadIdx.x;
+	int h = blockIdx.y * blockDim.y + threadIdx.y;
+	if (w >= s.width || h >= s.height) { return; }
+
+	size_t i = size_t(h) * s.width + w;
+	float d = disparityAt(s, &view.planes[i * 3], w, h);
+	float oWD = w + view.sign * d;
+	int oW = lroundf(oWD);
+	if (oWD < 0 || oW >= s.width) {      // rounded, as matchingColumn()
+		view.invalid[i] = 255;
+		return;
+	}
+
+	float oD = disparityAt(s, &other.planes[(size_t(h) * s.width + oW) * 3],
+			oW, h);
+	view.invalid[i] = (fabsf(d - oD) > 1) ? 255 : 0;
+}
+
+
+/***********************************************************
+* > launch()                                               *
+* Runs a kernel on all the pixels, with square blocks, and *
+* waits for it.                                            *
+***********************************************************/
+template<typename... KernelArgs, typename... Args>
+static void launch(void (*kernel)(KernelArgs...), const Settings& s,
+		Args... args) {
+
+	dim3 block(BLOCK_SIDE, BLOCK_SIDE);
+	dim3 grid((s.width + BLOCK_SIDE - 1) / BLOCK_SIDE,
+			(s.height + BLOCK_SIDE - 1) / BLOCK_SIDE);
+	kernel<<<grid, block>>>(s, args...);
+	check(cudaGetLastError(), "kernel launch");
+	check(cudaDeviceSynchronize(), "kernel");
+}
+
+
+/*************************************************
+* > gpuAvailable()                               *
+* Returns:                                       *
+*   (bool): true if there is a CUDA device       *
+*************************************************/
+bool gpuAvailable(void) {
+
+	int devices = 0;
+	return cudaGetDeviceCount(&devices) == cudaSuccess && devices > 0;
+}
+
+
+/****************************************************************************
+* > gpuMatch()                                                              *
+* Computes the planes of the two views on the GPU: random initialization,   *
+* params.ITERATIONS iterations (each one: left view, then right view; red   *
+* pixels, then black ones) and the consistency check. The outputs of the    *
+* views are resized and filled. With params.USE_PSEUDORAND, the result is   *
+* repeatable.                                                               *
+* NOTE: the two views must have the same size.                              *
+*                                                                           *
+* Args:                                                                     *
+*   width (size_t), height (size_t): the size of the views                  *
+*   left (GpuView), right (GpuView): the two views                          *
+****************************************************************************/
+void gpuMatch(size_t width, size_t height, GpuView& left, GpuView& right) {
+
+	Settings s;
+	s.width = width;
+	s.height = height;
+	s.alfa = params.ALFA;
+	s.tauCol = params.TAU_COL;
+	s.tauGrad = params.TAU_GRAD;
+	s.gamma = params.GAMMA;
+	s.window = params.WINDOW_SIZE;
+	s.minD = params.MIN_D;
+	s.maxD = params.MAX_D;
+	// As the CPU: degrees in setRandomFunction(), radians in the
+	// PlaneSampler of planeRefinement()
+	s.cosInitSlope = std::cos(params.MAX_SLOPE / 180 * M_PI);
+	s.cosSlope = std::cos(params.MAX_SLOPE);
+	s.resizeWindows = params.RESIZE_WINDOWS;
+	s.saturation = params.PLANES_SATURATION;
+	s.constDisparities = params.CONST_DISPARITIES;
+	s.iterations = params.ITERATIONS;
+	s.seed = params.USE_PSEUDORAND ? 0x53504d6174636821ull :
+			(uint64_t(std::random_device()()) << 32) ^ std::random_device()();
+
+	// Upload
+	size_t n = width * height;
+	GpuView* views[] = { &left, &right };
+	ViewBuffers leftBuffers(n, left.pixelStride);
+	ViewBuffers rightBuffers(n, right.pixelStride);
+	ViewBuffers* buffers[] = { &leftBuffers, &rightBuffers };
+	DeviceView device[2];
+	for (unsigned v = 0; v < 2; ++v) {
+		ViewBuffers& b = *buffers[v];
+		b.pixels.upload(views[v]->pixels);
+		device[v] = { b.pixels.data(), views[v]->pixelStride, b.planes.data(),
+				b.costs.data(), b.invalid.data(), (v == 0) ? -1 : +1, v };
+	}
+
+	// Iterations
+	launch(initKernel, s, device[0], device[1]);
+	launch(initKernel, s, device[1], device[0]);
+	unsigned launches = 0;
+	for (unsigned i = 0; i < s.iterations; ++i) {
+		for (unsigned v = 0; v < 2; ++v) {
+			for (unsigned colour = 0; colour < 2; ++colour) {
+				launch(stepKernel, s, device[v], device[1 - v], colour, ++launches);
+			}
+		}
+	}
+	launch(consistencyKernel, s, device[0], device[1]);
+	launch(consistencyKernel, s, device[1], device[0]);
+
+	// Download
+	for (unsigned v = 0; v < 2; ++v) {
+		views[v]->planes.resize(n * 3);
+		views[v]->costs.resize(n);
+		views[v]->invalid.resize(n);
+		buffers[v]->planes.download(views[v]->planes.data());
+		buffers[v]->costs.download(views[v]->costs.data());
+		buffers[v]->invalid.download(views[v]->invalid.data());
+	}
+}
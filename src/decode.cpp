@@ -0,0 +1,318 @@
+#include "decode.hpp"
+
+#include <fstream>
+#include <cstring>
+#include <csetjmp>
+#include <cstdio>
+#include <cmath>
+#include <stdexcept>
+
+#ifdef SPMATCH_PNG
+#include <png.h>
+#endif
+#ifdef SPMATCH_JPEG
+#include <jpeglib.h>     // NOTE: needs cstdio before
+#endif
+
+
+/*****************************************************************************
+* Direct decoders of PNG (libpng, with SPMATCH_PNG) and JPEG (libjpeg or     *
+* libjpeg-turbo, with SPMATCH_JPEG) into 8 bit buffers. CMake defines them   *
+* when the libraries are found. Without them, for 16 bit PNGs and for the    *
+* other formats, decodeImage() returns false and the images are loaded by    *
+* CImg, which may run an external converter (ImageMagick) for these formats, *
+* and keeps values above 8 bit (16 bit, float) for the matcher.              *
+* Both libraries report errors with longjmp(): between setjmp() and the end  *
+* of the decoding there are no C++ objects with destructors, only the        *
+* output buffer, which lives outside.                                        *
+*****************************************************************************/
+
+namespace {
+
+#ifdef SPMATCH_PNG
+
+	// The input of a PNG decoder: the bytes not read yet
+	struct PngInput {
+		const unsigned char* data;
+		size_t size;
+	};
+
+
+	// Reads from a PngInput. See png_set_read_fn()
+	void readPng(png_structp png, png_bytep out, png_size_t bytes) {
+		PngInput* in = static_cast<PngInput*>(png_get_io_ptr(png));
+		if (bytes > in->size) {
+			png_error(png, "truncated file");
+		}
+		std::memcpy(out, in->data, bytes);
+		in->data += bytes;
+		in->size -= bytes;
+	}
+
+
+	/*********************************************************************
+	* > decodePng()                                                      *
+	* Decodes a PNG file in memory. Palettes are expanded to RGB, 16 bit *
+	* channels are reduced to 8 bit, alpha is dropped.                   *
+	*                                                                    *
+	* Args:                                                              *
+	*   data (unsigned char*), size (size_t): the file                   *
+	*   out (DecodedImage): the decoded image                            *
+	*                                                                    *
+	* Returns:                                                           *
+	*   (const char*): nullptr, or the error of libpng                   *
+	*********************************************************************/
+	const char* decodePng(const unsigned char* data, size_t size,
+			DecodedImage& out) {
+
+		static thread_local char error[256];
+		png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+				nullptr, [] (png_structp p, png_const_charp message) {
+					std::snprintf(error, sizeof(error), "%s", message);
+					longjmp(png_jmpbuf(p), 1);
+				}, nullptr);
+		png_infop info = png ? png_create_info_struct(png) : nullptr;
+		if (!info) {
+			png_destroy_read_struct(&png, nullptr, nullptr);
+			return "out of memory";
+		}
+		PngInput in = { data, size };
+
+		if (setjmp(png_jmpbuf(png))) {
+			png_destroy_read_struct(&png, &info, nullptr);
+			return error;
+		}
+
+		png_set_read_fn(png, &in, readPng);
+		png_read_info(png, info);
+
+		png_set_expand(png);         // palette to RGB, gray to 8 bit
+		png_set_strip_alpha(png);    // NOTE: no 16 bit, see decodeImage()
+		int passes = png_set_interlace_handling(png);
+		png_read_update_info(png, info);
+
+		out.width = png_get_image_width(png, info);
+		out.height = png_get_image_height(png, info);
+		out.channels = png_get_channels(png, info);
+		if (out.channels != 1 && out.channels != 3) {
+			png_error(png, "unexpected channels");
+		}
+		out.pixels.resize(out.width * out.height * out.channels);
+
+		for (int pass = 0; pass < passes; ++pass) {
+			for (size_t h = 0; h < out.height; ++h) {
+				png_read_row(png, &out.pixels[h * out.width * out.channels],
+						nullptr);
+			}
+		}
+
+		png_read_end(png, nullptr);
+		png_destroy_read_struct(&png, &info, nullptr);
+		return nullptr;
+	}
+
+#endif // SPMATCH_PNG
+
+#ifdef SPMATCH_JPEG
+
+	// Errors of libjpeg, with a longjmp() back to decodeJpeg()
+	struct JpegError {
+		jpeg_error_mgr manager;      // NOTE: first, as libjpeg casts it
+		jmp_buf jump;
+		char message[JMSG_LENGTH_MAX];
+	};
+
+
+	/***********************************************************************
+	* > decodeJpeg()                                                       *
+	* Decodes a JPEG file in memory, as Grayscale or RGB.                  *
+	*                                                                      *
+	* Args:                                                                *
+	*   data (unsigned char*), size (size_t): the file                     *
+	*   out (DecodedImage): the decoded image                              *
+	*                                                                      *
+	* Returns:                                                             *
+	*   (const char*): nullptr, or the error of libjpeg                    *
+	***********************************************************************/
+	const char* decodeJpeg(const unsigned char* data, size_t size,
+			DecodedImage& out) {
+
+		static thread_local JpegError error;
+		jpeg_decompress_struct jpeg;
+		jpeg.err = jpeg_std_error(&error.manager);
+		error.manager.error_exit = [] (j_common_ptr j) {
+			JpegError* e = reinterpret_cast<JpegError*>(j->err);
+			e->manager.format_message(j, e->message);
+			longjmp(e->jump, 1);
+		};
+
+		if (setjmp(error.jump)) {
+			jpeg_destroy_decompress(&jpeg);
+			return error.message;
+		}
+
+		jpeg_create_decompress(&jpeg);
+		jpeg_mem_src(&jpeg, const_cast<unsigned char*>(data), size);
+		jpeg_read_header(&jpeg, TRUE);
+		jpeg.out_color_space = (jpeg.num_components == 1) ? JCS_GRAYSCALE :
+				JCS_RGB;
+		jpeg_start_decompress(&jpeg);
+
+		out.width = jpeg.output_width;
+		out.height = jpeg.output_height;
+		out.channels = jpeg.output_components;
+		out.pixels.resize(out.width * out.height * out.channels);
+
+		while (jpeg.output_scanline < jpeg.output_height) {
+			JSAMPROW row = &out.pixels[size_t(jpeg.output_scanline) * out.width *
+					out.channels];
+			jpeg_read_scanlines(&jpeg, &row, 1);
+		}
+
+		jpeg_finish_decompress(&jpeg);
+		jpeg_destroy_decompress(&jpeg);
+		return nullptr;
+	}
+
+#endif // SPMATCH_JPEG
+}
+
+
+/*******************************************************************
+* > decoderAvailable()                                             *
+* Returns:                                                         *
+*   (bool): true if built with a direct decoder, PNG or JPEG       *
+*******************************************************************/
+bool decoderAvailable(void) {
+#if defined(SPMATCH_PNG) || defined(SPMATCH_JPEG)
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+/**************************************************************************
+* > decodeImage()                                                         *
+* Decodes a PNG or JPEG file in memory (recognized by its signature) into *
+* 8 bit pixels, with the decoders of this build. See the comments above.  *
+* 16 bit PNGs are left to CImg, which keeps their values.                 *
+* Throws a runtime_error if the file is corrupted.                        *
+*                                                                         *
+* Args:                                                                   *
+*   data (unsigned char*), size (size_t): the file                        *
+*   out (DecodedImage): the decoded image. Its buffer is reused           *
+*                                                                         *
+* Returns:                                                                *
+*   (bool): false if there is no decoder for this file                    *
+**************************************************************************/
+bool decodeImage(const unsigned char* data, size_t size, DecodedImage& out) {
+
+	const char* error = nullptr;
+
+	static const unsigned char PNG_SIGNATURE[] = { 0x89, 'P', 'N', 'G' };
+	static const unsigned char JPEG_SIGNATURE[] = { 0xff, 0xd8, 0xff };
+	if (size >= 4 && std::memcmp(data, PNG_SIGNATURE, 4) == 0) {
+#ifdef SPMATCH_PNG
+		// The bit depth, in the IHDR chunk that comes first
+		if (size > 24 && std::memcmp(data + 12, "IHDR", 4) == 0 &&
+				data[24] == 16) {
+			return false;
+		}
+		error = decodePng(data, size, out);
+#else
+		return false;
+#endif
+	} else if (size >= 3 && std::memcmp(data, JPEG_SIGNATURE, 3) == 0) {
+#ifdef SPMATCH_JPEG
+		error = decodeJpeg(data, size, out);
+#else
+		return false;
+#endif
+	} else {
+		return false;
+	}
+
+	if (error) {
+		throw std::runtime_error(string("decodeImage(). ") + error);
+	}
+	return true;
+}
+
+
+/**********************************************************************
+* > decodeImage()                                                     *
+* As above, for the file at 'path'. Returns false, without reading    *
+* it, if there is no decoder in this build.                           *
+*                                                                     *
+* Args:                                                               *
+*   path (string): the file                                           *
+*   out (DecodedImage): the decoded image. Its buffer is reused       *
+*                                                                     *
+* Returns:                                                            *
+*   (bool): false if there is no decoder for this file                *
+**********************************************************************/
+bool decodeImage(const string& path, DecodedImage& out) {
+
+	if (!decoderAvailable()) { return false; }
+
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file) {
+		throw std::runtime_error("decodeImage(). Can't read " + path);
+	}
+	std::vector<unsigned char> data(size_t(file.tellg()));
+	file.seekg(0);
+	file.read(reinterpret_cast<char*>(data.data()), data.size());
+	if (!file) {
+		throw std::runtime_error("decodeImage(). Can't read " + path);
+	}
+
+	try {
+		return decodeImage(data.data(), data.size(), out);
+	} catch (const std::runtime_error& e) {
+		throw std::runtime_error(string(e.what()) + ": " + path);
+	}
+}
+
+
+/***********************************************************************
+* > loadImage()                                                        *
+* Reads any image file as 8 bit pixels: with decodeImage() if it can,  *
+* otherwise with CImg. For the 8 bit buffers of the tiles and of the   *
+* remote workers: throws a runtime_error for images with values that   *
+* aren't 8 bit (16 bit, float), rather than truncating them, and for   *
+* images other than RGB and Grayscale.                                 *
+*                                                                      *
+* Args:                                                                *
+*   path (string): the file                                            *
+*   out (DecodedImage): the image                                      *
+***********************************************************************/
+void loadImage(const string& path, DecodedImage& out) {
+
+	if (decodeImage(path, out)) { return; }
+
+	CImg<double> image(path.c_str());
+	if (image.spectrum() != 1 && image.spectrum() != 3) {
+		throw std::runtime_error("loadImage(). Wrong image format: " +
+				std::to_string(image.spectrum()) +
+				" channels; only RGB and Grayscale supported");
+	}
+
+	out.width = image.width();
+	out.height = image.height();
+	out.channels = image.spectrum();
+	out.pixels.resize(out.width * out.height * out.channels);
+	for (size_t h = 0; h < out.height; ++h) {
+		for (size_t w = 0; w < out.width; ++w) {
+			for (size_t c = 0; c < out.channels; ++c) {
+				double value = image(w, h, 0, c);
+				if (!(value >= 0 && value <= 255) || value != std::floor(value)) {
+					throw std::runtime_error("loadImage(). Not an 8 bit image "
+							"(needed by tiles and workers): " + path);
+				}
+				out.pixels[(h * out.width + w) * out.channels + c] =
+						(unsigned char)value;
+			}
+		}
+	}
+}
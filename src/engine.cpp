@@ -0,0 +1,194 @@
+
+#include "engine.hpp"
+
+#include <stdexcept>
+
+
+namespace {
+
+	/***************************************************************
+	* > struct ParamsScope                                         *
+	* Installs some params on this thread, and restores the old    *
+	* ones at the end of the scope (also when an exception leaves) *
+	***************************************************************/
+	struct ParamsScope {
+		Params saved;
+
+		explicit ParamsScope(const Params& p): saved(params) { params = p; }
+		~ParamsScope() { params = saved; }
+	};
+}
+
+
+// > class Engine
+
+/*********************************************
+* > Engine()                                 *
+* Constructor. An engine with default params *
+*********************************************/
+Engine::Engine(void):
+		settings(defaultParams()) {}
+
+
+/*****************************************************************
+* > Engine()                                                     *
+* Constructor. Throws a runtime_error if the params are out of   *
+* their ranges: see checkParams().                               *
+*                                                                *
+* Args:                                                          *
+*   settings (Params): the params to use                         *
+*****************************************************************/
+Engine::Engine(const Params& settings):
+		settings(settings) {
+
+	checkParams(settings);
+}
+
+
+/***********************************************************************
+* > setParams()                                                        *
+* Changes the params of the next computations. The buffers of previous *
+* frames are released, because their sizes depend on the params.       *
+* Throws a runtime_error if the params are out of their ranges (see    *
+* checkParams()): then the engine is unchanged.                        *
+*                                                                      *
+* Args:                                                                *
+*   settings (Params): the new params                                  *
+***********************************************************************/
+void Engine::setParams(const Params& settings) {
+
+	checkParams(settings);
+	this->settings = settings;
+	stereo.reset();
+}
+
+
+/*************************************************************************
+* > compute()                                                            *
+* Computes the disparity maps of a stereo pair. The images are copied:   *
+* the buffers can be reused after this call. If the size is the same of  *
+* the previous call, the memory of the previous frame is reused.         *
+* The params of the engine are used on this thread and on all the        *
+* threads of the computation; the params of the caller are unchanged.    *
+*                                                                        *
+* Args:                                                                  *
+*   left (ImageBuffer): the left view                                    *
+*   right (ImageBuffer): the right view. Same size and channels of left  *
+*   out (Disparities): where the disparity maps are written. Its vectors *
+*       are resized only if needed                                       *
+*************************************************************************/
+void Engine::compute(const ImageBuffer& left, const ImageBuffer& right,
+		Disparities& out) {
+
+	run(left, right, out, false);
+}
+
+
+/*************************************************************************
+* > computeNext()                                                        *
+* As compute(), for the next frame of a video: the planes of the         *
+* previous call are the initialization, as in                            *
+* StereoImagePair::computeDisparityFromPrevious(). If there's no         *
+* previous frame of the same size, this is the same as compute().        *
+*                                                                        *
+* Args:                                                                  *
+*   left (ImageBuffer), right (ImageBuffer), out (Disparities): as in    *
+*       compute()                                                        *
+*************************************************************************/
+void Engine::computeNext(const ImageBuffer& left, const ImageBuffer& right,
+		Disparities& out) {
+
+	run(left, right, out, true);
+}
+
+
+/***********************************************************************
+* > loadFrame()                                                        *
+* Loads the two views in the current pair, or in a new one if the size *
+* has changed. Expects the engine params on this thread.               *
+*                                                                      *
+* Args:                                                                *
+*   left (ImageBuffer), right (ImageBuffer): the two views             *
+*                                                                      *
+* Returns:                                                             *
+*   (bool): true if the current pair has been reused                   *
+***********************************************************************/
+bool Engine::loadFrame(const ImageBuffer& left, const ImageBuffer& right) {
+
+	// checks
+	if (left.width != right.width || left.height != right.height ||
+			left.channels != right.channels) {
+		throw std::invalid_argument("compute(). Left and right images must "
+				"have the same dimension");
+	}
+
+	// Reuse
+	if (stereo && left.width == width && left.height == height &&
+			left.channels == channels) {
+		stereo->loadFrame(left, right);
+		return true;
+	}
+
+	// New pair
+	stereo.reset();
+	stereo.reset(new StereoImagePair(
+			StereoImage(Image(left), StereoImage::LEFT),
+			StereoImage(Image(right), StereoImage::RIGHT)));
+	width = left.width;
+	height = left.height;
+	channels = left.channels;
+
+	return false;
+}
+
+
+/********************************************************************
+* > run()                                                           *
+* The body of compute() and computeNext().                          *
+*                                                                   *
+* Args:                                                             *
+*   left (ImageBuffer), right (ImageBuffer), out (Disparities): as  *
+*       in compute()                                                *
+*   warmStart (bool): whether to start from the previous planes     *
+********************************************************************/
+void Engine::run(const ImageBuffer& left, const ImageBuffer& right,
+		Disparities& out, bool warmStart) {
+
+	ParamsScope scope(settings);
+
+	try {
+		bool reused = loadFrame(left, right);
+		auto disparities = (warmStart && reused) ?
+				stereo->computeDisparityFromPrevious() : stereo->computeDisparity();
+
+		out.width = width;
+		out.height = height;
+		copyDisparities(disparities.first, out.left);
+		copyDisparities(disparities.second, out.right);
+	} catch (...) {
+		stereo.reset();          // a failed frame leaves the pair unusable
+		throw;
+	}
+}
+
+
+/************************************************************
+* > copyDisparities()                                       *
+* Copies a disparity map in a row-major vector of floats.   *
+*                                                           *
+* Args:                                                     *
+*   disp (Image): a disparity map                           *
+*   out (vector<float>): the destination. Resized if needed *
+************************************************************/
+void Engine::copyDisparities(const Image& disp, std::vector<float>& out) {
+
+	size_t width = disp.size(0);
+	size_t height = disp.size(1);
+	out.resize(width * height);
+
+	for (size_t h = 0; h < height; ++h) {
+		for (size_t w = 0; w < width; ++w) {
+			out[h * width + w] = disp.get(w, h);
+		}
+	}
+}
@@ -1,6 +1,7 @@
 
 #include "geometry.hpp"
 
+#include <algorithm>
 #include <Eigen/Geometry>
 
 #include "numbers.hpp"
@@ -502,3 +503,70 @@ std::ostream& operator<<(std::ostream& out, const PlaneFunction& p) {
 inline bool PlaneFunction::areFunctionParams(Vector3d p) const {
 	return std::abs(p(2)) > Z_EPS;
 }
+
+
+// > struct CompactPlane
+
+/*********************************************************************
+* > normal()                                                         *
+* Returns the unit normal of this plane, as the one of toFunction(): *
+* (a, b, -1), normalized.                                            *
+*                                                                    *
+* Returns:                                                           *
+*   (Vector3d): the unit normal                                      *
+*********************************************************************/
+Vector3d CompactPlane::normal(void) const {
+
+	Vector3d n = { a, b, -1 };
+	return n.normalized();
+}
+
+
+// print
+std::ostream& operator<<(std::ostream& out, const CompactPlane& p) {
+	return out << "{ " << p.a << " " << p.b << " " << p.c << " }";
+}
+
+
+// > class PlaneSampler
+
+/**************************************************************************
+* > PlaneSampler()                                                        *
+* Constructor. Samples around 'plane'.                                    *
+*                                                                         *
+* Args:                                                                   *
+*   plane (CompactPlane): the current plane                               *
+*   cosLimit (double): the slope limit, as the minimum z component of the *
+*       sampled normals. Raised to PlaneFunction::Z_EPS, if lower         *
+**************************************************************************/
+PlaneSampler::PlaneSampler(const CompactPlane& plane, double cosLimit):
+		cosLimit(std::max(cosLimit, PlaneFunction::Z_EPS)) {
+
+	thetaLimit = std::acos(this->cosLimit);
+	setPlane(plane);
+}
+
+
+/**********************************************************************
+* > setPlane()                                                        *
+* Changes the current plane: computes the frame of its normal. Either *
+* orientation of the normal describes the same plane: the one towards *
+* positive z is used.                                                 *
+*                                                                     *
+* Args:                                                               *
+*   plane (CompactPlane): the new plane                               *
+**********************************************************************/
+void PlaneSampler::setPlane(const CompactPlane& plane) {
+
+	m = -plane.normal();               // (a, b, -1) -> positive z
+	mZ = m(2);
+	sinMZ = std::sqrt(std::max(0.0, 1 - mZ * mZ));
+
+	// Direction towards z, orthogonal to m. Any direction if m == z
+	if (sinMZ > 1e-12) {
+		toZ = (Vector3d::UnitZ() - mZ * m) / sinMZ;
+	} else {
+		toZ = Vector3d::UnitX();
+	}
+	side = m.cross(toZ);
+}
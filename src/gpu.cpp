@@ -0,0 +1,29 @@
+
+#include "gpu.hpp"
+
+#include <stdexcept>
+
+
+// Without SPMATCH_CUDA (CMake option of the same name) there is no GPU
+// backend: these are the placeholders. The backend is in cuda/gpu.cu
+#ifndef SPMATCH_CUDA
+
+/****************************************************
+* > gpuAvailable()                                  *
+* Returns:                                          *
+*   (bool): true if gpuMatch() can run. Here false  *
+****************************************************/
+bool gpuAvailable(void) {
+	return false;
+}
+
+
+/****************************************************
+* > gpuMatch()                                      *
+* Throws a runtime_error: built without the backend *
+****************************************************/
+void gpuMatch(size_t, size_t, GpuView&, GpuView&) {
+	throw std::runtime_error("gpuMatch(). Built without SPMATCH_CUDA");
+}
+
+#endif // SPMATCH_CUDA
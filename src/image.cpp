@@ -1,22 +1,36 @@
 
 #include "image.hpp"
 
+#include "decode.hpp"
+
 
 // > class Image
 
 /*****************************************
 * > Image()                              *
 * Constructs and image from a file path. *
+* See load().                            *
 *****************************************/
 Image::Image(const string& imgPath):
-		imgPath(imgPath), img(imgPath.c_str()),
-		width(img.width()), height(img.height()), channels(img.spectrum()) {
-	
-	if (channels != 1 && channels != 3) {
-		throw std::runtime_error(
-				"Image(). Wrong image format: " + std::to_string(channels) +
-				" channels; only RGB and Grayscale supported");
-	}
+		Image(0, 0, 1) {
+
+	load(imgPath);
+}
+
+
+/**********************************************
+* > Image()                                   *
+* Constructs an image from a buffer in memory *
+* (copied). See load().                       *
+*                                             *
+* Args:                                       *
+*   buffer (ImageBuffer): the pixels          *
+**********************************************/
+Image::Image(const ImageBuffer& buffer):
+		Image(buffer.width, buffer.height, buffer.channels) {
+
+	imgPath = "buffer.png";
+	load(buffer);
 }
 
 
@@ -218,6 +232,114 @@ Image Image::toGrayscale(void) const {
 }
 
 
+/***********************************************************************
+* > load()                                                             *
+* Replaces this image with the one in a file. PNG and JPEG files are   *
+* read by the decoders of this build, if any (see decodeImage()): the  *
+* pixel buffer is kept if the size doesn't change. Otherwise, and for  *
+* the other formats, by CImg.                                          *
+*                                                                      *
+* Args:                                                                *
+*   imgPath (string): the path of the new image                        *
+*                                                                      *
+* Returns:                                                             *
+*   (Image&): reference to this                                        *
+***********************************************************************/
+Image& Image::load(const string& imgPath) {
+
+	DecodedImage decoded;
+	if (decodeImage(imgPath, decoded)) {
+		load(decoded.buffer());
+		this->imgPath = imgPath;
+		return *this;
+	}
+
+	img.load(imgPath.c_str());
+	this->imgPath = imgPath;
+	width = img.width();
+	height = img.height();
+	channels = img.spectrum();
+
+	if (channels != 1 && channels != 3) {
+		throw std::runtime_error(
+				"load(). Wrong image format: " + std::to_string(channels) +
+				" channels; only RGB and Grayscale supported");
+	}
+
+	return *this;
+}
+
+
+/************************************************************************
+* > load()                                                              *
+* Replaces this image with a copy of the buffer. The memory of the      *
+* pixels is reused if the size is the same. The path is not changed.    *
+*                                                                       *
+* Args:                                                                 *
+*   buffer (ImageBuffer): the pixels                                    *
+*                                                                       *
+* Returns:                                                              *
+*   (Image&): reference to this                                         *
+************************************************************************/
+Image& Image::load(const ImageBuffer& buffer) {
+
+	// checks
+	if (buffer.channels != 1 && buffer.channels != 3) {
+		throw std::invalid_argument(
+				"load(). Wrong image format: " + std::to_string(buffer.channels) +
+				" channels; only RGB and Grayscale supported");
+	}
+	if (buffer.width == 0 || buffer.height == 0 || !buffer.data) {
+		throw std::invalid_argument("load(). Empty buffer");
+	}
+	if (buffer.rowStride < buffer.width * buffer.channels) {
+		throw std::invalid_argument("load(). Row stride " +
+				std::to_string(buffer.rowStride) + " shorter than a row");
+	}
+
+	if (width != buffer.width || height != buffer.height ||
+			channels != buffer.channels) {
+		img.assign(buffer.width, buffer.height, 1, buffer.channels);
+		width = buffer.width;
+		height = buffer.height;
+		channels = buffer.channels;
+	}
+
+	// Copy
+	for (size_t h = 0; h < height; ++h) {
+		const unsigned char* row = buffer.data + h * buffer.rowStride;
+		for (size_t w = 0; w < width; ++w) {
+			for (size_t c = 0; c < channels; ++c) {
+				img(w,h,0,c) = row[w * channels + c];
+			}
+		}
+	}
+
+	return *this;
+}
+
+
+/***************************************************************************
+* > resized()                                                              *
+* Creates a new image with a different size. When shrinking, each pixel is *
+* the average of the pixels it covers (CImg moving average).               *
+*                                                                          *
+* Args:                                                                    *
+*   width (size_t), height (size_t): the new size                          *
+*                                                                          *
+* Returns:                                                                 *
+*   (Image): a new image with the same channels                            *
+***************************************************************************/
+Image Image::resized(size_t width, size_t height) const {
+
+	if (width == 0 || height == 0) {
+		throw std::invalid_argument("resized(). Empty size");
+	}
+
+	return Image(img.get_resize(width, height, -100, -100, 2));
+}
+
+
 /***************************************************************
 * > operator=                                                  *
 * Assingn a CImg to the current instance with a move operation *
@@ -0,0 +1,732 @@
+#include "kernels.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+
+#include "stereo.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SPMATCH_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define SPMATCH_NEON
+#include <arm_neon.h>
+#endif
+
+
+// Pixel layout. See StereoImage::packPixels()
+static const size_t STRIDE = StereoImage::PIXEL_STRIDE;
+static const size_t RED = StereoImage::RED;
+static const size_t GRAD_X = StereoImage::GRAD_X;
+static const size_t GRAD_Y = StereoImage::GRAD_Y;
+
+
+// All the kernels follow StereoImage::pixelWindowCost(), the reference.
+// A group of adjacent pixels in a row of the window is processed at once:
+// the pixels of this view and their weights are loaded once for the group,
+// then, for each plane, disparity, coordinate of the other pixel,
+// interpolation, truncated distances and weighting. Lanes of the group that
+// fall out of the window, and out-of-bounds pixels with NAN_COST, are
+// masked out from the sums. Planes that can't win are skipped from the next
+// row on.
+// Arithmetic is in single precision, so the result can differ from the
+// reference in the last digits, and a pixel that maps right on the border
+// of the other view can be classified differently.
+
+
+/**************************************************************************
+* > cantWin()                                                             *
+* Whether the sum of a plane can stop after row iH, because its window    *
+* cost can't be lower than bound. "Can't" is for any value of the         *
+* remaining pixels: costs are not negative, so at best they are all valid *
+* with cost 0.                                                            *
+*                                                                         *
+* Args:                                                                   *
+*   p (WindowPlane): the plane and its window                             *
+*   bound (double): the cost to beat                                      *
+*   iH (size_t): the last row in the sums                                 *
+*   total (double): sum of the weighted costs so far                      *
+*   count (long): number of valid costs so far                            *
+*                                                                         *
+* Returns:                                                                *
+*   (bool): true if the rest of the window can be skipped                 *
+**************************************************************************/
+static inline bool cantWin(const WindowPlane& p, double bound, size_t iH,
+		double total, long count) {
+
+	size_t remaining = (p.maxH - iH) * (p.maxW - p.minW + 1);
+	return iH < p.maxH && total >= bound * (count + remaining);
+}
+
+
+/***********************************************************************
+* > skipPlane()                                                        *
+* Whether the group of pixels [iW, iW+lanes) of row iH has nothing to  *
+* add to plane k: the plane is stopped, or the group is outside its    *
+* window.                                                              *
+*                                                                      *
+* Args:                                                                *
+*   t (WindowTask): the window                                         *
+*   sum (WindowSum): the stopped planes                                *
+*   k (size_t): the plane                                              *
+*   iW (size_t), iH (size_t): the first pixel of the group             *
+*   lanes (size_t): the pixels of the group                            *
+*                                                                      *
+* Returns:                                                             *
+*   (bool): true if the plane can be skipped                           *
+***********************************************************************/
+static inline bool skipPlane(const WindowTask& t, const WindowSum& sum,
+		size_t k, size_t iW, size_t iH, size_t lanes) {
+
+	const WindowPlane& p = t.planes[k];
+	return sum.stopped[k] || iH < p.minH || iH > p.maxH ||
+			iW > p.maxW || iW + lanes <= p.minW;
+}
+
+
+/***********************************************************************
+* > endRow()                                                           *
+* Adds the row sums of the running planes to their totals, and stops   *
+* the planes that can't win.                                           *
+*                                                                      *
+* Args:                                                                *
+*   t (WindowTask): the window                                         *
+*   iH (size_t): the row just summed                                   *
+*   rowSums (double*): the sum of the row, for each plane              *
+*   sum (WindowSum&): totals and stopped planes. Updated               *
+*                                                                      *
+* Returns:                                                             *
+*   (bool): true if no plane has rows left to sum                      *
+***********************************************************************/
+static inline bool endRow(const WindowTask& t, size_t iH,
+		const double* rowSums, WindowSum& sum) {
+
+	bool allDone = true;
+	for (size_t k = 0; k < t.nPlanes; ++k) {
+		const WindowPlane& p = t.planes[k];
+		if (sum.stopped[k] || iH < p.minH || iH > p.maxH) {
+			allDone = allDone && (sum.stopped[k] || iH >= p.maxH);
+			continue;
+		}
+		sum.cost[k] += rowSums[k];
+		sum.stopped[k] = cantWin(p, t.bound, iH, sum.cost[k], sum.count[k]);
+		allDone = allDone && (sum.stopped[k] || iH >= p.maxH);
+	}
+	return allDone;
+}
+
+
+#ifdef SPMATCH_X86
+
+/**************************************************************************
+* > windowCostAvx2()                                                      *
+* The window cost, for groups of 8 pixels. See WindowTask and WindowSum.  *
+* NOTE: requires AVX2 and FMA. Don't call it without checking the CPU.    *
+*                                                                         *
+* Template args:                                                          *
+*   PLANES (size_t): max number of planes. With 1, the sums of the plane  *
+*       stay in registers                                                 *
+*                                                                         *
+* Args:                                                                   *
+*   t (WindowTask): the window                                            *
+*                                                                         *
+* Returns:                                                                *
+*   (WindowSum): weighted sums and counts of the costs                    *
+**************************************************************************/
+template<size_t PLANES>
+__attribute__((target("avx2,fma")))
+static WindowSum windowCostAvx2(const WindowTask& t) {
+
+	const size_t LANES = 8;
+	const Params::OutOfBounds mode = params.OUT_OF_BOUNDS;
+
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 alfa = _mm256_set1_ps(params.ALFA);
+	const __m256 notAlfa = _mm256_set1_ps(1 - params.ALFA);
+	const __m256 tauCol = _mm256_set1_ps(params.TAU_COL);
+	const __m256 tauGrad = _mm256_set1_ps(params.TAU_GRAD);
+	const __m256 minD = _mm256_set1_ps(params.MIN_D);
+	const __m256 maxD = _mm256_set1_ps(params.MAX_D);
+	const __m256 sign = _mm256_set1_ps(t.sign);
+	const __m256 lastQ = _mm256_set1_ps(t.otherWidth - 1);
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256 lanesF = _mm256_cvtepi32_ps(lanes);
+	const __m256i lanesLow = _mm256_setr_epi64x(0, 1, 2, 3);
+	const __m256i lanesHigh = _mm256_setr_epi64x(4, 5, 6, 7);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i stride = _mm256_set1_epi32(STRIDE);
+	const __m256i lastQi = _mm256_set1_epi32(t.otherWidth - 1);
+	const __m256i lastW = _mm256_set1_epi32(t.maxW);
+
+	const size_t nPlanes = (PLANES == 1) ? 1 : t.nPlanes;
+	WindowSum sum = {};
+	for (size_t iH = t.minH; iH <= t.maxH; ++iH) {
+		const float* pRow = t.pixels + iH * t.width * STRIDE;
+		const float* qRow = t.otherPixels + iH * t.otherWidth * STRIDE;
+		const double* wRow = t.weights + (iH - t.minH) * t.weightsStride;
+
+		__m256 rowSum[PLANES];
+		for (size_t k = 0; k < nPlanes; ++k) {
+			rowSum[k] = zero;
+		}
+
+		for (size_t iW = t.minW; iW <= t.maxW; iW += LANES) {
+			long n = std::min(LANES, t.maxW + 1 - iW);
+			__m256i col = _mm256_add_epi32(_mm256_set1_epi32(iW), lanes);
+			__m256 colF = _mm256_cvtepi32_ps(col);
+
+			// Pixels of this view
+			__m256i pIdx = _mm256_mullo_epi32(_mm256_min_epi32(col, lastW), stride);
+			__m256 p[GRAD_Y + 1];
+			for (size_t c = RED; c <= GRAD_Y; ++c) {
+				p[c] = _mm256_i32gather_ps(pRow + c, pIdx, 4);
+			}
+
+			// Weights. Masked loads don't read past the window
+			const double* weights = wRow + (iW - t.minW);
+			__m256i nLanes = _mm256_set1_epi64x(n);
+			__m128 wLow = _mm256_cvtpd_ps(_mm256_maskload_pd(weights,
+					_mm256_cmpgt_epi64(nLanes, lanesLow)));
+			__m128 wHigh = _mm256_cvtpd_ps(_mm256_maskload_pd(weights + 4,
+					_mm256_cmpgt_epi64(nLanes, lanesHigh)));
+			__m256 weight = _mm256_insertf128_ps(_mm256_castps128_ps256(wLow),
+					wHigh, 1);
+
+			for (size_t k = 0; k < nPlanes; ++k) {
+				if (skipPlane(t, sum, k, iW, iH, LANES)) { continue; }
+				const WindowPlane& plane = t.planes[k];
+
+				// Lanes in the window of this plane
+				__m256i beforeEnd = _mm256_set1_epi32(plane.maxW + 1);
+				__m256i afterStart = _mm256_set1_epi32(long(plane.minW) - 1);
+				__m256 active = _mm256_castsi256_ps(_mm256_and_si256(
+						_mm256_cmpgt_epi32(col, afterStart),
+						_mm256_cmpgt_epi32(beforeEnd, col)));
+
+				// Disparity and coordinate of the other pixels
+				__m256 d = _mm256_fmadd_ps(_mm256_set1_ps(plane.a), lanesF,
+						_mm256_set1_ps(plane.a * iW + plane.b * iH + plane.c));
+				if (params.PLANES_SATURATION) {
+					d = _mm256_min_ps(_mm256_max_ps(d, minD), maxD);
+				}
+				__m256 qW = _mm256_fmadd_ps(sign, d, colF);
+
+				// Out of the other view?
+				__m256 out = _mm256_and_ps(active, _mm256_or_ps(
+						_mm256_cmp_ps(qW, zero, _CMP_LT_OQ),
+						_mm256_cmp_ps(qW, lastQ, _CMP_GT_OQ)));
+				if (mode == Params::OutOfBounds::ERROR &&
+						_mm256_movemask_ps(out) != 0) {
+					sum.outOfBounds = true;
+					return sum;
+				}
+
+				// The two pixels around qW. Clamped, so that every read is valid
+				qW = _mm256_min_ps(_mm256_max_ps(qW, zero), lastQ);
+				__m256 qLowF = _mm256_floor_ps(qW);
+				__m256 x = _mm256_sub_ps(qW, qLowF);
+				__m256i qLow = _mm256_cvttps_epi32(qLowF);
+				__m256i qHigh = _mm256_min_epi32(_mm256_add_epi32(qLow, one),
+						lastQi);
+
+				__m256i q0Idx = _mm256_mullo_epi32(qLow, stride);
+				__m256i q1Idx = _mm256_mullo_epi32(qHigh, stride);
+
+				// L1 distances
+				__m256 colourDist = zero;
+				__m256 gradientDist = zero;
+				for (size_t c = RED; c <= GRAD_Y; ++c) {
+					__m256 q0 = _mm256_i32gather_ps(qRow + c, q0Idx, 4);
+					__m256 q1 = _mm256_i32gather_ps(qRow + c, q1Idx, 4);
+					__m256 q = _mm256_fmadd_ps(x, _mm256_sub_ps(q1, q0), q0);
+					if (mode == Params::OutOfBounds::BLACK_PIXEL) {
+						q = _mm256_andnot_ps(out, q);
+					}
+
+					__m256 dist = _mm256_and_ps(absMask, _mm256_sub_ps(p[c], q));
+					if (c < GRAD_X) {
+						colourDist = _mm256_add_ps(colourDist, dist);
+					} else {
+						gradientDist = _mm256_add_ps(gradientDist, dist);
+					}
+				}
+
+				// Function
+				__m256 cost = _mm256_fmadd_ps(notAlfa,
+						_mm256_min_ps(colourDist, tauCol),
+						_mm256_mul_ps(alfa, _mm256_min_ps(gradientDist, tauGrad)));
+				if (mode == Params::OutOfBounds::ZERO_COST) {
+					cost = _mm256_andnot_ps(out, cost);
+				}
+
+				__m256 valid = active;
+				if (mode == Params::OutOfBounds::NAN_COST) {
+					valid = _mm256_andnot_ps(out, active);
+				}
+
+				// Accumulate
+				rowSum[k] = _mm256_add_ps(rowSum[k],
+						_mm256_and_ps(valid, _mm256_mul_ps(weight, cost)));
+				sum.count[k] += __builtin_popcount(_mm256_movemask_ps(valid));
+			}
+		}
+
+		double rowSums[PLANES];
+		for (size_t k = 0; k < nPlanes; ++k) {
+			float sums[LANES];
+			_mm256_storeu_ps(sums, rowSum[k]);
+			rowSums[k] = 0;
+			for (size_t i = 0; i < LANES; ++i) {
+				rowSums[k] += sums[i];
+			}
+		}
+		if (endRow(t, iH, rowSums, sum)) {
+			break;
+		}
+	}
+
+	return sum;
+}
+
+
+// GCC 12 warns on the '__Y' of the AVX-512 intrinsics, that are
+// _mm512_undefined_*() on purpose (GCC bug 105593, fixed in 12.3)
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+/**************************************************************************
+* > windowCostAvx512()                                                    *
+* The window cost, for groups of 16 pixels. See WindowTask and WindowSum. *
+* NOTE: requires AVX-512F. Don't call it without checking the CPU.        *
+*                                                                         *
+* Template args:                                                          *
+*   PLANES (size_t): max number of planes. With 1, the sums of the plane  *
+*       stay in registers                                                 *
+*                                                                         *
+* Args:                                                                   *
+*   t (WindowTask): the window                                            *
+*                                                                         *
+* Returns:                                                                *
+*   (WindowSum): weighted sums and counts of the costs                    *
+**************************************************************************/
+template<size_t PLANES>
+__attribute__((target("avx512f")))
+static WindowSum windowCostAvx512(const WindowTask& t) {
+
+	const size_t LANES = 16;
+	const Params::OutOfBounds mode = params.OUT_OF_BOUNDS;
+
+	const __m512 zero = _mm512_setzero_ps();
+	const __m512 alfa = _mm512_set1_ps(params.ALFA);
+	const __m512 notAlfa = _mm512_set1_ps(1 - params.ALFA);
+	const __m512 tauCol = _mm512_set1_ps(params.TAU_COL);
+	const __m512 tauGrad = _mm512_set1_ps(params.TAU_GRAD);
+	const __m512 minD = _mm512_set1_ps(params.MIN_D);
+	const __m512 maxD = _mm512_set1_ps(params.MAX_D);
+	const __m512 sign = _mm512_set1_ps(t.sign);
+	const __m512 lastQ = _mm512_set1_ps(t.otherWidth - 1);
+	const __m512i absMask = _mm512_set1_epi32(0x7fffffff);
+
+	const __m512i lanes = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+			7, 6, 5, 4, 3, 2, 1, 0);
+	const __m512 lanesF = _mm512_cvtepi32_ps(lanes);
+	const __m512i one = _mm512_set1_epi32(1);
+	const __m512i stride = _mm512_set1_epi32(STRIDE);
+	const __m512i lastQi = _mm512_set1_epi32(t.otherWidth - 1);
+	const __m512i lastW = _mm512_set1_epi32(t.maxW);
+
+	const size_t nPlanes = (PLANES == 1) ? 1 : t.nPlanes;
+	WindowSum sum = {};
+	for (size_t iH = t.minH; iH <= t.maxH; ++iH) {
+		const float* pRow = t.pixels + iH * t.width * STRIDE;
+		const float* qRow = t.otherPixels + iH * t.otherWidth * STRIDE;
+		const double* wRow = t.weights + (iH - t.minH) * t.weightsStride;
+
+		__m512 rowSum[PLANES];
+		for (size_t k = 0; k < nPlanes; ++k) {
+			rowSum[k] = zero;
+		}
+
+		for (size_t iW = t.minW; iW <= t.maxW; iW += LANES) {
+			size_t n = std::min(LANES, t.maxW + 1 - iW);
+			__mmask16 loaded = (n == LANES) ? 0xFFFF : ((1u << n) - 1);
+			__m512i col = _mm512_add_epi32(_mm512_set1_epi32(iW), lanes);
+			__m512 colF = _mm512_cvtepi32_ps(col);
+
+			// Pixels of this view
+			__m512i pIdx = _mm512_mullo_epi32(_mm512_min_epi32(col, lastW), stride);
+			__m512 p[GRAD_Y + 1];
+			for (size_t c = RED; c <= GRAD_Y; ++c) {
+				p[c] = _mm512_i32gather_ps(pIdx, pRow + c, 4);
+			}
+
+			// Weights. Masked loads don't read past the window
+			const double* weights = wRow + (iW - t.minW);
+			__m256 wLow = _mm512_cvtpd_ps(_mm512_maskz_loadu_pd(
+					loaded & 0xFF, weights));
+			__m256 wHigh = _mm512_cvtpd_ps(_mm512_maskz_loadu_pd(
+					loaded >> 8, weights + 8));
+			__m512 weight = _mm512_castpd_ps(_mm512_insertf64x4(
+					_mm512_castps_pd(_mm512_castps256_ps512(wLow)),
+					_mm256_castps_pd(wHigh), 1));
+
+			for (size_t k = 0; k < nPlanes; ++k) {
+				if (skipPlane(t, sum, k, iW, iH, LANES)) { continue; }
+				const WindowPlane& plane = t.planes[k];
+
+				// Lanes in the window of this plane
+				__mmask16 active =
+						_mm512_cmpge_epi32_mask(col, _mm512_set1_epi32(plane.minW)) &
+						_mm512_cmple_epi32_mask(col, _mm512_set1_epi32(plane.maxW));
+
+				// Disparity and coordinate of the other pixels
+				__m512 d = _mm512_fmadd_ps(_mm512_set1_ps(plane.a), lanesF,
+						_mm512_set1_ps(plane.a * iW + plane.b * iH + plane.c));
+				if (params.PLANES_SATURATION) {
+					d = _mm512_min_ps(_mm512_max_ps(d, minD), maxD);
+				}
+				__m512 qW = _mm512_fmadd_ps(sign, d, colF);
+
+				// Out of the other view?
+				__mmask16 out = active &
+						(_mm512_cmp_ps_mask(qW, zero, _CMP_LT_OQ) |
+						_mm512_cmp_ps_mask(qW, lastQ, _CMP_GT_OQ));
+				if (mode == Params::OutOfBounds::ERROR && out != 0) {
+					sum.outOfBounds = true;
+					return sum;
+				}
+				__mmask16 in = ~out;
+
+				// The two pixels around qW. Clamped, so that every read is valid
+				qW = _mm512_min_ps(_mm512_max_ps(qW, zero), lastQ);
+				__m512 qLowF = _mm512_roundscale_ps(qW,
+						_MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+				__m512 x = _mm512_sub_ps(qW, qLowF);
+				__m512i qLow = _mm512_cvttps_epi32(qLowF);
+				__m512i qHigh = _mm512_min_epi32(_mm512_add_epi32(qLow, one),
+						lastQi);
+
+				__m512i q0Idx = _mm512_mullo_epi32(qLow, stride);
+				__m512i q1Idx = _mm512_mullo_epi32(qHigh, stride);
+
+				// L1 distances
+				__m512 colourDist = zero;
+				__m512 gradientDist = zero;
+				for (size_t c = RED; c <= GRAD_Y; ++c) {
+					__m512 q0 = _mm512_i32gather_ps(q0Idx, qRow + c, 4);
+					__m512 q1 = _mm512_i32gather_ps(q1Idx, qRow + c, 4);
+					__m512 q = _mm512_fmadd_ps(x, _mm512_sub_ps(q1, q0), q0);
+					if (mode == Params::OutOfBounds::BLACK_PIXEL) {
+						q = _mm512_maskz_mov_ps(in, q);
+					}
+
+					__m512 dist = _mm512_castsi512_ps(_mm512_and_si512(absMask,
+							_mm512_castps_si512(_mm512_sub_ps(p[c], q))));
+					if (c < GRAD_X) {
+						colourDist = _mm512_add_ps(colourDist, dist);
+					} else {
+						gradientDist = _mm512_add_ps(gradientDist, dist);
+					}
+				}
+
+				// Function
+				__m512 cost = _mm512_fmadd_ps(notAlfa,
+						_mm512_min_ps(colourDist, tauCol),
+						_mm512_mul_ps(alfa, _mm512_min_ps(gradientDist, tauGrad)));
+				if (mode == Params::OutOfBounds::ZERO_COST) {
+					cost = _mm512_maskz_mov_ps(in, cost);
+				}
+
+				__mmask16 valid = active;
+				if (mode == Params::OutOfBounds::NAN_COST) {
+					valid = active & in;
+				}
+
+				// Accumulate
+				rowSum[k] = _mm512_mask_add_ps(rowSum[k], valid, rowSum[k],
+						_mm512_mul_ps(weight, cost));
+				sum.count[k] += __builtin_popcount(valid);
+			}
+		}
+
+		double rowSums[PLANES];
+		for (size_t k = 0; k < nPlanes; ++k) {
+			rowSums[k] = _mm512_reduce_add_ps(rowSum[k]);
+		}
+		if (endRow(t, iH, rowSums, sum)) {
+			break;
+		}
+	}
+
+	return sum;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif // SPMATCH_X86
+
+
+#ifdef SPMATCH_NEON
+
+/**************************************************************************
+* > windowCostNeon()                                                      *
+* The window cost, for groups of 4 pixels. See WindowTask and WindowSum.  *
+* NEON has no gathers: the pixels of each group are loaded lane by lane,  *
+* the rest is vectorized.                                                 *
+*                                                                         *
+* Template args:                                                          *
+*   PLANES (size_t): max number of planes. With 1, the sums of the plane  *
+*       stay in registers                                                 *
+*                                                                         *
+* Args:                                                                   *
+*   t (WindowTask): the window                                            *
+*                                                                         *
+* Returns:                                                                *
+*   (WindowSum): weighted sums and counts of the costs                    *
+**************************************************************************/
+template<size_t PLANES>
+static WindowSum windowCostNeon(const WindowTask& t) {
+
+	const size_t LANES = 4;
+	const Params::OutOfBounds mode = params.OUT_OF_BOUNDS;
+
+	const float32x4_t zero = vdupq_n_f32(0);
+	const float32x4_t alfa = vdupq_n_f32(params.ALFA);
+	const float32x4_t notAlfa = vdupq_n_f32(1 - params.ALFA);
+	const float32x4_t tauCol = vdupq_n_f32(params.TAU_COL);
+	const float32x4_t tauGrad = vdupq_n_f32(params.TAU_GRAD);
+	const float32x4_t minD = vdupq_n_f32(params.MIN_D);
+	const float32x4_t maxD = vdupq_n_f32(params.MAX_D);
+	const float32x4_t sign = vdupq_n_f32(t.sign);
+	const float32x4_t lastQ = vdupq_n_f32(t.otherWidth - 1);
+
+	const uint32_t lanesArray[LANES] = { 0, 1, 2, 3 };
+	const uint32x4_t lanes = vld1q_u32(lanesArray);
+	const float32x4_t lanesF = vcvtq_f32_u32(lanes);
+
+	const size_t nPlanes = (PLANES == 1) ? 1 : t.nPlanes;
+	WindowSum sum = {};
+	for (size_t iH = t.minH; iH <= t.maxH; ++iH) {
+		const float* pRow = t.pixels + iH * t.width * STRIDE;
+		const float* qRow = t.otherPixels + iH * t.otherWidth * STRIDE;
+		const double* wRow = t.weights + (iH - t.minH) * t.weightsStride;
+
+		float32x4_t rowSum[PLANES];
+		for (size_t k = 0; k < nPlanes; ++k) {
+			rowSum[k] = zero;
+		}
+
+		for (size_t iW = t.minW; iW <= t.maxW; iW += LANES) {
+			size_t n = std::min(LANES, t.maxW + 1 - iW);
+			uint32x4_t col = vaddq_u32(vdupq_n_u32(iW), lanes);
+			float32x4_t colF = vcvtq_f32_u32(col);
+
+			// Pixels of this view
+			float32x4_t p[GRAD_Y + 1];
+			for (size_t c = RED; c <= GRAD_Y; ++c) {
+				float pc[LANES];
+				for (size_t i = 0; i < LANES; ++i) {
+					pc[i] = pRow[std::min(iW + i, t.maxW) * STRIDE + c];
+				}
+				p[c] = vld1q_f32(pc);
+			}
+
+			// Weights. Copied, so that nothing is read past the window
+			double weights[LANES] = { 0, 0, 0, 0 };
+			std::copy(wRow + (iW - t.minW), wRow + (iW - t.minW) + n, weights);
+			float32x4_t weight = vcombine_f32(vcvt_f32_f64(vld1q_f64(weights)),
+					vcvt_f32_f64(vld1q_f64(weights + 2)));
+
+			for (size_t k = 0; k < nPlanes; ++k) {
+				if (skipPlane(t, sum, k, iW, iH, LANES)) { continue; }
+				const WindowPlane& plane = t.planes[k];
+
+				// Lanes in the window of this plane
+				uint32x4_t active = vandq_u32(
+						vcgeq_u32(col, vdupq_n_u32(plane.minW)),
+						vcleq_u32(col, vdupq_n_u32(plane.maxW)));
+
+				// Disparity and coordinate of the other pixels
+				float32x4_t d = vfmaq_f32(
+						vdupq_n_f32(plane.a * iW + plane.b * iH + plane.c),
+						vdupq_n_f32(plane.a), lanesF);
+				if (params.PLANES_SATURATION) {
+					d = vminq_f32(vmaxq_f32(d, minD), maxD);
+				}
+				float32x4_t qW = vfmaq_f32(colF, sign, d);
+
+				// Out of the other view?
+				uint32x4_t out = vandq_u32(active, vorrq_u32(vcltq_f32(qW, zero),
+						vcgtq_f32(qW, lastQ)));
+				if (mode == Params::OutOfBounds::ERROR && vmaxvq_u32(out) != 0) {
+					sum.outOfBounds = true;
+					return sum;
+				}
+
+				// The two pixels around qW. Clamped, so that every read is valid
+				qW = vminq_f32(vmaxq_f32(qW, zero), lastQ);
+				float32x4_t qLowF = vrndmq_f32(qW);
+				float32x4_t x = vsubq_f32(qW, qLowF);
+				uint32_t qLow[LANES];
+				vst1q_u32(qLow, vcvtq_u32_f32(qLowF));
+
+				float q0[GRAD_Y + 1][LANES];
+				float q1[GRAD_Y + 1][LANES];
+				for (size_t i = 0; i < LANES; ++i) {
+					size_t qHigh = std::min<size_t>(qLow[i] + 1, t.otherWidth - 1);
+					const float* q0Pixel = qRow + qLow[i] * STRIDE;
+					const float* q1Pixel = qRow + qHigh * STRIDE;
+					for (size_t c = RED; c <= GRAD_Y; ++c) {
+						q0[c][i] = q0Pixel[c];
+						q1[c][i] = q1Pixel[c];
+					}
+				}
+
+				// L1 distances
+				float32x4_t colourDist = zero;
+				float32x4_t gradientDist = zero;
+				for (size_t c = RED; c <= GRAD_Y; ++c) {
+					float32x4_t q0c = vld1q_f32(q0[c]);
+					float32x4_t q = vfmaq_f32(q0c, x,
+							vsubq_f32(vld1q_f32(q1[c]), q0c));
+					if (mode == Params::OutOfBounds::BLACK_PIXEL) {
+						q = vbslq_f32(out, zero, q);
+					}
+
+					float32x4_t dist = vabdq_f32(p[c], q);
+					if (c < GRAD_X) {
+						colourDist = vaddq_f32(colourDist, dist);
+					} else {
+						gradientDist = vaddq_f32(gradientDist, dist);
+					}
+				}
+
+				// Function
+				float32x4_t cost = vfmaq_f32(
+						vmulq_f32(alfa, vminq_f32(gradientDist, tauGrad)),
+						notAlfa, vminq_f32(colourDist, tauCol));
+				if (mode == Params::OutOfBounds::ZERO_COST) {
+					cost = vbslq_f32(out, zero, cost);
+				}
+
+				uint32x4_t valid = active;
+				if (mode == Params::OutOfBounds::NAN_COST) {
+					valid = vbicq_u32(active, out);
+				}
+
+				// Accumulate
+				rowSum[k] = vaddq_f32(rowSum[k],
+						vbslq_f32(valid, vmulq_f32(weight, cost), zero));
+				sum.count[k] += vaddvq_u32(vshrq_n_u32(valid, 31));
+			}
+		}
+
+		double rowSums[PLANES];
+		for (size_t k = 0; k < nPlanes; ++k) {
+			rowSums[k] = vaddvq_f32(rowSum[k]);
+		}
+		if (endRow(t, iH, rowSums, sum)) {
+			break;
+		}
+	}
+
+	return sum;
+}
+
+#endif // SPMATCH_NEON
+
+
+/*************************************************************************
+* > byPlanes()                                                           *
+* A kernel that runs the single-plane instance SINGLE if the task has    *
+* one plane, the general instance ANY otherwise.                         *
+*                                                                        *
+* Args:                                                                  *
+*   t (WindowTask): the window                                           *
+*                                                                        *
+* Returns:                                                               *
+*   (WindowSum): weighted sums and counts of the costs                   *
+*************************************************************************/
+template<WindowKernel SINGLE, WindowKernel ANY>
+static WindowSum byPlanes(const WindowTask& t) {
+	return (t.nPlanes == 1) ? SINGLE(t) : ANY(t);
+}
+
+
+/**************************************************************************
+* > selectWindowKernel()                                                  *
+* Returns the implementation of the window cost for this CPU. With AUTO,  *
+* the widest supported instruction set is used. With SCALAR, or if no     *
+* vectorized kernel is supported, it returns nullptr: that is, use the    *
+* reference StereoImage::pixelWindowCost(). Throws a runtime_error if an  *
+* explicit choice is not supported.                                       *
+*                                                                         *
+* Args:                                                                   *
+*   choice (Params::Kernel): the requested implementation                 *
+*                                                                         *
+* Returns:                                                                *
+*   (WindowKernel): the kernel, or nullptr                                *
+**************************************************************************/
+WindowKernel selectWindowKernel(Params::Kernel choice) {
+
+	// CPU features
+	bool hasAvx2 = false;
+	bool hasAvx512 = false;
+	bool hasNeon = false;
+#ifdef SPMATCH_X86
+	__builtin_cpu_init();
+	hasAvx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	hasAvx512 = __builtin_cpu_supports("avx512f");
+#endif
+#ifdef SPMATCH_NEON
+	hasNeon = true;     // NEON is always available on AArch64
+#endif
+
+	switch (choice) {
+		case Params::Kernel::SCALAR:
+			return nullptr;
+
+		case Params::Kernel::AUTO:
+			if (hasAvx512) { return selectWindowKernel(Params::Kernel::AVX512); }
+			if (hasAvx2) { return selectWindowKernel(Params::Kernel::AVX2); }
+			if (hasNeon) { return selectWindowKernel(Params::Kernel::NEON); }
+			return nullptr;
+
+		case Params::Kernel::AVX2:
+#ifdef SPMATCH_X86
+			if (hasAvx2) {
+				return byPlanes<windowCostAvx2<1>, windowCostAvx2<MAX_WINDOW_PLANES>>;
+			}
+#endif
+			throw std::runtime_error("selectWindowKernel(). AVX2 is not supported");
+
+		case Params::Kernel::AVX512:
+#ifdef SPMATCH_X86
+			if (hasAvx512) {
+				return byPlanes<windowCostAvx512<1>,
+						windowCostAvx512<MAX_WINDOW_PLANES>>;
+			}
+#endif
+			throw std::runtime_error(
+					"selectWindowKernel(). AVX-512 is not supported");
+
+		case Params::Kernel::NEON:
+#ifdef SPMATCH_NEON
+			if (hasNeon) {
+				return byPlanes<windowCostNeon<1>, windowCostNeon<MAX_WINDOW_PLANES>>;
+			}
+#endif
+			throw std::runtime_error("selectWindowKernel(). NEON is not supported");
+	}
+
+	return nullptr;
+}
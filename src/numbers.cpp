@@ -17,7 +17,8 @@ using std::string;
 * > weightedMedian()                                                    *
 * Return the weighted median value.                                     *
 * NOTE: cost is O(n log(n)), where n is the number of values.           *
-*   The input is copied in memory.                                      *
+*   The input is copied in memory, reused by the next calls of this     *
+*   thread.                                                             *
 *                                                                       *
 * Args:                                                                 *
 *   values (vector<double>): the vector of values                       *
@@ -55,7 +56,8 @@ double weightedMedian(const vector<double>& values,
 	}
 
 	// Copy the input into a single vector
-	vector<pair<double, double>> vec;
+	static thread_local vector<pair<double, double>> vec;
+	vec.clear();
 	for (size_t i = 0; i < values.size(); ++i) {
 		vec.push_back(std::make_pair(values[i], weights[i]));
 	}
@@ -94,3 +96,260 @@ double weightedMedian(const vector<double>& values,
 	// Should never happen
 	throw std::logic_error("weightedMedian(). no number selected as output");
 }
+
+
+/**************************************************************************
+* > boxFilter()                                                           *
+* The mean of each (2*radius + 1)^2 window of an image. Near the borders, *
+* the window is cut: the mean is over the pixels in the image only.       *
+* Row sums, then a running sum of the rows: O(1) for each pixel.          *
+*                                                                         *
+* Args:                                                                   *
+*   in (vector<float>): the image, by rows                                *
+*   width (size_t), height (size_t): the size of the image                *
+*   radius (unsigned): the half side of the window                        *
+*   out (vector<float>): the filtered image. Resized if necessary         *
+**************************************************************************/
+void boxFilter(const vector<float>& in, size_t width, size_t height,
+		unsigned radius, vector<float>& out) {
+
+	if (in.size() != width * height) {
+		throw std::invalid_argument("boxFilter(). inconsistent sizes");
+	}
+	out.resize(width * height);
+
+	// Horizontal means
+	vector<float> rows(width * height);
+	vector<double> prefix(width + 1);
+	for (size_t h = 0; h < height; ++h) {
+		const float* row = &in[h * width];
+		prefix[0] = 0;
+		for (size_t w = 0; w < width; ++w) {
+			prefix[w + 1] = prefix[w] + row[w];
+		}
+		for (size_t w = 0; w < width; ++w) {
+			size_t first = (w > radius) ? (w - radius) : 0;
+			size_t last = std::min(w + radius + 1, width);
+			rows[h * width + w] = (prefix[last] - prefix[first]) / (last - first);
+		}
+	}
+
+	// Vertical means: running sum of the rows [first, last)
+	vector<double> sums(width, 0);
+	size_t first = 0, last = 0;
+	for (size_t h = 0; h < height; ++h) {
+		for (; last < std::min<size_t>(h + radius + 1, height); ++last) {
+			for (size_t w = 0; w < width; ++w) { sums[w] += rows[last * width + w]; }
+		}
+		for (; first + radius < h; ++first) {
+			for (size_t w = 0; w < width; ++w) { sums[w] -= rows[first * width + w]; }
+		}
+		for (size_t w = 0; w < width; ++w) {
+			out[h * width + w] = sums[w] / (last - first);
+		}
+	}
+}
+
+
+// > class CounterRandom
+
+/*******************************************************************
+* > nextBlock()                                                    *
+* Computes the block of the current counter, the 10 rounds of      *
+* Philox4x32, then increments the counter (its last word).         *
+*******************************************************************/
+void CounterRandom::nextBlock(void) {
+
+	const uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;    // multipliers
+	const uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;    // key increments
+
+	uint32_t c[4] = { counter[0], counter[1], counter[2], counter[3] };
+	uint32_t k0 = key[0], k1 = key[1];
+	for (unsigned round = 0; round < 10; ++round) {
+		uint64_t p0 = uint64_t(M0) * c[0];
+		uint64_t p1 = uint64_t(M1) * c[2];
+		uint32_t r[4] = { uint32_t(p1 >> 32) ^ c[1] ^ k0, uint32_t(p1),
+				uint32_t(p0 >> 32) ^ c[3] ^ k1, uint32_t(p0) };
+		std::copy(r, r + 4, c);
+		k0 += W0;
+		k1 += W1;
+	}
+
+	std::copy(c, c + 4, block);
+	next = 0;
+	++counter[3];
+}
+
+
+// > class JointHistogram
+
+const size_t JointHistogram::BLOCK;
+
+/****************************************************************************
+* The values of each colour bin are counted in 'counts', and also by blocks *
+* of BLOCK bins in 'blockCounts'. So median() first finds the block of the  *
+* median, then the bin within that block: a query costs                     *
+* O(colourBins * (valueBins / BLOCK + BLOCK)), whatever the window size.    *
+****************************************************************************/
+
+/******************************************************
+* > JointHistogram()                                  *
+* Constructor. An empty histogram.                    *
+*                                                     *
+* Args:                                               *
+*   colourBins (size_t): the number of colour bins    *
+*   valueBins (size_t): the number of value bins      *
+******************************************************/
+JointHistogram::JointHistogram(size_t colourBins, size_t valueBins) {
+	reset(colourBins, valueBins);
+}
+
+
+/******************************************************************
+* > reset()                                                       *
+* Empties the histogram, with new numbers of bins. The memory is  *
+* reused: nothing is allocated if the bins are not more than the  *
+* previous ones.                                                  *
+*                                                                 *
+* Args:                                                           *
+*   colourBins (size_t): the number of colour bins                *
+*   valueBins (size_t): the number of value bins                  *
+******************************************************************/
+void JointHistogram::reset(size_t colourBins, size_t valueBins) {
+
+	if (colourBins == 0 || valueBins == 0) {
+		throw std::invalid_argument("reset(). No bins");
+	}
+
+	this->colourBins = colourBins;
+	this->valueBins = valueBins;
+	blocks = (valueBins + BLOCK - 1) / BLOCK;
+	counts.assign(colourBins * valueBins, 0);
+	blockCounts.assign(colourBins * blocks, 0);
+	colourCounts.assign(colourBins, 0);
+	colourSums.assign(colourBins * 3, 0);
+	weights.resize(colourBins);
+	sums.resize(std::max(blocks, BLOCK));
+}
+
+
+/*************************************************
+* > empty()                                      *
+* Returns:                                       *
+*   (bool): true if no pixel is in the histogram *
+*************************************************/
+bool JointHistogram::empty(void) const {
+
+	for (unsigned count: colourCounts) {
+		if (count > 0) { return false; }
+	}
+	return true;
+}
+
+
+/******************************************************
+* > add()                                             *
+* Adds a pixel to the histogram.                      *
+* NOTE: bins are not checked.                         *
+*                                                     *
+* Args:                                               *
+*   colour (size_t): the colour bin of the pixel      *
+*   value (size_t): the value bin of the pixel        *
+*   rgb (float*): the colour of the pixel             *
+******************************************************/
+void JointHistogram::add(size_t colour, size_t value, const float* rgb) {
+
+	++counts[colour * valueBins + value];
+	++blockCounts[colour * blocks + value / BLOCK];
+	++colourCounts[colour];
+	for (size_t i = 0; i < 3; ++i) {
+		colourSums[colour * 3 + i] += rgb[i];
+	}
+}
+
+
+/******************************************************
+* > remove()                                          *
+* Removes a pixel added with the same arguments.      *
+* NOTE: bins are not checked.                         *
+*                                                     *
+* Args:                                               *
+*   colour (size_t), value (size_t), rgb (float*):    *
+*       as in add()                                   *
+******************************************************/
+void JointHistogram::remove(size_t colour, size_t value, const float* rgb) {
+
+	--counts[colour * valueBins + value];
+	--blockCounts[colour * blocks + value / BLOCK];
+	--colourCounts[colour];
+	for (size_t i = 0; i < 3; ++i) {
+		colourSums[colour * 3 + i] -= rgb[i];
+	}
+}
+
+
+/****************************************************************************
+* > median()                                                                *
+* Returns the weighted median of the values in the histogram. Each pixel    *
+* has weight exp(-d/gamma), where d is the L1 distance between 'rgb' and    *
+* the mean colour of the bin of the pixel.                                  *
+*                                                                           *
+* Args:                                                                     *
+*   rgb (float*): colour of the central pixel                               *
+*   gamma (double): as params.GAMMA                                         *
+*                                                                           *
+* Returns:                                                                  *
+*   (size_t): the value bin of the median                                   *
+****************************************************************************/
+size_t JointHistogram::median(const float* rgb, double gamma) {
+
+	if (empty()) {
+		throw std::logic_error("JointHistogram::median(). Empty histogram");
+	}
+
+	// Weight of each colour bin
+	double total = 0;
+	for (size_t c = 0; c < colourBins; ++c) {
+		weights[c] = 0;
+		if (colourCounts[c] == 0) { continue; }
+		double dist = 0;
+		for (size_t i = 0; i < 3; ++i) {
+			dist += std::abs(rgb[i] - colourSums[c * 3 + i] / colourCounts[c]);
+		}
+		weights[c] = std::exp(-dist/gamma);
+		total += weights[c] * colourCounts[c];
+	}
+
+	// Weight of a block or of a bin
+	auto sumOver = [&] (const std::vector<unsigned>& table, size_t stride,
+			size_t first, size_t n) {
+		std::fill(sums.begin(), sums.begin() + n, 0);
+		for (size_t c = 0; c < colourBins; ++c) {
+			if (weights[c] == 0) { continue; }
+			const unsigned* row = &table[c * stride + first];
+			for (size_t i = 0; i < n; ++i) {
+				sums[i] += weights[c] * row[i];
+			}
+		}
+	};
+
+	// The block with the median
+	double half = total / 2;
+	double acc = 0;
+	sumOver(blockCounts, blocks, 0, blocks);
+	size_t block = 0;
+	while (block + 1 < blocks && acc + sums[block] < half) {
+		acc += sums[block++];
+	}
+
+	// The bin with the median
+	size_t first = block * BLOCK;
+	size_t n = std::min(BLOCK, valueBins - first);
+	sumOver(counts, valueBins, first, n);
+	size_t bin = 0;
+	while (bin + 1 < n && acc + sums[bin] < half) {
+		acc += sums[bin++];
+	}
+
+	return first + bin;
+}
@@ -0,0 +1,494 @@
+
+#include "output.hpp"
+
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+#include <fcntl.h>        // Linux specific: open(), mmap()
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+namespace {
+
+	/**********************************************************
+	* > putLittleEndian()                                     *
+	* Stores a 32 bit value at 'out' in little endian order.  *
+	*                                                         *
+	* Args:                                                   *
+	*   out (char*): 4 bytes of memory                        *
+	*   value (uint32_t): the value                           *
+	**********************************************************/
+	void putLittleEndian(char* out, uint32_t value) {
+		for (unsigned i = 0; i < 4; ++i) {
+			out[i] = char((value >> (8 * i)) & 0xff);
+		}
+	}
+
+
+	/*********************************************************
+	* > putLittleEndian()                                    *
+	* Stores a float32 at 'out' in little endian order.      *
+	*                                                        *
+	* Args:                                                  *
+	*   out (char*): 4 bytes of memory                       *
+	*   value (float): the value                             *
+	*********************************************************/
+	void putLittleEndian(char* out, float value) {
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		putLittleEndian(out, bits);
+	}
+
+
+	/*********************************************************
+	* > getLittleEndian()                                    *
+	* Args:                                                  *
+	*   in (char*): 4 bytes of memory                        *
+	*                                                        *
+	* Returns:                                               *
+	*   (float): the float32 stored there, little endian     *
+	*********************************************************/
+	float getLittleEndian(const char* in) {
+		uint32_t bits = 0;
+		for (unsigned i = 0; i < 4; ++i) {
+			bits |= uint32_t(static_cast<unsigned char>(in[i])) << (8 * i);
+		}
+		float value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+
+	/*********************************************************************
+	* > mapFile()                                                        *
+	* Creates (or truncates) a file of 'size' bytes, zero filled, and    *
+	* maps it in memory. Unmap it with munmap().                         *
+	*                                                                    *
+	* Args:                                                              *
+	*   path (string): the file                                          *
+	*   size (size_t): its size                                          *
+	*   caller (string): the function name, for the errors               *
+	*                                                                    *
+	* Returns:                                                           *
+	*   (char*): the memory of the file                                  *
+	*********************************************************************/
+	char* mapFile(const string& path, size_t size, const string& caller) {
+
+		int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			throw std::runtime_error(caller + "(). Can't open " + path);
+		}
+		if (::ftruncate(fd, size) != 0) {
+			::close(fd);
+			throw std::runtime_error(caller + "(). Can't resize " + path);
+		}
+		void* memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fd, 0);
+		::close(fd);            // the mapping stays valid
+		if (memory == MAP_FAILED) {
+			throw std::runtime_error(caller + "(). Can't map " + path);
+		}
+		return static_cast<char*>(memory);
+	}
+
+
+	/*********************************************************************
+	* > packRows()                                                       *
+	* Writes the pixels of 'map' as little endian float32, channels      *
+	* interleaved, one row after the other.                              *
+	*                                                                    *
+	* Args:                                                              *
+	*   map (Map): the values: an Image or a FloatMap                    *
+	*   out (char*): width * height * channels * 4 bytes of memory       *
+	*   bottomUp (bool): whether the last row comes first (as in PFM)    *
+	*********************************************************************/
+	template<typename Map>
+	void packRows(const Map& map, char* out, bool bottomUp) {
+
+		size_t width = map.size(0);
+		size_t height = map.size(1);
+		size_t channels = map.size(2);
+
+		for (size_t r = 0; r < height; ++r) {
+			size_t h = bottomUp ? (height - 1 - r) : r;
+			for (size_t w = 0; w < width; ++w) {
+				for (size_t c = 0; c < channels; ++c) {
+					putLittleEndian(out, float(map.get(w, h, c)));
+					out += sizeof(float);
+				}
+			}
+		}
+	}
+
+
+	/**************************************************************
+	* > rawHeader()                                               *
+	* Writes the RawHeader of 'map' in little endian order.       *
+	*                                                             *
+	* Args:                                                       *
+	*   map (Map): the values: an Image or a FloatMap             *
+	*   out (char*): sizeof(RawHeader) bytes of memory            *
+	**************************************************************/
+	template<typename Map>
+	void rawHeader(const Map& map, char* out) {
+
+		uint32_t fields[] = { RawHeader::MAGIC, RawHeader::VERSION,
+				uint32_t(map.size(0)), uint32_t(map.size(1)),
+				uint32_t(map.size(2)) };
+		for (uint32_t field: fields) {
+			putLittleEndian(out, field);
+			out += sizeof(uint32_t);
+		}
+	}
+
+
+	/******************************************************************
+	* > writeCsv()                                                    *
+	* Writes 'map' as text: "w, h, values..." for each pixel, by      *
+	* columns, with 8 significant digits.                             *
+	******************************************************************/
+	template<typename Map>
+	void writeCsv(const Map& map, const string& path) {
+
+		std::ofstream out(path);
+		if (!out) {
+			throw std::runtime_error("writeFloatMap(). Can't open " + path);
+		}
+		out << std::setprecision(8);
+		for (size_t w = 0; w < map.size(0); ++w) {
+			for (size_t h = 0; h < map.size(1); ++h) {
+				out << w << ", " << h;
+				for (size_t c = 0; c < map.size(2); ++c) {
+					out << ", " << map.get(w, h, c);
+				}
+				out << "\n";
+			}
+		}
+	}
+
+
+	/****************************************************************
+	* > writePfm()                                                  *
+	* Writes 'map' as a PFM: "Pf" (gray) or "PF" (RGB), the size,   *
+	* a negative scale for little endian, then the rows bottom-up.  *
+	****************************************************************/
+	template<typename Map>
+	void writePfm(const Map& map, const string& path) {
+
+		string header = string(map.size(2) == 1 ? "Pf" : "PF") + "\n" +
+				std::to_string(map.size(0)) + " " + std::to_string(map.size(1)) +
+				"\n-1.0\n";
+		std::vector<char> data(map.size(0) * map.size(1) * map.size(2) *
+				sizeof(float));
+		packRows(map, data.data(), true);
+
+		std::ofstream out(path, std::ios::binary);
+		if (!out) {
+			throw std::runtime_error("writeFloatMap(). Can't open " + path);
+		}
+		out.write(header.data(), header.size());
+		out.write(data.data(), data.size());
+	}
+
+
+	/**********************************************************
+	* > writeRaw()                                            *
+	* Writes 'map' as a RawHeader followed by the pixels.     *
+	**********************************************************/
+	template<typename Map>
+	void writeRaw(const Map& map, const string& path) {
+
+		std::vector<char> data(sizeof(RawHeader) +
+				map.size(0) * map.size(1) * map.size(2) * sizeof(float));
+		rawHeader(map, data.data());
+		packRows(map, data.data() + sizeof(RawHeader), false);
+
+		std::ofstream out(path, std::ios::binary);
+		if (!out) {
+			throw std::runtime_error("writeFloatMap(). Can't open " + path);
+		}
+		out.write(data.data(), data.size());
+	}
+
+
+	/*******************************************************************
+	* > writeMapped()                                                  *
+	* As writeRaw(), but the file gets its final size first, then it   *
+	* is mapped in memory and the pixels are written in place: no copy *
+	* through a stream buffer.                                         *
+	*******************************************************************/
+	template<typename Map>
+	void writeMapped(const Map& map, const string& path) {
+
+		size_t size = sizeof(RawHeader) +
+				map.size(0) * map.size(1) * map.size(2) * sizeof(float);
+
+		char* out = mapFile(path, size, "writeFloatMap");
+		rawHeader(map, out);
+		packRows(map, out + sizeof(RawHeader), false);
+
+		::munmap(out, size);
+	}
+}
+
+
+/****************************************************************
+* > outputExtension()                                           *
+* Args:                                                         *
+*   format (OutputFormat): a file format                        *
+*                                                               *
+* Returns:                                                      *
+*   (string): the file extension of the format, with the dot    *
+****************************************************************/
+string outputExtension(OutputFormat format) {
+
+	switch (format) {
+		case OutputFormat::CSV:
+			return ".csv";
+		case OutputFormat::PFM:
+			return ".pfm";
+		case OutputFormat::RAW:
+		case OutputFormat::MMAP:
+			return ".raw";
+	}
+	throw std::invalid_argument("outputExtension(). Unknown OutputFormat");
+}
+
+
+/***********************************************************************
+* > writeFloatMap()                                                    *
+* Writes the values of an image (a map of real numbers per pixel) to a *
+* file, in the given format. See OutputFormat.                         *
+*                                                                      *
+* Args:                                                                *
+*   map (Image): the values; 1 or 3 channels                           *
+*   path (string): the output file                                     *
+*   format (OutputFormat): the file format                             *
+***********************************************************************/
+void writeFloatMap(const Image& map, const string& path, OutputFormat format) {
+
+	switch (format) {
+		case OutputFormat::CSV:
+			writeCsv(map, path);
+			return;
+		case OutputFormat::PFM:
+			writePfm(map, path);
+			return;
+		case OutputFormat::RAW:
+			writeRaw(map, path);
+			return;
+		case OutputFormat::MMAP:
+			writeMapped(map, path);
+			return;
+	}
+	throw std::invalid_argument("writeFloatMap(). Unknown OutputFormat");
+}
+
+
+/*********************************************************************
+* > writeFloatMap()                                                  *
+* As above, for a FloatMap in memory. A mapped one is in its file    *
+* already.                                                           *
+*                                                                    *
+* Args:                                                              *
+*   map (FloatMap): the values; not mapped                           *
+*   path (string): the output file                                   *
+*   format (OutputFormat): the file format                           *
+*********************************************************************/
+void writeFloatMap(const FloatMap& map, const string& path,
+		OutputFormat format) {
+
+	if (map.isMapped()) {
+		throw std::logic_error("writeFloatMap(). The map is in a file");
+	}
+
+	switch (format) {
+		case OutputFormat::CSV:
+			writeCsv(map, path);
+			return;
+		case OutputFormat::PFM:
+			writePfm(map, path);
+			return;
+		case OutputFormat::RAW:
+			writeRaw(map, path);
+			return;
+		case OutputFormat::MMAP:
+			writeMapped(map, path);
+			return;
+	}
+	throw std::invalid_argument("writeFloatMap(). Unknown OutputFormat");
+}
+
+
+/**************************************************************************
+* > writeNormalizedImage()                                                *
+* Saves the first channel of a map as an 8 bit image (any format of       *
+* CImg), normalized to [0, 255] as Image::normalize(). Only the 8 bit     *
+* image is allocated, not a copy of the values.                           *
+*                                                                         *
+* Args:                                                                   *
+*   map (FloatMap): the values                                            *
+*   path (string): the image file                                         *
+**************************************************************************/
+void writeNormalizedImage(const FloatMap& map, const string& path) {
+
+	size_t width = map.size(0);
+	size_t height = map.size(1);
+
+	float minValue = std::numeric_limits<float>::infinity();
+	float maxValue = -minValue;
+	for (size_t h = 0; h < height; ++h) {
+		for (size_t w = 0; w < width; ++w) {
+			minValue = std::min(minValue, map.get(w, h));
+			maxValue = std::max(maxValue, map.get(w, h));
+		}
+	}
+
+	CImg<unsigned char> image(width, height, 1, 1, 0);
+	if (maxValue > minValue) {
+		double scale = 255.0 / (double(maxValue) - minValue);
+		for (size_t h = 0; h < height; ++h) {
+			for (size_t w = 0; w < width; ++w) {
+				image(w, h) = (unsigned char)((map.get(w, h) - minValue) * scale);
+			}
+		}
+	}
+	image.save(path.c_str());
+}
+
+
+// > class FloatMap
+
+/**********************************************************
+* > FloatMap()                                            *
+* Constructor. A map in memory, with all values 0.        *
+*                                                         *
+* Args:                                                   *
+*   width (size_t), height (size_t), channels (size_t)    *
+**********************************************************/
+FloatMap::FloatMap(size_t width, size_t height, size_t channels):
+		width(width), height(height), channels(channels),
+		values(width * height * channels, 0) {}
+
+
+/**********************************************************************
+* > FloatMap()                                                        *
+* Constructor. A map mapped onto a new RAW file (see OutputFormat),   *
+* with all values 0. The file is complete at any time: each set()     *
+* writes there.                                                       *
+*                                                                     *
+* Args:                                                               *
+*   width (size_t), height (size_t), channels (size_t)                *
+*   rawPath (string): the file. Replaced if it exists                 *
+**********************************************************************/
+FloatMap::FloatMap(size_t width, size_t height, size_t channels,
+		const string& rawPath):
+		width(width), height(height), channels(channels) {
+
+	mappedSize = sizeof(RawHeader) + width * height * channels * sizeof(float);
+	mapped = mapFile(rawPath, mappedSize, "FloatMap");
+	rawHeader(*this, mapped);
+}
+
+
+// Destructor. Unmaps the file, if mapped
+FloatMap::~FloatMap() {
+	if (mapped) {
+		::munmap(mapped, mappedSize);
+	}
+}
+
+
+/***************************************************************************
+* > size()                                                                 *
+* Args:                                                                    *
+*   dim (unsigned): dimension number. { 0: width, 1: height, 2: channels } *
+*                                                                          *
+* Returns:                                                                 *
+*   (size_t): lenght of dimension 'dim'                                    *
+***************************************************************************/
+size_t FloatMap::size(unsigned dim) const {
+	switch (dim) {
+		case 0:
+			return width;
+		case 1:
+			return height;
+		case 2:
+			return channels;
+		default:
+			throw std::domain_error("size(). " + std::to_string(dim) +
+					" is not a dimension {0,1,2}");
+	}
+}
+
+
+/********************************************************
+* > get()                                               *
+* NOTE: bounds are not checked.                         *
+*                                                       *
+* Args:                                                 *
+*   w (size_t), h (size_t), c (size_t): the value       *
+*                                                       *
+* Returns:                                              *
+*   (float): the value of channel c at (w,h)            *
+********************************************************/
+float FloatMap::get(size_t w, size_t h, size_t c) const {
+
+	size_t i = (h * width + w) * channels + c;
+	if (mapped) {
+		return getLittleEndian(mapped + sizeof(RawHeader) + i * sizeof(float));
+	}
+	return values[i];
+}
+
+
+/********************************************************
+* > set()                                               *
+* Sets channel c at (w,h): in the file, if mapped.      *
+* NOTE: bounds are not checked.                         *
+*                                                       *
+* Args:                                                 *
+*   w (size_t), h (size_t), c (size_t): the value       *
+*   value (float): the new value                        *
+********************************************************/
+void FloatMap::set(size_t w, size_t h, size_t c, float value) {
+
+	size_t i = (h * width + w) * channels + c;
+	if (mapped) {
+		putLittleEndian(mapped + sizeof(RawHeader) + i * sizeof(float), value);
+	} else {
+		values[i] = value;
+	}
+}
+
+
+/********************************************************
+* > operator=()                                         *
+* Move assignment: 'other' becomes an empty map.        *
+********************************************************/
+FloatMap& FloatMap::operator=(FloatMap&& other) {
+
+	if (this != &other) {
+		if (mapped) {
+			::munmap(mapped, mappedSize);
+		}
+		width = other.width;
+		height = other.height;
+		channels = other.channels;
+		values = std::move(other.values);
+		mapped = other.mapped;
+		mappedSize = other.mappedSize;
+
+		other.width = other.height = 0;
+		other.values.clear();
+		other.mapped = nullptr;
+		other.mappedSize = 0;
+	}
+	return *this;
+}
@@ -0,0 +1,244 @@
+
+#include "parallel.hpp"
+
+#include <string>
+#include <stdexcept>
+
+
+// > class ThreadPool
+
+/*********************************************************************
+* > ThreadPool()                                                     *
+* Constructor. Starts nThreads-1 workers: the calling thread of each *
+* parallelFor() is the last one. If nThreads is 0, the number of     *
+* hardware threads is used.                                          *
+*                                                                    *
+* Args:                                                              *
+*   nThreads (unsigned): the number of threads of each loop          *
+*********************************************************************/
+ThreadPool::ThreadPool(unsigned nThreads):
+		next(0) {
+
+	if (nThreads == 0) {
+		nThreads = std::thread::hardware_concurrency();
+	}
+	for (unsigned i = 1; i < nThreads; ++i) {
+		workers.emplace_back(&ThreadPool::workerLoop, this);
+	}
+}
+
+
+/**********************************************
+* > ~ThreadPool()                             *
+* Destructor. Stops and joins all the workers *
+**********************************************/
+ThreadPool::~ThreadPool() {
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeUp.notify_all();
+
+	for (auto& worker: workers) {
+		worker.join();
+	}
+}
+
+
+/**************************************************************
+* > workerLoop()                                              *
+* The main function of each worker: wait for a job, take the  *
+* params of its caller, run some chunks of it, then notify    *
+* the end.                                                    *
+**************************************************************/
+void ThreadPool::workerLoop(void) {
+
+	unsigned seen = 0;
+	while (true) {
+
+		// Wait for a new job
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wakeUp.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping) { return; }
+			seen = generation;
+			params = jobParams;
+		}
+
+		runChunks();
+
+		// Job done
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--running == 0) {
+				done.notify_one();
+			}
+		}
+	}
+}
+
+
+/**********************************************************************
+* > runChunks()                                                       *
+* Runs chunks of the current job until all indices have been taken.   *
+* The first exception is saved and all the remaining indices skipped. *
+**********************************************************************/
+void ThreadPool::runChunks(void) {
+
+	while (true) {
+		size_t first = next.fetch_add(chunk);
+		if (first >= jobEnd) { break; }
+		size_t last = (first + chunk < jobEnd) ? (first + chunk) : jobEnd;
+
+		try {
+			for (size_t i = first; i < last; ++i) {
+				job.call(job.callable, i);
+			}
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!error) {
+				error = std::current_exception();
+			}
+			next = jobEnd;
+		}
+	}
+}
+
+
+/****************************************************************************
+* > runLoop()                                                               *
+* The loop of parallelFor(), with its body type erased. The body lives on   *
+* the stack of the caller, which waits for all the workers before leaving.  *
+*                                                                           *
+* Args:                                                                     *
+*   begin (size_t): the first index                                         *
+*   end (size_t): one past the last index                                   *
+*   body (Body): the loop body                                              *
+****************************************************************************/
+void ThreadPool::runLoop(size_t begin, size_t end, Body body) {
+
+	if (end <= begin) { return; }
+
+	// Sequential
+	if (workers.empty() || end - begin == 1) {
+		for (size_t i = begin; i < end; ++i) {
+			body.call(body.callable, i);
+		}
+		return;
+	}
+
+	// Publish the job
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = body;
+		jobParams = params;
+		next = begin;
+		jobEnd = end;
+		chunk = (end - begin) / (4 * size());
+		if (chunk == 0) { chunk = 1; }
+		running = workers.size();
+		error = nullptr;
+		++generation;
+	}
+	wakeUp.notify_all();
+
+	// Work on it, then wait for the others
+	runChunks();
+	std::exception_ptr jobError;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&] { return running == 0; });
+		job = { nullptr, nullptr };
+		jobError = error;
+		error = nullptr;
+	}
+
+	if (jobError) {
+		std::rethrow_exception(jobError);
+	}
+}
+
+
+// > class ProgressCounter
+
+/**********************************************************************
+* > ProgressCounter()                                                 *
+* Constructor. No item is done.                                       *
+*                                                                     *
+* Args:                                                               *
+*   window (size_t): how many items, after the first not done, can be *
+*       marked                                                        *
+**********************************************************************/
+ProgressCounter::ProgressCounter(size_t window):
+		done(window, false) {
+
+	if (window == 0) {
+		throw std::invalid_argument("ProgressCounter(). Empty window");
+	}
+}
+
+
+/***********************************************************************
+* > markDone()                                                         *
+* Marks an item as done and wakes up the consumers, if the count of    *
+* the items done in order has changed.                                 *
+*                                                                      *
+* Args:                                                                *
+*   item (size_t): the number of the item. Must be in the window: that *
+*       is, in [count, count + window)                                 *
+***********************************************************************/
+void ProgressCounter::markDone(size_t item) {
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// checks
+	if (item < count || item >= count + done.size()) {
+		throw std::logic_error("markDone(). Item " + std::to_string(item) +
+				" is outside the window at " + std::to_string(count));
+	}
+
+	// Advance
+	done[item % done.size()] = true;
+	size_t oldCount = count;
+	while (done[count % done.size()]) {
+		done[count % done.size()] = false;
+		++count;
+	}
+
+	if (count != oldCount) {
+		changed.notify_all();
+	}
+}
+
+
+/************************************************************************
+* > waitFor()                                                           *
+* Blocks until the first n items are done. Throws a runtime_error if    *
+* the counter has been aborted.                                         *
+*                                                                       *
+* Args:                                                                 *
+*   n (size_t): the number of items to wait for                         *
+************************************************************************/
+void ProgressCounter::waitFor(size_t n) {
+
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [&] { return count >= n || aborted; });
+
+	if (count < n) {
+		throw std::runtime_error("waitFor(). The producer has been aborted");
+	}
+}
+
+
+/******************************************************************
+* > abort()                                                       *
+* Wakes up all the consumers: the waiting ones, and those that    *
+* would wait from now on, throw. Used if the producer has failed. *
+******************************************************************/
+void ProgressCounter::abort(void) {
+
+	std::lock_guard<std::mutex> lock(mutex);
+	aborted = true;
+	changed.notify_all();
+}
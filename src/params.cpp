@@ -0,0 +1,171 @@
+#include "params.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+#include "kernels.hpp"
+
+
+// The parameters of this thread
+__thread Params params;
+
+
+/**************************************************************************
+* > defaultParams()                                                       *
+* Returns the defaults values of all the parameters                       *
+* NOTE: these were the paper weights:                                     *
+*   const double ALFA = 0.9;                                              *
+*   const double TAU_COL = 10;                                            *
+*   const double TAU_GRAD = 2;                                            *
+*   const double GAMMA = 10;                                              *
+*   const unsigned int WINDOW_SIZE = 35;                                  *
+* However I can't use them, because I don't know the numeric range of the *
+*   RGB and gradients.                                                    *
+**************************************************************************/
+Params defaultParams(void) {
+
+	Params defaults;
+
+	// Math constants
+	defaults.ALFA = 0.5;
+	defaults.TAU_COL = 60;
+	defaults.TAU_GRAD = 30;
+	defaults.GAMMA = 15;
+	defaults.GUIDED_EPS = 1e-4;
+
+	// Range parameters
+	defaults.WINDOW_SIZE = 35;    // NOTE: Must be an odd number
+	defaults.MIN_D = 0;
+	defaults.MAX_D = 70;          // NOTE: must be positive
+	defaults.ITERATIONS = 3;
+	defaults.PYRAMID_LEVELS = 1;
+	defaults.FINE_ITERATIONS = 1;
+	defaults.TEMPORAL_ITERATIONS = 1;
+	defaults.TEMPORAL_RANDOM = 0;
+	defaults.MAX_SLOPE = 45;
+	defaults.REFINE_CANDIDATES = 1; // NOTE: at most MAX_WINDOW_PLANES
+	defaults.CONVERGENCE = 0;       // 0: always all the iterations
+	defaults.ACTIVE_PIXELS = false;
+
+	// Flag parameters
+	defaults.NORMALIZE_GRADIENTS = true; // With this false, TAU_GRAD must also change
+	defaults.OUT_OF_BOUNDS = Params::OutOfBounds::NAN_COST;
+	defaults.RESIZE_WINDOWS = true;
+	defaults.PLANES_SATURATION = true;
+	defaults.USE_PSEUDORAND = false;
+	defaults.CONST_DISPARITIES = false;
+	defaults.COST_VOLUME = false;
+	defaults.WEIGHTS_CACHE_MB = 32;
+	defaults.COST_CACHE_MB = 0;
+	defaults.COST_CACHE_STEPS = 4;
+	defaults.KERNEL = Params::Kernel::AUTO;
+	defaults.MEDIAN = Params::Median::EXACT;
+	defaults.MEDIAN_BINS = 256;
+	defaults.FUSED_POSTPROCESS = false;
+
+	// Parallel parameters
+	defaults.THREADS = 1;
+	defaults.SCHEDULE = Params::Schedule::WAVEFRONT;
+	defaults.PARALLEL_VIEWS = false;
+	defaults.GPU = false;
+	defaults.TILE_SIZE = 0;       // 0: the whole frame at once
+	defaults.TILE_JOBS = 1;
+	defaults.LOG = 1;             // {0,...,3}. 0 means off
+
+	return defaults;
+}
+
+
+/****************************************************************************
+* > checkParams()                                                           *
+* Throws a runtime_error if a parameter is out of its range: the values     *
+* that would make the computation fail, or allocate without bounds. For the *
+* params of the command line, and for those of a remote request (see        *
+* serveWorker()), which come as raw bytes: so the enums and the bools are   *
+* checked too.                                                              *
+*                                                                           *
+* Args:                                                                     *
+*   p (Params): the parameters to check                                     *
+****************************************************************************/
+void checkParams(const Params& p) {
+
+	// Sanity limits
+	const unsigned MAX_WINDOW_SIZE = 255;
+	const int MAX_DISPARITY = 1 << 16;
+	const unsigned MAX_ITERATIONS = 1000;
+	const unsigned MAX_PYRAMID_LEVELS = 16;
+	const unsigned MAX_CACHE_MB = 1 << 16;
+	const unsigned MAX_CACHE_STEPS = 1024;
+	const unsigned MAX_MEDIAN_BINS = 1 << 16;
+
+	auto check = [] (bool valid, const std::string& message) {
+		if (!valid) {
+			throw std::runtime_error("checkParams(). " + message);
+		}
+	};
+	auto range = [] (long min, long max) {
+		return " must be in [" + std::to_string(min) + ", " +
+				std::to_string(max) + "]";
+	};
+	auto in = [] (double value, double min, double max) {
+		return value >= min && value <= max;     // false for NaN
+	};
+
+	// Math constants
+	check(in(p.ALFA, 0, 1), "alfa" + range(0, 1));
+	check(in(p.TAU_COL, 0, HUGE_VAL) && std::isfinite(p.TAU_COL),
+			"tau_col must be finite, >= 0");
+	check(in(p.TAU_GRAD, 0, HUGE_VAL) && std::isfinite(p.TAU_GRAD),
+			"tau_grad must be finite, >= 0");
+	check(std::isfinite(p.GAMMA) && p.GAMMA > 0, "gamma must be finite, > 0");
+	check(std::isfinite(p.GUIDED_EPS) && p.GUIDED_EPS > 0,
+			"guided_eps must be finite, > 0");
+
+	// Ranges
+	check(p.WINDOW_SIZE % 2 == 1 && p.WINDOW_SIZE <= MAX_WINDOW_SIZE,
+			"window_size must be odd, at most " +
+			std::to_string(MAX_WINDOW_SIZE));
+	check(p.MIN_D <= p.MAX_D && p.MIN_D >= -MAX_DISPARITY &&
+			p.MAX_D <= MAX_DISPARITY, "min_d and max_d must be ordered, in [" +
+			std::to_string(-MAX_DISPARITY) + ", " +
+			std::to_string(MAX_DISPARITY) + "]");
+	check(p.ITERATIONS <= MAX_ITERATIONS &&
+			p.FINE_ITERATIONS <= MAX_ITERATIONS &&
+			p.TEMPORAL_ITERATIONS <= MAX_ITERATIONS,
+			"iterations must be at most " + std::to_string(MAX_ITERATIONS));
+	check(p.PYRAMID_LEVELS >= 1 && p.PYRAMID_LEVELS <= MAX_PYRAMID_LEVELS,
+			"pyramid" + range(1, MAX_PYRAMID_LEVELS));
+	check(in(p.TEMPORAL_RANDOM, 0, 1), "temporal_random" + range(0, 1));
+	check(in(p.MAX_SLOPE, 0, HUGE_VAL) && std::isfinite(p.MAX_SLOPE),
+			"max_slope must be finite, >= 0");
+	check(p.REFINE_CANDIDATES >= 1 && p.REFINE_CANDIDATES <= MAX_WINDOW_PLANES,
+			"refine_candidates" + range(1, MAX_WINDOW_PLANES));
+	check(in(p.CONVERGENCE, 0, 1), "convergence" + range(0, 1));
+
+	// Flags and memory
+	check(p.WEIGHTS_CACHE_MB <= MAX_CACHE_MB && p.COST_CACHE_MB <= MAX_CACHE_MB,
+			"caches must be at most " + std::to_string(MAX_CACHE_MB) + " MB");
+	check(p.COST_CACHE_STEPS >= 1 && p.COST_CACHE_STEPS <= MAX_CACHE_STEPS,
+			"cost_cache_steps" + range(1, MAX_CACHE_STEPS));
+	check(p.MEDIAN_BINS >= 1 && p.MEDIAN_BINS <= MAX_MEDIAN_BINS,
+			"median_bins" + range(1, MAX_MEDIAN_BINS));
+	check(in(p.LOG, 0, 3), "log" + range(0, 3));
+
+	// Enums and bools, as bytes
+	check(in(int(p.OUT_OF_BOUNDS), 0, int(Params::OutOfBounds::NAN_COST)) &&
+			in(int(p.SCHEDULE), 0, int(Params::Schedule::RED_BLACK)) &&
+			in(int(p.KERNEL), 0, int(Params::Kernel::NEON)) &&
+			in(int(p.MEDIAN), 0, int(Params::Median::HISTOGRAM)),
+			"unknown enum value");
+	const bool* flags[] = { &p.ACTIVE_PIXELS, &p.NORMALIZE_GRADIENTS,
+			&p.RESIZE_WINDOWS, &p.PLANES_SATURATION, &p.USE_PSEUDORAND,
+			&p.CONST_DISPARITIES, &p.COST_VOLUME, &p.FUSED_POSTPROCESS,
+			&p.PARALLEL_VIEWS, &p.GPU };
+	for (const bool* flag: flags) {
+		unsigned char byte;
+		std::memcpy(&byte, flag, 1);
+		check(byte <= 1, "bad bool value");
+	}
+}
@@ -0,0 +1,462 @@
+#include "remote.hpp"
+
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+#include <unistd.h>       // Linux specific: sockets
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "params.hpp"
+#include "stereo.hpp"
+#include "log.hpp"
+
+
+using std::to_string;
+
+
+/*****************************************************************************
+* Protocol. Each connection carries one job. All numbers are in the byte     *
+* order of the host.                                                         *
+* Request (coordinator to worker):                                           *
+*   uint32 REQUEST_MAGIC, uint32 PROTOCOL, uint32 sizeof(Params), Params,    *
+*   uint32 planes (0 or 1), uint64 width, uint64 height, uint64 channels,    *
+*   uint64 w0, uint64 h0, uint64 frameWidth (see setFrameOrigin()), the left *
+*   view, the right view: width * height * channels bytes each, interleaved, *
+*   row major                                                                *
+* Reply (worker to coordinator):                                             *
+*   uint32 REPLY_MAGIC, uint32 status. With status 0: uint64 width, uint64   *
+*   height, then the float maps of RemoteResult: the two disparities; with   *
+*   planes, the two planes and the two costs. With status 1: uint64 length,  *
+*   the error message                                                        *
+*****************************************************************************/
+
+namespace {
+
+	const uint32_t REQUEST_MAGIC = 0x4a4d5053;   // "SPMJ", on little endian
+	const uint32_t REPLY_MAGIC = 0x444d5053;     // "SPMD", on little endian
+	const uint32_t PROTOCOL = 2;
+	const uint64_t MAX_SIDE = 1 << 20;           // sanity checks of a request
+	const uint64_t MAX_PIXELS = uint64_t(1) << 28;
+	const uint64_t MAX_ERROR = 1 << 16;          // of a reply
+	const time_t IO_TIMEOUT_S = 60;              // of each read/write of a worker
+
+	static_assert(std::is_trivially_copyable<Params>::value,
+			"Params are sent as bytes");
+
+
+	/*************************************************************
+	* > class Socket                                             *
+	* A connected TCP socket, closed at destruction. read() and  *
+	* write() transfer everything, or throw a runtime_error.     *
+	*************************************************************/
+	class Socket {
+
+		private:
+
+			int fd;
+			string peer;             // for the error messages
+
+		public:
+
+			Socket(int fd, const string& peer): fd(fd), peer(peer) {}
+			Socket(const Socket&) = delete;
+			~Socket() { close(fd); }
+
+			// read() and write() throw if a transfer stalls for 'seconds'
+			void setTimeout(time_t seconds) const {
+				timeval timeout = {};
+				timeout.tv_sec = seconds;
+				if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+						sizeof(timeout)) != 0 ||
+						setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+						sizeof(timeout)) != 0) {
+					throw std::runtime_error("Socket. Can't set a timeout on " +
+							peer);
+				}
+			}
+
+			void write(const void* data, size_t bytes) const {
+				const char* p = static_cast<const char*>(data);
+				while (bytes > 0) {
+					ssize_t n = send(fd, p, bytes, MSG_NOSIGNAL);
+					if (n <= 0) {
+						throw std::runtime_error("Socket. Can't write to " + peer);
+					}
+					p += n;
+					bytes -= n;
+				}
+			}
+
+			void read(void* data, size_t bytes) const {
+				char* p = static_cast<char*>(data);
+				while (bytes > 0) {
+					ssize_t n = recv(fd, p, bytes, 0);
+					if (n <= 0) {
+						throw std::runtime_error("Socket. Can't read from " + peer);
+					}
+					p += n;
+					bytes -= n;
+				}
+			}
+
+			template<typename T>
+			void put(const T& value) const { write(&value, sizeof(T)); }
+
+			template<typename T>
+			T take(void) const { T value; read(&value, sizeof(T)); return value; }
+
+			void put(const std::vector<float>& values) const {
+				write(values.data(), values.size() * sizeof(float));
+			}
+
+			void take(std::vector<float>& values, size_t size) const {
+				values.resize(size);
+				read(values.data(), size * sizeof(float));
+			}
+
+			Socket& operator=(const Socket&) = delete;
+	};
+
+
+	/*********************************************************************
+	* > fromImage()                                                      *
+	* Args:                                                              *
+	*   image (Image): a map                                             *
+	*                                                                    *
+	* Returns:                                                           *
+	*   (vector<float>): its values, row major, channels interleaved     *
+	*********************************************************************/
+	std::vector<float> fromImage(const Image& image) {
+
+		size_t width = image.size(0), channels = image.size(2);
+		std::vector<float> values(width * image.size(1) * channels);
+		for (size_t h = 0; h < image.size(1); ++h) {
+			for (size_t w = 0; w < width; ++w) {
+				for (size_t c = 0; c < channels; ++c) {
+					values[(h * width + w) * channels + c] = image.get(w, h, c);
+				}
+			}
+		}
+		return values;
+	}
+
+
+	/*************************************************************************
+	* > serveJob()                                                           *
+	* Runs the job of a connection: reads the request, computes the pair (as *
+	* StereoImagePair::computeDisparity(), with the params of the request)   *
+	* and writes the reply. Errors of the computation are sent back; the     *
+	* params of this thread are restored.                                    *
+	* The threads, the kernel, the GPU and the log level are those of the    *
+	* worker, not of the request; tiles are off, and the weights cache is    *
+	* at most that of the worker. The params of the request are checked (see *
+	* checkParams()) before they are used.                                   *
+	*                                                                        *
+	* Args:                                                                  *
+	*   socket (Socket): the connection                                      *
+	*************************************************************************/
+	void serveJob(const Socket& socket) {
+
+		// Request
+		if (socket.take<uint32_t>() != REQUEST_MAGIC ||
+				socket.take<uint32_t>() != PROTOCOL ||
+				socket.take<uint32_t>() != sizeof(Params)) {
+			throw std::runtime_error("serveJob(). Not a request of this build");
+		}
+		Params workerParams = params;
+		Params jobParams = socket.take<Params>();
+		bool planes = socket.take<uint32_t>() != 0;
+		uint64_t width = socket.take<uint64_t>();
+		uint64_t height = socket.take<uint64_t>();
+		uint64_t channels = socket.take<uint64_t>();
+		uint64_t w0 = socket.take<uint64_t>();
+		uint64_t h0 = socket.take<uint64_t>();
+		uint64_t frameWidth = socket.take<uint64_t>();
+		if (width == 0 || height == 0 || width > MAX_SIDE || height > MAX_SIDE ||
+				width * height > MAX_PIXELS || (channels != 1 && channels != 3)) {
+			throw std::runtime_error("serveJob(). Bad size " + to_string(width) +
+					"x" + to_string(height) + "x" + to_string(channels));
+		}
+		if (frameWidth > MAX_SIDE || w0 > frameWidth || w0 + width > frameWidth ||
+				h0 > MAX_SIDE) {
+			throw std::runtime_error("serveJob(). Bad origin " + to_string(w0) +
+					"," + to_string(h0) + " in a frame of width " +
+					to_string(frameWidth));
+		}
+		std::vector<unsigned char> views[2];
+		for (auto& view: views) {
+			view.resize(width * height * channels);
+			socket.read(view.data(), view.size());
+		}
+
+		// Computation
+		jobParams.THREADS = workerParams.THREADS;
+		jobParams.KERNEL = workerParams.KERNEL;
+		jobParams.GPU = workerParams.GPU;
+		jobParams.LOG = workerParams.LOG;
+		jobParams.TILE_SIZE = 0;
+		jobParams.TILE_JOBS = 1;
+		jobParams.WEIGHTS_CACHE_MB = std::min(jobParams.WEIGHTS_CACHE_MB,
+				workerParams.WEIGHTS_CACHE_MB);
+
+		RemoteResult result;
+		string error;
+		try {
+			checkParams(jobParams);      // raw bytes from the network
+			params = jobParams;
+			ImageBuffer left = { views[0].data(), width, height, channels,
+					width * channels };
+			ImageBuffer right = { views[1].data(), width, height, channels,
+					width * channels };
+			StereoImage leftView(Image(left), StereoImage::LEFT);
+			StereoImage rightView(Image(right), StereoImage::RIGHT);
+			leftView.setFrameOrigin(w0, h0, frameWidth);
+			rightView.setFrameOrigin(w0, h0, frameWidth);
+			StereoImagePair stereo(std::move(leftView), std::move(rightView));
+
+			pair<Image,Image> disparities = stereo.computeDisparity();
+			result.disparities[0] = fromImage(disparities.first);
+			result.disparities[1] = fromImage(disparities.second);
+			if (planes) {
+				pair<Image,Image> planeMaps = stereo.getPlanesMaps();
+				pair<Image,Image> costMaps = stereo.getCostsMaps();
+				result.planes[0] = fromImage(planeMaps.first);
+				result.planes[1] = fromImage(planeMaps.second);
+				result.costs[0] = fromImage(costMaps.first);
+				result.costs[1] = fromImage(costMaps.second);
+			}
+		} catch (const std::exception& e) {
+			error = e.what();
+		}
+		params = workerParams;
+
+		// Reply
+		socket.put(REPLY_MAGIC);
+		if (!error.empty()) {
+			logMsg("Job failed: " + error, 1);
+			error.resize(std::min<size_t>(error.size(), MAX_ERROR));
+			socket.put<uint32_t>(1);
+			socket.put<uint64_t>(error.size());
+			socket.write(error.data(), error.size());
+			return;
+		}
+		socket.put<uint32_t>(0);
+		socket.put<uint64_t>(width);
+		socket.put<uint64_t>(height);
+		for (const auto* maps: { &result.disparities, &result.planes,
+				&result.costs }) {
+			socket.put((*maps)[0]);
+			socket.put((*maps)[1]);
+		}
+	}
+}
+
+
+/*********************************************************************
+* > toImage()                                                        *
+* Args:                                                              *
+*   values (vector<float>): a map, row major, channels interleaved   *
+*       (as in RemoteResult)                                         *
+*   width (size_t), height (size_t), channels (size_t): its size     *
+*                                                                    *
+* Returns:                                                           *
+*   (Image): the same map                                            *
+*********************************************************************/
+Image toImage(const std::vector<float>& values, size_t width, size_t height,
+		size_t channels) {
+
+	if (values.size() != width * height * channels) {
+		throw std::invalid_argument("toImage(). Inconsistent size");
+	}
+
+	Image image(width, height, channels);
+	for (size_t h = 0; h < height; ++h) {
+		for (size_t w = 0; w < width; ++w) {
+			for (size_t c = 0; c < channels; ++c) {
+				image(w, h, c) = values[(h * width + w) * channels + c];
+			}
+		}
+	}
+
+	return image;
+}
+
+
+/****************************************************************************
+* > remoteCompute()                                                         *
+* Computes a pair on a worker (see serveWorker()), with the params of this  *
+* thread. Blocks until the reply. Throws a runtime_error if the worker      *
+* can't be reached, or if its computation failed.                           *
+*                                                                           *
+* Args:                                                                     *
+*   address (string): the worker, as "<host>:<port>"                        *
+*   left (ImageBuffer), right (ImageBuffer): the two views, same size       *
+*   planes (bool): whether to get the planes and the costs too              *
+*   w0 (size_t), h0 (size_t), frameWidth (size_t): the place of the views   *
+*       in their frame, e.g. for a tile. See setFrameOrigin()               *
+*                                                                           *
+* Returns:                                                                  *
+*   (RemoteResult): the maps of the two views                               *
+****************************************************************************/
+RemoteResult remoteCompute(const string& address, const ImageBuffer& left,
+		const ImageBuffer& right, bool planes, size_t w0, size_t h0,
+		size_t frameWidth) {
+
+	// checks
+	if (left.width != right.width || left.height != right.height ||
+			left.channels != right.channels) {
+		throw std::invalid_argument("remoteCompute(). " +
+				string("Left and right images must have the same dimension."));
+	}
+	size_t colon = address.rfind(':');
+	if (colon == string::npos) {
+		throw std::invalid_argument("remoteCompute(). Not <host>:<port>: " +
+				address);
+	}
+
+	// Connection
+	string host = address.substr(0, colon);
+	string port = address.substr(colon + 1);
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* found = nullptr;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) {
+		throw std::runtime_error("remoteCompute(). Unknown host " + address);
+	}
+	int fd = -1;
+	for (addrinfo* a = found; a != nullptr && fd < 0; a = a->ai_next) {
+		fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(found);
+	if (fd < 0) {
+		throw std::runtime_error("remoteCompute(). Can't connect to " + address);
+	}
+	Socket socket(fd, address);
+
+	// Request
+	socket.put(REQUEST_MAGIC);
+	socket.put(PROTOCOL);
+	socket.put<uint32_t>(sizeof(Params));
+	socket.put(params);
+	socket.put<uint32_t>(planes);
+	socket.put<uint64_t>(left.width);
+	socket.put<uint64_t>(left.height);
+	socket.put<uint64_t>(left.channels);
+	socket.put<uint64_t>(w0);
+	socket.put<uint64_t>(h0);
+	socket.put<uint64_t>(frameWidth);
+	for (const ImageBuffer* view: { &left, &right }) {
+		for (size_t h = 0; h < view->height; ++h) {
+			socket.write(view->data + h * view->rowStride,
+					view->width * view->channels);
+		}
+	}
+
+	// Reply
+	if (socket.take<uint32_t>() != REPLY_MAGIC) {
+		throw std::runtime_error("remoteCompute(). Bad reply from " + address);
+	}
+	if (socket.take<uint32_t>() != 0) {
+		uint64_t length = socket.take<uint64_t>();
+		if (length > MAX_ERROR) {
+			throw std::runtime_error("remoteCompute(). Bad reply from " + address);
+		}
+		string error(length, ' ');
+		socket.read(&error[0], error.size());
+		throw std::runtime_error("remoteCompute(). " + address + ": " + error);
+	}
+
+	RemoteResult result;
+	result.width = socket.take<uint64_t>();
+	result.height = socket.take<uint64_t>();
+	if (result.width != left.width || result.height != left.height) {
+		throw std::runtime_error("remoteCompute(). Bad reply from " + address);
+	}
+	size_t pixels = result.width * result.height;
+	for (unsigned v = 0; v < 2; ++v) {
+		socket.take(result.disparities[v], pixels);
+	}
+	if (planes) {
+		for (unsigned v = 0; v < 2; ++v) {
+			socket.take(result.planes[v], 3 * pixels);
+		}
+		for (unsigned v = 0; v < 2; ++v) {
+			socket.take(result.costs[v], pixels);
+		}
+	}
+
+	return result;
+}
+
+
+/**************************************************************************
+* > serveWorker()                                                         *
+* Runs a worker: accepts the connections of the coordinators on 'port',   *
+* and serves their jobs one at a time, with all the threads of this       *
+* process. Never returns; a failed connection is logged and dropped, and  *
+* so is a connection that stalls for IO_TIMEOUT_S seconds.                *
+* NOTE: there is no authentication: any peer that reaches the port can    *
+*   send jobs. Listen on other interfaces than loopback only in a         *
+*   trusted network.                                                      *
+*                                                                         *
+* Args:                                                                   *
+*   port (unsigned short): the TCP port                                   *
+*   bindAddress (string): the address to listen on, IPv4 or IPv6 (e.g.    *
+*       127.0.0.1, or :: for all the interfaces), or a host name          *
+**************************************************************************/
+void serveWorker(unsigned short port, const string& bindAddress) {
+
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	addrinfo* found = nullptr;
+	if (getaddrinfo(bindAddress.c_str(), to_string(port).c_str(), &hints,
+			&found) != 0) {
+		throw std::runtime_error("serveWorker(). Unknown address " +
+				bindAddress);
+	}
+	int fd = -1;
+	int on = 1;
+	for (addrinfo* a = found; a != nullptr && fd < 0; a = a->ai_next) {
+		fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd >= 0 && (
+				setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+				bind(fd, a->ai_addr, a->ai_addrlen) != 0 ||
+				listen(fd, 16) != 0)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(found);
+	if (fd < 0) {
+		throw std::runtime_error("serveWorker(). Can't listen on " +
+				bindAddress + ":" + to_string(port));
+	}
+	Socket listener(fd, "port " + to_string(port));
+	logMsg("Worker on " + bindAddress + ":" + to_string(port), 1);
+
+	while (true) {
+		int connection = accept(fd, nullptr, nullptr);
+		if (connection < 0) { continue; }
+
+		try {
+			Socket socket(connection, "the coordinator");
+			socket.setTimeout(IO_TIMEOUT_S);   // a stalled peer can't block
+			serveJob(socket);
+		} catch (const std::exception& e) {
+			logMsg(string("Connection dropped: ") + e.what(), 1);
+		}
+	}
+}
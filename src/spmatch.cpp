@@ -11,12 +11,22 @@
 
 #include <string>
 #include <iostream>
-#include <iomanip>
 #include <fstream>
+#include <sstream>
+#include <deque>
+#include <memory>
+#include <atomic>
 #include <boost/program_options.hpp>
 
 #include "params.hpp"
 #include "stereo.hpp"
+#include "tiles.hpp"
+#include "decode.hpp"
+#include "remote.hpp"
+#include "output.hpp"
+#include "stats.hpp"
+#include "gpu.hpp"
+#include "log.hpp"
 
 //#define DEBUG
 
@@ -27,14 +37,57 @@ using std::cout;
 using std::endl;
 
 
-// Global parameters
-Params params;
+// Where and how the results are saved. See saveDisparityMaps()
+struct OutputSettings {
+	string path;                 // path/name of the output files
+	OutputFormat format;         // format of the floating point maps
+	bool dumpPlanes;             // also save the planes and their costs
+	bool dumpConfidence;         // also save the confidence of disparities
+};
+
+
+// A line of the batch manifest. See readManifest()
+struct BatchItem {
+	string leftImgPath;
+	string rightImgPath;
+	string disparityPath;        // as OutputSettings::path
+};
+
+
+// The maps of a pair that is gone (computed by a remote worker, or a batch
+// pair already released), for saveDisparityMaps(). Maps not asked are empty
+struct PairMaps {
+	pair<Image,Image> planes;
+	pair<Image,Image> costs;
+	pair<Image,Image> confidence;
+
+	static pair<Image,Image> none(void) {
+		return { Image(0, 0, 1), Image(0, 0, 1) };
+	}
+
+	pair<Image,Image> getPlanesMaps(void) const {
+		return { Image(planes.first), Image(planes.second) };
+	}
+	pair<Image,Image> getCostsMaps(void) const {
+		return { Image(costs.first), Image(costs.second) };
+	}
+};
 
 
 // Forward eclarations
-void setDefaults(void);
 void writeDisparityMap(const string& leftImgPath, const string& rightImgPath,
-		const string& disparityPath);
+		const OutputSettings& output, const std::vector<string>& workers);
+void writeVideoDisparityMaps(const std::vector<string>& framePaths,
+		const OutputSettings& output);
+void writeBatchDisparityMaps(const std::vector<BatchItem>& items,
+		const OutputSettings& output, unsigned prefetch);
+void writeRemoteBatchDisparityMaps(const std::vector<BatchItem>& items,
+		const OutputSettings& output, const std::vector<string>& workers);
+std::vector<BatchItem> readManifest(const string& manifestPath);
+template<typename Stereo>
+void saveDisparityMaps(pair<Image,Image>& disparities, const Stereo& stereo,
+		const OutputSettings& output);
+void saveTiledMaps(const TiledStereo& stereo, const OutputSettings& output);
 void debugging(void);
 
 
@@ -42,11 +95,17 @@ void debugging(void);
 int main(int argc, char *argv[]) {
 
 	// Default settings
-	setDefaults();
+	params = defaultParams();
 
 	// General options
-	string outputPath;
+	OutputSettings output = { "", OutputFormat::CSV, false, false };
 	std::vector<string> inputImages;
+	string manifestPath;
+	string statsPath;
+	unsigned prefetch = 2;
+	std::vector<string> workers;
+	unsigned short workerPort = 0;
+	string workerBind = "127.0.0.1";
 
 	// parsing the command line
 	po::options_description generalOpts("General options");
@@ -54,11 +113,36 @@ int main(int argc, char *argv[]) {
 
 	generalOpts.add_options()
 			("help,h", "Help")
-			("output,o", po::value<string>(&outputPath)->default_value(
+			("output,o", po::value<string>(&output.path)->default_value(
 				"disparity.png"), "The path/name of the output files")
+			("format,f", po::value<OutputFormat>(&output.format),
+				"Format of the disparity values. One of {csv, pfm, raw, mmap}")
+			("dump_planes", po::value<bool>(&output.dumpPlanes)
+				->implicit_value(true),
+				"Also save the plane and the cost of each pixel")
+			("dump_confidence", po::value<bool>(&output.dumpConfidence)
+				->implicit_value(true),
+				"Also save the confidence of each disparity (needs fused_post)")
 			("inputs,I", po::value<std::vector<string>>(&inputImages)
-				->multitoken()->required(), "Left and right images")
-			("log,l", po::value<int>(&params.LOG), "Log level {0,...,3}")
+				->multitoken(), "Left and right images. "
+				"More pairs are the next frames of a video")
+			("batch,b", po::value<string>(&manifestPath),
+				"A manifest of independent pairs: one \"<left> <right> <output>\" "
+				"line each, instead of the inputs")
+			("prefetch", po::value<unsigned>(&prefetch),
+				"Pairs of the batch loaded while matching the current one")
+			("log,l", po::value<int>(&params.LOG), "Log level {0,...,3}. "
+				"With SPMATCH_STATS, 1 also prints the counters of each sweep")
+			("stats_json", po::value<string>(&statsPath),
+				"Save the counters of each sweep as JSON (needs SPMATCH_STATS)")
+			("workers", po::value<std::vector<string>>(&workers)->multitoken(),
+				"Remote workers, as <host>:<port>: they match the tiles, or the "
+				"pairs of the batch")
+			("worker", po::value<unsigned short>(&workerPort),
+				"Serve as a remote worker on this TCP port, until killed")
+			("worker_bind", po::value<string>(&workerBind),
+				"Address the worker listens on. Loopback by default; "
+				"0.0.0.0 or :: for all the interfaces")
 	;
 	paramsOpts.add_options()
 			("alfa", po::value<double>(&params.ALFA), "ALFA constant")
@@ -71,8 +155,24 @@ int main(int argc, char *argv[]) {
 			("max_d,M", po::value<int>(&params.MAX_D), "Maximum disparity")
 			("iteration,i", po::value<unsigned>(&params.ITERATIONS),
 				"Number of iterations per view")
+			("pyramid", po::value<unsigned>(&params.PYRAMID_LEVELS),
+				"Levels of the coarse-to-fine pyramid. 1 disables it")
+			("fine_iterations", po::value<unsigned>(&params.FINE_ITERATIONS),
+				"Iterations at full resolution, with the pyramid")
+			("temporal_iterations", po::value<unsigned>(
+				&params.TEMPORAL_ITERATIONS),
+				"Iterations of each video frame after the first")
+			("temporal_random", po::value<double>(&params.TEMPORAL_RANDOM),
+				"Fraction of random planes mixed in each video frame")
 			("max_slope", po::value<double>(&params.MAX_SLOPE),
 				"Maximum slope of each window")
+			("refine_candidates", po::value<unsigned>(&params.REFINE_CANDIDATES),
+				"Planes tried together at each step of the plane refinement")
+			("convergence", po::value<double>(&params.CONVERGENCE),
+				"Stop when the fraction of changed planes in an iteration is lower")
+			("active_pixels", po::value<bool>(&params.ACTIVE_PIXELS)
+				->implicit_value(true),
+				"Revisit only the pixels whose neighbourhood has changed")
 			("normalize_gradients", po::value<bool>(
 				&params.NORMALIZE_GRADIENTS)->implicit_value(true),
 				"Whether the gradient map should be normalized")
@@ -90,16 +190,50 @@ int main(int argc, char *argv[]) {
 			("const_disparities", po::value<bool>(&params.CONST_DISPARITIES)
 				->implicit_value(true),
 				"Always use constant planes")
+			("cost_volume", po::value<bool>(&params.COST_VOLUME)
+				->implicit_value(true),
+				"Initial constant planes from a cost volume, with a guided filter")
+			("guided_eps", po::value<double>(&params.GUIDED_EPS),
+				"Regularization of the guided filter of --cost_volume")
+			("weights_cache", po::value<unsigned>(&params.WEIGHTS_CACHE_MB),
+				"Memory (MB) of the adaptive weights caches of a pair. 0 disables them")
+			("cost_cache", po::value<unsigned>(&params.COST_CACHE_MB),
+				"Memory (MB) of the tables of the pixel costs of a pair. 0 disables them")
+			("cost_cache_steps", po::value<unsigned>(&params.COST_CACHE_STEPS),
+				"Entries of the cost table for each unit of disparity")
+			("kernel", po::value<Params::Kernel>(&params.KERNEL),
+				"Window cost implementation. One of {auto, scalar, avx2, avx512, neon}")
+			("median", po::value<Params::Median>(&params.MEDIAN),
+				"Weighted median of the post processing. One of {exact, histogram}")
+			("median_bins", po::value<unsigned>(&params.MEDIAN_BINS),
+				"Disparity bins of the histogram median")
+			("fused_post", po::value<bool>(&params.FUSED_POSTPROCESS)
+				->implicit_value(true),
+				"Post processing of both views in one parallel pass over the rows")
+			("threads,t", po::value<unsigned>(&params.THREADS),
+				"Number of threads. 0 means all hardware threads")
+			("schedule", po::value<Params::Schedule>(&params.SCHEDULE),
+				"Parallel order of the pixels. One of {wavefront, redblack}")
+			("parallel_views", po::value<bool>(&params.PARALLEL_VIEWS)
+				->implicit_value(true),
+				"Process the left and right views at the same time")
+			("gpu", po::value<bool>(&params.GPU)->implicit_value(true),
+				"Run the iterations on the GPU (built with SPMATCH_CUDA)")
+			("tile", po::value<unsigned>(&params.TILE_SIZE),
+				"Match the pair in tiles of this size, with halos. 0 disables it")
+			("tile_jobs", po::value<unsigned>(&params.TILE_JOBS),
+				"Tiles matched at the same time, sharing the threads")
 	;
 
 	po::positional_options_description positionalOpts;
-	positionalOpts.add("inputs", 2);
+	positionalOpts.add("inputs", -1);
 
 	po::options_description allOpts(string() + "SPMatch. " + 
 			"Stereo matching with slanted support windows\n" +
 			"Implementation of Cipollone R.\n" +
 			"Usage:\n"+
-			"  spmatch <left_image> <right_image>\n");
+			"  spmatch <left_image> <right_image>\n" +
+			"  spmatch --batch <manifest>\n");
 	allOpts.add(generalOpts).add(paramsOpts);
 
 	po::variables_map vMap;
@@ -114,9 +248,26 @@ int main(int argc, char *argv[]) {
 
 	// Check options
 	po::notify(vMap);
+	checkParams(params);
 
-	if (inputImages.size() != 2) {		// enough?
-		throw std::runtime_error("Need two images");
+	// Remote worker: the jobs bring their own params and images
+	if (vMap.count("worker")) {
+		serveWorker(workerPort, workerBind);
+		return 0;
+	}
+
+	std::vector<BatchItem> batch;
+	if (!manifestPath.empty()) {
+		if (!inputImages.empty()) {
+			throw std::runtime_error("Give either the inputs or a batch manifest");
+		}
+		batch = readManifest(manifestPath);
+		for (const BatchItem& item: batch) {
+			inputImages.push_back(item.leftImgPath);
+			inputImages.push_back(item.rightImgPath);
+		}
+	} else if (inputImages.size() < 2 || inputImages.size() % 2 != 0) {	// enough?
+		throw std::runtime_error("Need pairs of images");
 	}
 	for (string s: inputImages) {		// existing?
 		std::ifstream f(s);
@@ -124,6 +275,24 @@ int main(int argc, char *argv[]) {
 			throw std::runtime_error("File not found: " + s);
 		}
 	}
+	if (!statsPath.empty() && !Stats::ENABLED) {
+		throw std::runtime_error("stats_json needs a build with SPMATCH_STATS");
+	}
+	if (params.GPU && !gpuAvailable()) {
+		throw std::runtime_error("gpu needs a build with SPMATCH_CUDA and a " +
+				string("CUDA device"));
+	}
+	if (params.TILE_SIZE > 0 && inputImages.size() > 2) {
+		throw std::runtime_error("tile needs a single pair: no videos or batches");
+	}
+	if (!workers.empty() && manifestPath.empty() && params.TILE_SIZE == 0) {
+		throw std::runtime_error("workers need tiles or a batch");
+	}
+	if (output.dumpConfidence && (!params.FUSED_POSTPROCESS || params.GPU ||
+			params.TILE_SIZE > 0 || !workers.empty())) {
+		throw std::runtime_error("dump_confidence needs fused_post, and no gpu, "
+				"tiles or workers");
+	}
 
 #ifdef DEBUG
 	debugging();
@@ -131,48 +300,26 @@ int main(int argc, char *argv[]) {
 #endif // DEBUG
 
 	// run
-	writeDisparityMap(inputImages.at(0), inputImages.at(1), outputPath);
-
-	return 0;
-}
-
+	if (!manifestPath.empty() && !workers.empty()) {
+		writeRemoteBatchDisparityMaps(batch, output, workers);
+	} else if (!manifestPath.empty()) {
+		writeBatchDisparityMaps(batch, output, prefetch);
+	} else if (inputImages.size() == 2) {
+		writeDisparityMap(inputImages.at(0), inputImages.at(1), output, workers);
+	} else {
+		writeVideoDisparityMaps(inputImages, output);
+	}
 
-/**************************************************************************
-* > setDefaults()                                                         *
-* Set the defaults values in the global 'params' struct                   *
-* NOTE: these were the paper weights:                                     *
-*   const double ALFA = 0.9;                                              *
-*   const double TAU_COL = 10;                                            *
-*   const double TAU_GRAD = 2;                                            *
-*   const double GAMMA = 10;                                              *
-*   const unsigned int WINDOW_SIZE = 35;                                  *
-* However I can't use them, because I don't know the numeric range of the *
-*   RGB and gradients.                                                    *
-**************************************************************************/
-void setDefaults(void) {
-
-	// Math constants
-	params.ALFA = 0.5;
-	params.TAU_COL = 60;
-	params.TAU_GRAD = 30;
-	params.GAMMA = 15;
-
-	// Range parameters
-	params.WINDOW_SIZE = 35;      // NOTE: Must be an odd number
-	params.MIN_D = 0;
-	params.MAX_D = 70;            // NOTE: must be positive
-	params.ITERATIONS = 3;
-	params.MAX_SLOPE = 45;
-
-	// Flag parameters
-	params.NORMALIZE_GRADIENTS = true; // With this false, TAU_GRAD must also change
-	params.OUT_OF_BOUNDS = Params::OutOfBounds::NAN_COST;
-	params.RESIZE_WINDOWS = true;
-	params.PLANES_SATURATION = true;
-	params.USE_PSEUDORAND = false;
-	params.CONST_DISPARITIES = false;
-	params.LOG = 1;               // {0,...,3}. 0 means off
+	// Statistics
+	if (Stats::ENABLED && params.LOG >= 1) {
+		Stats::printTable(std::cout);
+	}
+	if (!statsPath.empty()) {
+		std::ofstream statsFile(statsPath);
+		Stats::writeJson(statsFile);
+	}
 
+	return 0;
 }
 
 
@@ -182,63 +329,391 @@ void setDefaults(void) {
 * the left and right view to the ouput path. The image will be saved as:  *
 * <disparityPath_name>L.<disparityPath_ext>                               *
 * <disparityPath_name>R.<disparityPath_ext>                               *
-* It also writes two text files with the floating point value of the      *
+* It also writes two files with the floating point value of the           *
 * disparity at each pixel, in the following two files:                    *
 * <disparityPath_name>L.csv                                               *
 * <disparityPath_name>R.csv                                               *
 * They have the format:                                                   *
 * p_w, p_h,    disparity                                                  *
 * ...                                                                     *
+* With other output formats, the extension changes (see OutputFormat).    *
+* With output.dumpPlanes, the planes and their costs are also saved in    *
+* <disparityPath_name>L_planes.<format_ext>, <...>L_costs.<format_ext>,   *
+* and the same for R. With output.dumpConfidence, the confidence of the   *
+* disparities in <...>L_confidence.<format_ext> and R.                    *
+* With params.TILE_SIZE > 0, the pair is matched in tiles: see            *
+* TiledStereo. The tiles can go to remote workers. With RAW and MMAP      *
+* output, the tiles are written to the files as they are done.            *
 * NOTE: no try blocks                                                     *
 *                                                                         *
 * Args:                                                                   *
 *   leftImgPath (string): left image name/path                            *
 *   rightImgPath (string): right image name/path                          *
-*   disparityPath (string): output name/path of the images and text files *
+*   output (OutputSettings): output name/path of the images and files,    *
+*       and their format                                                  *
+*   workers (vector<string>): the remote workers of the tiles, as         *
+*       <host>:<port>. Empty: all tiles here                              *
 **************************************************************************/
 void writeDisparityMap(const string& leftImgPath, const string& rightImgPath,
-		const string& disparityPath) {
-
-	// Set the paths
-	auto extPos = disparityPath.rfind('.');
-	string leftDisparityPath = disparityPath;
-	string rightDisparityPath = disparityPath;
-	string leftDisparityTextPath = disparityPath;
-	string rightDisparityTextPath = disparityPath;
-	leftDisparityPath.insert(extPos, "L");
-	rightDisparityPath.insert(extPos, "R");
-	leftDisparityTextPath.replace(extPos, 10, "L.csv");
-	rightDisparityTextPath.replace(extPos, 10, "R.csv");
+		const OutputSettings& output, const std::vector<string>& workers) {
+
+	// In tiles
+	if (params.TILE_SIZE > 0) {
+		TiledStereo stereo(leftImgPath, rightImgPath, output.dumpPlanes);
+		stereo.setWorkers(workers);
+		if (output.format == OutputFormat::RAW ||
+				output.format == OutputFormat::MMAP) {
+			stereo.setOutput(output.path.substr(0, output.path.rfind('.')));
+		}
+		stereo.computeDisparity();
+		saveTiledMaps(stereo, output);
+		return;
+	}
 
 	// Read the two stereo images
 	StereoImagePair stereo(leftImgPath, rightImgPath);
 
 	// Run the algorithm
 	auto disparities = stereo.computeDisparity();
+	saveDisparityMaps(disparities, stereo, output);
+}
+
+
+/**************************************************************************
+* > writeVideoDisparityMaps()                                             *
+* As writeDisparityMap(), for the frames of a stereo video. The first     *
+* frame is computed as a single pair, each next frame starts from the     *
+* planes of the previous one (see computeDisparityFromPrevious()). The    *
+* same StereoImagePair, and its buffers, is used for all the frames.      *
+* The maps of frame i are saved as <disparityPath_name>_<i>L.<ext>, etc.  *
+*                                                                         *
+* Args:                                                                   *
+*   framePaths (vector<string>): left and right image of each frame, in   *
+*       order. All frames have the same size                              *
+*   output (OutputSettings): output name/path of the images and files,    *
+*       and their format                                                  *
+**************************************************************************/
+void writeVideoDisparityMaps(const std::vector<string>& framePaths,
+		const OutputSettings& output) {
+
+	auto extPos = output.path.rfind('.');
+	StereoImagePair stereo(framePaths.at(0), framePaths.at(1));
+
+	for (size_t f = 0; 2 * f < framePaths.size(); ++f) {
+		logMsg("Frame " + std::to_string(f), 1);
+
+		if (f > 0) {
+			stereo.loadFrame(framePaths.at(2 * f), framePaths.at(2 * f + 1));
+		}
+		auto disparities = (f == 0) ? stereo.computeDisparity() :
+				stereo.computeDisparityFromPrevious();
+
+		OutputSettings frameOutput = output;
+		frameOutput.path.insert(extPos, "_" + std::to_string(f));
+		saveDisparityMaps(disparities, stereo, frameOutput);
+	}
+}
+
+
+/***************************************************************************
+* > writeBatchDisparityMaps()                                              *
+* As writeDisparityMap(), for many independent pairs in one process. The   *
+* images of the next 'prefetch' pairs are read while the current pair is   *
+* matched, each in its own thread. Only the images are loaded ahead: the   *
+* StereoImagePair (its threads, caches and buffers) is built just before   *
+* matching, and released after it, so there is one at a time. The maps of  *
+* a pair are saved in the background while the next pair is matched; at    *
+* most one pair is being saved at a time.                                  *
+*                                                                          *
+* Args:                                                                    *
+*   items (vector<BatchItem>): the pairs and their output names/paths      *
+*   output (OutputSettings): the output format. Its path is replaced by    *
+*       that of each item                                                  *
+*   prefetch (unsigned): number of pairs loaded ahead                      *
+***************************************************************************/
+void writeBatchDisparityMaps(const std::vector<BatchItem>& items,
+		const OutputSettings& output, unsigned prefetch) {
+
+	typedef pair<Image,Image> Views;
+
+	std::deque<std::future<Views>> loading;     // the next pairs, in order
+	std::future<void> saving;                   // the previous pair
+	size_t nextLoad = 0;
+
+	for (size_t i = 0; i < items.size(); ++i) {
+
+		// Keep the queue full: this pair and the next 'prefetch'
+		while (nextLoad < items.size() && loading.size() <= prefetch) {
+			const BatchItem& item = items[nextLoad++];
+			loading.push_back(asyncWithParams([&item] {
+				return Views(Image(item.leftImgPath), Image(item.rightImgPath));
+			}));
+		}
+
+		Views views = loading.front().get();
+		loading.pop_front();
+
+		logMsg("Pair " + std::to_string(i) + ": " + items[i].leftImgPath, 1);
+		std::shared_ptr<Views> disparities;
+		std::shared_ptr<PairMaps> maps;
+		{
+			StereoImagePair stereo(
+					StereoImage(std::move(views.first), StereoImage::LEFT),
+					StereoImage(std::move(views.second), StereoImage::RIGHT));
+			disparities = std::make_shared<Views>(stereo.computeDisparity());
+			maps = std::make_shared<PairMaps>(PairMaps {
+				output.dumpPlanes ? stereo.getPlanesMaps() : PairMaps::none(),
+				output.dumpPlanes ? stereo.getCostsMaps() : PairMaps::none(),
+				output.dumpConfidence ? stereo.getConfidenceMaps() :
+						PairMaps::none() });
+		}
+
+		// Save in the background
+		if (saving.valid()) {
+			saving.get();
+		}
+		OutputSettings itemOutput = output;
+		itemOutput.path = items[i].disparityPath;
+		saving = asyncWithParams([disparities, maps, itemOutput] {
+			saveDisparityMaps(*disparities, *maps, itemOutput);
+		});
+	}
+
+	if (saving.valid()) {
+		saving.get();
+	}
+}
+
+
+/*************************************************************************
+* > writeRemoteBatchDisparityMaps()                                      *
+* As writeBatchDisparityMaps(), with the pairs matched by remote workers *
+* (see remoteCompute()). Each worker has a thread here, that sends it    *
+* the next pair of the batch (as 8 bit images), waits for the result     *
+* and saves it, until none is left. If one fails, the others stop after  *
+* their current pair, and the first error is thrown.                     *
+*                                                                        *
+* Args:                                                                  *
+*   items (vector<BatchItem>): the pairs and their output names/paths    *
+*   output (OutputSettings): the output format. Its path is replaced by  *
+*       that of each item                                                *
+*   workers (vector<string>): the workers, as <host>:<port>              *
+*************************************************************************/
+void writeRemoteBatchDisparityMaps(const std::vector<BatchItem>& items,
+		const OutputSettings& output, const std::vector<string>& workers) {
+
+	std::atomic<size_t> next(0);
+	auto job = [&] (const string& worker) {
+		for (size_t i = next++; i < items.size(); i = next++) {
+			logMsg("Pair " + std::to_string(i) + ": " + items[i].leftImgPath +
+					" on " + worker, 1);
+			try {
+				DecodedImage frames[2];
+				loadImage(items[i].leftImgPath, frames[0]);
+				loadImage(items[i].rightImgPath, frames[1]);
+
+				RemoteResult result = remoteCompute(worker, frames[0].buffer(),
+						frames[1].buffer(), output.dumpPlanes, 0, 0,
+						frames[0].width);
+
+				// Maps without values (the planes, if not asked) are empty
+				auto maps = [&result] (const std::vector<float>* views,
+						size_t channels) {
+					size_t width = views[0].empty() ? 0 : result.width;
+					size_t height = views[0].empty() ? 0 : result.height;
+					return pair<Image,Image>(
+							toImage(views[0], width, height, channels),
+							toImage(views[1], width, height, channels));
+				};
+				pair<Image,Image> disparities = maps(result.disparities, 1);
+				PairMaps stereo = { maps(result.planes, 3),
+						maps(result.costs, 1), PairMaps::none() };
+
+				OutputSettings itemOutput = output;
+				itemOutput.path = items[i].disparityPath;
+				saveDisparityMaps(disparities, stereo, itemOutput);
+			} catch (...) {
+				next = items.size();     // the other workers stop too
+				throw;
+			}
+		}
+	};
+
+	std::vector<std::future<void>> running;
+	for (const string& worker: workers) {
+		running.push_back(asyncWithParams([&job, &worker] { job(worker); }));
+	}
+	std::exception_ptr error;
+	for (auto& task: running) {
+		try {
+			task.get();
+		} catch (...) {
+			if (!error) { error = std::current_exception(); }
+		}
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+
+/************************************************************************
+* > readManifest()                                                      *
+* Reads the list of pairs of a batch. Each line is:                     *
+* <left_image> <right_image> <output>                                   *
+* separated by spaces (paths can't contain spaces); <output> is as the  *
+* --output option. Empty lines and lines starting with '#' are skipped. *
+*                                                                       *
+* Args:                                                                 *
+*   manifestPath (string): the path of the manifest                     *
+*                                                                       *
+* Returns:                                                              *
+*   (vector<BatchItem>): the pairs, in order                            *
+************************************************************************/
+std::vector<BatchItem> readManifest(const string& manifestPath) {
+
+	std::ifstream manifest(manifestPath);
+	if (!manifest.good()) {
+		throw std::runtime_error("File not found: " + manifestPath);
+	}
+
+	std::vector<BatchItem> items;
+	string line;
+	for (size_t lineNum = 1; std::getline(manifest, line); ++lineNum) {
+
+		std::istringstream fields(line);
+		BatchItem item;
+		if (!(fields >> item.leftImgPath) || item.leftImgPath[0] == '#') {
+			continue;
+		}
+
+		string extra;
+		if (!(fields >> item.rightImgPath >> item.disparityPath) ||
+				(fields >> extra)) {
+			throw std::runtime_error(manifestPath + ", line " +
+					std::to_string(lineNum) + ": expected <left> <right> <output>");
+		}
+		if (item.disparityPath.rfind('.') == string::npos) {
+			throw std::runtime_error(manifestPath + ", line " +
+					std::to_string(lineNum) + ": the output needs an extension");
+		}
+		items.push_back(item);
+	}
+
+	if (items.empty()) {
+		throw std::runtime_error("No pairs in " + manifestPath);
+	}
+
+	return items;
+}
+
+
+// The confidence maps of a pair, for saveDisparityMaps(). Only a local
+// StereoImagePair has them: see the checks in main()
+pair<Image,Image> confidenceMaps(const StereoImagePair& stereo) {
+	return stereo.getConfidenceMaps();
+}
+pair<Image,Image> confidenceMaps(const PairMaps& maps) {
+	return { Image(maps.confidence.first), Image(maps.confidence.second) };
+}
+template<typename Stereo>
+pair<Image,Image> confidenceMaps(const Stereo&) {
+	throw std::logic_error("confidenceMaps(). No confidence for this pair");
+}
+
+
+/**************************************************************************
+* > saveDisparityMaps()                                                   *
+* Saves the disparity maps of the left and right view as images and as    *
+* files of real values; with output.dumpPlanes, also the planes and the   *
+* costs of the two views; with output.dumpConfidence, their confidence.   *
+* See writeDisparityMap() for the names and the format.                   *
+* NOTE: the images are normalized in place.                               *
+*                                                                         *
+* Args:                                                                   *
+*   disparities (pair<Image,Image>&): the left and right disparity maps   *
+*   stereo (Stereo): the pair that computed them: a StereoImagePair, or   *
+*       the PairMaps of a pair that is gone                               *
+*   output (OutputSettings): output name/path of the images and files,    *
+*       and their format                                                  *
+**************************************************************************/
+template<typename Stereo>
+void saveDisparityMaps(pair<Image,Image>& disparities, const Stereo& stereo,
+		const OutputSettings& output) {
+
+	// Set the paths
+	auto extPos = output.path.rfind('.');
+	string name = output.path.substr(0, extPos);
+	string ext = outputExtension(output.format);
+
 	Image& leftDisp = disparities.first;
 	Image& rightDisp = disparities.second;
 
-	// Write to text files
-	std::ofstream leftDispCsv(leftDisparityTextPath);
-	std::ofstream rightDispCsv(rightDisparityTextPath);
-	for (size_t w = 0; w < leftDisp.size(0); ++w) {
-		for (size_t h = 0; h < leftDisp.size(1); ++h) {
-			leftDispCsv << w << ", " << h << ", " << std::setprecision(8) <<
-					leftDisp.get(w,h) << "\n";
-			rightDispCsv << w << ", " << h << ", " << std::setprecision(8) <<
-					rightDisp.get(w,h) << "\n";
-		}
+	// Write the values
+	writeFloatMap(leftDisp, name + "L" + ext, output.format);
+	writeFloatMap(rightDisp, name + "R" + ext, output.format);
+
+	if (output.dumpPlanes) {
+		auto planes = stereo.getPlanesMaps();
+		auto costs = stereo.getCostsMaps();
+		writeFloatMap(planes.first, name + "L_planes" + ext, output.format);
+		writeFloatMap(planes.second, name + "R_planes" + ext, output.format);
+		writeFloatMap(costs.first, name + "L_costs" + ext, output.format);
+		writeFloatMap(costs.second, name + "R_costs" + ext, output.format);
+	}
+	if (output.dumpConfidence) {
+		auto confidence = confidenceMaps(stereo);
+		writeFloatMap(confidence.first, name + "L_confidence" + ext,
+				output.format);
+		writeFloatMap(confidence.second, name + "R_confidence" + ext,
+				output.format);
 	}
-	leftDispCsv.close();
-	rightDispCsv.close();
 
 	// Normalization before converting to uint8
 	leftDisp.normalize();
 	rightDisp.normalize();
 	
 	// Write the result to image
-	leftDisp.setPath(leftDisparityPath).write();
-	rightDisp.setPath(rightDisparityPath).write();
+	leftDisp.setPath(name + "L" + output.path.substr(extPos)).write();
+	rightDisp.setPath(name + "R" + output.path.substr(extPos)).write();
+}
+
+
+/**************************************************************************
+* > saveTiledMaps()                                                       *
+* As saveDisparityMaps(), for the maps of a TiledStereo, which are never  *
+* copied: those not yet in their files (see TiledStereo::setOutput()) are *
+* written, and the disparity maps are saved as normalized images.         *
+*                                                                         *
+* Args:                                                                   *
+*   stereo (TiledStereo): the pair, after computeDisparity()              *
+*   output (OutputSettings): output name/path of the images and files,    *
+*       and their format                                                  *
+**************************************************************************/
+void saveTiledMaps(const TiledStereo& stereo, const OutputSettings& output) {
+
+	// Set the paths
+	auto extPos = output.path.rfind('.');
+	string name = output.path.substr(0, extPos);
+	string ext = outputExtension(output.format);
+
+	auto write = [&] (const FloatMap& map, const string& suffix) {
+		if (!map.isMapped()) {
+			writeFloatMap(map, name + suffix + ext, output.format);
+		}
+	};
+
+	const StereoImage::Side sides[] = { StereoImage::LEFT, StereoImage::RIGHT };
+	for (auto side: sides) {
+		string s = (side == StereoImage::LEFT) ? "L" : "R";
+		write(stereo.getDisparityMap(side), s);
+		if (output.dumpPlanes) {
+			write(stereo.getPlanesMap(side), s + "_planes");
+			write(stereo.getCostsMap(side), s + "_costs");
+		}
+		writeNormalizedImage(stereo.getDisparityMap(side),
+				name + s + output.path.substr(extPos));
+	}
 }
 
 
@@ -268,6 +743,96 @@ std::istream& operator>>(std::istream& in, Params::OutOfBounds& selection) {
 }
 
 
+/************************************
+* > operator>>                      *
+* Utility function to set Schedule. *
+************************************/
+std::istream& operator>>(std::istream& in, Params::Schedule& selection) {
+
+	std::string token;
+	in >> token;
+	if (token == "wavefront") {
+		selection = Params::Schedule::WAVEFRONT;
+	} else if (token == "redblack") {
+		selection = Params::Schedule::RED_BLACK;
+	} else {
+		throw std::runtime_error("Invalid Schedule selection");
+	}
+
+	return in;
+}
+
+
+/**********************************
+* > operator>>                    *
+* Utility function to set Kernel. *
+**********************************/
+std::istream& operator>>(std::istream& in, Params::Kernel& selection) {
+
+	std::string token;
+	in >> token;
+	if (token == "auto") {
+		selection = Params::Kernel::AUTO;
+	} else if (token == "scalar") {
+		selection = Params::Kernel::SCALAR;
+	} else if (token == "avx2") {
+		selection = Params::Kernel::AVX2;
+	} else if (token == "avx512") {
+		selection = Params::Kernel::AVX512;
+	} else if (token == "neon") {
+		selection = Params::Kernel::NEON;
+	} else {
+		throw std::runtime_error("Invalid Kernel selection");
+	}
+
+	return in;
+}
+
+
+/**********************************
+* > operator>>                    *
+* Utility function to set Median. *
+**********************************/
+std::istream& operator>>(std::istream& in, Params::Median& selection) {
+
+	std::string token;
+	in >> token;
+	if (token == "exact") {
+		selection = Params::Median::EXACT;
+	} else if (token == "histogram") {
+		selection = Params::Median::HISTOGRAM;
+	} else {
+		throw std::runtime_error("Invalid Median selection");
+	}
+
+	return in;
+}
+
+
+/****************************************
+* > operator>>                          *
+* Utility function to set OutputFormat. *
+****************************************/
+std::istream& operator>>(std::istream& in, OutputFormat& selection) {
+
+	std::string token;
+	in >> token;
+	if (token == "csv") {
+		selection = OutputFormat::CSV;
+	} else if (token == "pfm") {
+		selection = OutputFormat::PFM;
+	} else if (token == "raw") {
+		selection = OutputFormat::RAW;
+	} else if (token == "mmap") {
+		selection = OutputFormat::MMAP;
+	} else {
+		throw std::runtime_error("Invalid OutputFormat selection");
+	}
+
+	return in;
+}
+
+
 void debugging(void) {
 
 }
@@ -0,0 +1,237 @@
+
+#include "stats.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <iomanip>
+
+
+#ifdef SPMATCH_STATS
+const bool Stats::ENABLED = true;
+#else
+const bool Stats::ENABLED = false;
+#endif
+
+const char* const Stats::COUNTER_NAMES[Stats::COUNTERS] = { "pixels",
+		"spatial_accepted", "view_accepted", "refinement_accepted",
+		"spatial_ns", "view_ns", "refinement_ns", "refinement_samples",
+		"window_costs", "window_planes" };
+
+
+/***************************************************************************
+* > struct Stats::ThreadCounters                                           *
+* The counters of a thread, for the two views. Only the owner thread       *
+* writes them; endSweep() reads them from another thread, so they are      *
+* relaxed atomics. Each instance is in the registry while it lives; at the *
+* thread exit, its counts are moved to 'retired'.                          *
+***************************************************************************/
+struct Stats::ThreadCounters {
+
+	std::atomic<uint64_t> counts[2][COUNTERS];
+
+	ThreadCounters(void);
+	~ThreadCounters();
+
+	// The counters of this thread
+	static ThreadCounters& local(void) {
+		static thread_local ThreadCounters counters;
+		return counters;
+	}
+};
+
+
+namespace {
+
+	// All the counters. Locked by 'mutex'
+	struct Registry {
+		std::mutex mutex;
+		std::vector<Stats::Sweep> sweeps;
+		std::vector<const void*> threads;        // live ThreadCounters
+		uint64_t retired[2][Stats::COUNTERS] = {};
+		uint64_t recorded[2][Stats::COUNTERS] = {};   // at the last sweep
+	};
+
+	Registry& registry(void) {
+		static Registry instance;
+		return instance;
+	}
+}
+
+
+/****************************************************
+* > ThreadCounters()                                *
+* Constructor. Zero counts, added to the registry.  *
+****************************************************/
+Stats::ThreadCounters::ThreadCounters(void) {
+
+	for (auto& view: counts) {
+		for (auto& count: view) {
+			count.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	Registry& r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	r.threads.push_back(this);
+}
+
+
+/*******************************************************
+* > ~ThreadCounters()                                  *
+* Destructor. Moves the counts to the retired ones.    *
+*******************************************************/
+Stats::ThreadCounters::~ThreadCounters() {
+
+	Registry& r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	for (unsigned v = 0; v < 2; ++v) {
+		for (unsigned c = 0; c < COUNTERS; ++c) {
+			r.retired[v][c] += counts[v][c].load(std::memory_order_relaxed);
+		}
+	}
+	r.threads.erase(std::find(r.threads.begin(), r.threads.end(), this));
+}
+
+
+/*******************************************************
+* > add()                                              *
+* Adds n to a counter of this thread.                  *
+*                                                      *
+* Args:                                                *
+*   view (unsigned): the view, as StereoImage::Side    *
+*   counter (Counter): the counter                     *
+*   n (uint64_t): the increment                        *
+*******************************************************/
+void Stats::add(unsigned view, Counter counter, uint64_t n) {
+
+	std::atomic<uint64_t>& count = ThreadCounters::local().counts[view][counter];
+	count.store(count.load(std::memory_order_relaxed) + n,
+			std::memory_order_relaxed);
+}
+
+
+/*************************************************************************
+* > endSweep()                                                           *
+* Records a sweep of a view: the counters of the view added since its    *
+* previous sweep, in all the threads. Does nothing without SPMATCH_STATS *
+*                                                                        *
+* Args:                                                                  *
+*   view (unsigned): the view, as StereoImage::Side                      *
+*   iteration (unsigned): the iteration number                           *
+*   width (size_t), height (size_t): the size of the view                *
+*   seconds (double): wall time of the sweep                             *
+*************************************************************************/
+void Stats::endSweep(unsigned view, unsigned iteration, size_t width,
+		size_t height, double seconds) {
+
+	if (!ENABLED) { return; }
+
+	Registry& r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+
+	Sweep sweep = { iteration, view, width, height, seconds, {} };
+	for (unsigned c = 0; c < COUNTERS; ++c) {
+		uint64_t total = r.retired[view][c];
+		for (const void* t: r.threads) {
+			total += static_cast<const ThreadCounters*>(t)->counts[view][c].load(
+					std::memory_order_relaxed);
+		}
+		sweep.counts[c] = total - r.recorded[view][c];
+		r.recorded[view][c] = total;
+	}
+	r.sweeps.push_back(sweep);
+}
+
+
+/*******************************************************
+* > sweeps()                                           *
+* Returns:                                             *
+*   (vector<Sweep>): all the sweeps recorded, in order *
+*******************************************************/
+std::vector<Stats::Sweep> Stats::sweeps(void) {
+
+	Registry& r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	return r.sweeps;
+}
+
+
+/*****************************************************
+* > clear()                                          *
+* Forgets the sweeps recorded. Counting goes on.     *
+*****************************************************/
+void Stats::clear(void) {
+
+	Registry& r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	r.sweeps.clear();
+}
+
+
+/**************************************************************************
+* > printTable()                                                          *
+* Prints a table of the sweeps: for each one, the wall time, the fraction *
+* of pixels changed by each step, the time of each step per pixel, and    *
+* the window costs per pixel.                                             *
+*                                                                         *
+* Args:                                                                   *
+*   out (ostream): the output stream                                      *
+**************************************************************************/
+void Stats::printTable(std::ostream& out) {
+
+	out << " iter view      size   time(s)  spatial%    view%  refine%" <<
+			"  spat(us) view(us) refn(us) samples costs  planes\n";
+
+	auto flags = out.flags();
+	out << std::fixed;
+	for (const Sweep& s: sweeps()) {
+		double pixels = std::max<uint64_t>(s.counts[PIXELS], 1);
+		out << std::setw(5) << s.iteration + 1 <<
+				std::setw(5) << (s.view == 0 ? "L" : "R") <<
+				std::setw(10) << (std::to_string(s.width) + "x" +
+						std::to_string(s.height)) <<
+				std::setprecision(3) << std::setw(10) << s.seconds <<
+				std::setprecision(2) <<
+				std::setw(10) << 100 * s.counts[SPATIAL_ACCEPTED] / pixels <<
+				std::setw(9) << 100 * s.counts[VIEW_ACCEPTED] / pixels <<
+				std::setw(9) << 100 * s.counts[REFINEMENT_ACCEPTED] / pixels <<
+				std::setw(10) << s.counts[SPATIAL_NS] / pixels / 1000 <<
+				std::setw(9) << s.counts[VIEW_NS] / pixels / 1000 <<
+				std::setw(9) << s.counts[REFINEMENT_NS] / pixels / 1000 <<
+				std::setprecision(1) <<
+				std::setw(8) << s.counts[REFINEMENT_SAMPLES] / pixels <<
+				std::setw(6) << s.counts[WINDOW_COSTS] / pixels <<
+				std::setw(8) << s.counts[WINDOW_PLANES] / pixels << "\n";
+	}
+	out.flags(flags);
+}
+
+
+/*************************************************************************
+* > writeJson()                                                          *
+* Writes the sweeps as a JSON array of objects, with the raw counters:   *
+* [ { "iteration": i, "view": "L", "width": w, "height": h,              *
+*     "seconds": s, "pixels": n, "spatial_accepted": n, ... }, ... ]     *
+*                                                                        *
+* Args:                                                                  *
+*   out (ostream): the output stream                                     *
+*************************************************************************/
+void Stats::writeJson(std::ostream& out) {
+
+	std::vector<Sweep> all = sweeps();
+
+	out << "[";
+	for (size_t i = 0; i < all.size(); ++i) {
+		const Sweep& s = all[i];
+		out << ((i == 0) ? "\n" : ",\n");
+		out << "  { \"iteration\": " << s.iteration << ", \"view\": \"" <<
+				(s.view == 0 ? "L" : "R") << "\", \"width\": " << s.width <<
+				", \"height\": " << s.height << ", \"seconds\": " << s.seconds;
+		for (unsigned c = 0; c < COUNTERS; ++c) {
+			out << ", \"" << COUNTER_NAMES[c] << "\": " << s.counts[c];
+		}
+		out << " }";
+	}
+	out << "\n]" << std::endl;
+}
@@ -1,9 +1,14 @@
 
 #include "stereo.hpp"
 
+#include <future>
+#include <algorithm>
+#include <chrono>
+
 #include "params.hpp"
 #include "log.hpp"
 #include "numbers.hpp"
+#include "stats.hpp"
 
 
 using std::to_string;
@@ -21,26 +26,183 @@ using std::to_string;
 *   imgPath (string): the path of the image to load.    *
 ********************************************************/
 StereoImage::StereoImage(const string& imgPath, Side side):
-		image(imgPath),
-		gradientX(0,0,1),
-		gradientY(0,0,1),
+		StereoImage(Image(imgPath), side) {}
+
+
+/********************************************************
+* > StereoImage()                                       *
+* Constructor. As above, from an image in memory.       *
+*                                                       *
+* Args:                                                 *
+*   img (Image&&): the image, moved into this instance. *
+********************************************************/
+StereoImage::StereoImage(Image&& img, Side side):
+		image(std::move(img)),
 		width(image.size(0)),
 		height(image.size(1)),
-		disparityPlanes(width, height, Grid<PlaneFunction>::Order::WIDTH_HEIGHT),
-		side(side) {
+		disparityPlanes(width, height, Grid<CompactPlane>::Order::WIDTH_HEIGHT),
+		planeCosts(width, height, Grid<float>::Order::WIDTH_HEIGHT,
+				std::numeric_limits<float>::quiet_NaN()),
+		side(side),
+		randomSeed(RandomDevice::newSeed()),
+		frameWidth(width),
+		windowKernel(selectWindowKernel(params.KERNEL)),
+		windowCostFn(windowCostFor(params.OUT_OF_BOUNDS,
+				params.PLANES_SATURATION, params.RESIZE_WINDOWS)),
+		candidatesStart(height * (width + 1)),
+		candidates(height * width),
+		indexedRows(height, false),
+		disparityMap(width, height, 1),
+		invalidMap(width, height, 1, 0),
+		confidenceMap(width, height, 1, 0) {
+
+	packPixels();
+	allocateCaches();
+}
+
+
+/***************************************************************************
+* > allocateCaches()                                                       *
+* Allocates the weights cache and the cost table, with the caps of params, *
+* if they fit. Each view has half of the caps: they are those of the pair. *
+* See releaseCaches().                                                     *
+***************************************************************************/
+void StereoImage::allocateCaches(void) {
+
+	// Cache of the window weights, if it fits in the memory cap
+	if (params.WEIGHTS_CACHE_MB > 0) {
+		size_t windowLength = params.WINDOW_SIZE * params.WINDOW_SIZE;
+		size_t maxBytes = size_t(params.WEIGHTS_CACHE_MB) << 19;
+		if (SlotCache<double>::slotsFor(width*height, windowLength, maxBytes) > 0) {
+			weightsCache.reset(new SlotCache<double>(width*height, windowLength,
+					maxBytes));
+		}
+	}
+
+	// Table of the pixel costs, if it fits in the memory cap. Not with
+	// OutOfBounds::ERROR: entries out of the other view would throw
+	if (params.COST_CACHE_MB > 0 && params.COST_CACHE_STEPS > 0 &&
+			params.MAX_D > params.MIN_D &&
+			params.OUT_OF_BOUNDS != Params::OutOfBounds::ERROR) {
+		size_t maxBytes = size_t(params.COST_CACHE_MB) << 19;
+		if (CostTable::bytesFor(width*height, params.MIN_D, params.MAX_D,
+				params.COST_CACHE_STEPS) <= maxBytes) {
+			costTable.reset(new CostTable(width*height, params.MIN_D,
+					params.MAX_D, params.COST_CACHE_STEPS));
+		}
+	}
+}
+
+
+/*************************************************************************
+* > releaseCaches()                                                      *
+* Frees the weights cache and the cost table, e.g. while a coarser level *
+* of the pyramid runs with its own (see initializePlanes()). Costs are   *
+* then computed without them, until allocateCaches().                    *
+*************************************************************************/
+void StereoImage::releaseCaches(void) {
+
+	weightsCache.reset();
+	costTable.reset();
+}
+
+
+/****************************************************************************
+* > packPixels()                                                            *
+* Fills 'pixels' from the image. Each pixel is a group of PIXEL_STRIDE      *
+* floats: red, green, blue, gradient x, gradient y, then padding (see the   *
+* Channel enum). Pixels are stored in row major order. A grayscale image is *
+* stored with three equal colour channels.                                  *
+* The gradients are those of the grayscale image (as Image::toGrayscale()): *
+* Sobel operator with repeated borders, as CImg::get_gradient("xy", 2).     *
+* With params.NORMALIZE_GRADIENTS, each one is mapped linearly to [0, 255], *
+* as CImg::normalize(). Grayscale, gradients and packing are fused in       *
+* passes over the rows, with three grayscale rows at a time: the first pass *
+* finds the range of the gradients (only to normalize), the second writes   *
+* the pixels. There are no temporaries as big as the frame.                 *
+****************************************************************************/
+void StereoImage::packPixels(void) {
+
+	bool isGray = (image.size(2) == 1);
 
-	// convert to grayscale and store the gradients
-	Image grayscale = image.toGrayscale();
-	CImgList<double> gradients;
-	grayscale.getCImg().get_gradient("xy", 2).move_to(gradients);
+	// Grayscale of row h, repeating the borders: gray[w+1] is column w
+	auto grayRow = [&] (long h, double* gray) {
+		h = std::min(std::max(h, 0L), long(height) - 1);
+		for (size_t w = 0; w < width; ++w) {
+			gray[w + 1] = isGray ? image.get(w, h, 0) :
+					image.get(w, h, 0) * 0.3 + image.get(w, h, 1) * 0.59 +
+					image.get(w, h, 2) * 0.11;
+		}
+		gray[0] = gray[1];
+		gray[width + 1] = gray[width];
+	};
+
+	// Sobel operator on a row, from the grayscale rows above (p), at (c)
+	// and below (n). Independent columns, so this loop is vectorized
+	static thread_local std::vector<double> rows, gradients;
+	rows.resize(3 * (width + 2));
+	gradients.resize(2 * width);
+	double* gradX = &gradients[0];
+	double* gradY = &gradients[width];
+	auto sobelRow = [&] (const double* p, const double* c, const double* n) {
+		for (size_t w = 0; w < width; ++w) {
+			gradX[w] = -p[w] - 2*c[w] - n[w] + p[w+2] + 2*c[w+2] + n[w+2];
+			gradY[w] = -p[w] - 2*p[w+1] - p[w+2] + n[w] + 2*n[w+1] + n[w+2];
+		}
+	};
+
+	// A pass over the rows: gradients of row h, then row(h)
+	auto gradientRows = [&] (const std::function<void(size_t)>& row) {
+		double* prev = &rows[0];
+		double* cur = &rows[width + 2];
+		double* next = &rows[2 * (width + 2)];
+		grayRow(0, cur);
+		std::copy(cur, cur + width + 2, prev);
+		for (size_t h = 0; h < height; ++h) {
+			grayRow(h + 1, next);
+			sobelRow(prev, cur, next);
+			row(h);
+			std::swap(prev, cur);
+			std::swap(cur, next);
+		}
+	};
 
+	// Range of the gradients
+	double minX = 0, maxX = 255, minY = 0, maxY = 255;
 	if (params.NORMALIZE_GRADIENTS) {
-		gradients(0).normalize(0,255);
-		gradients(1).normalize(0,255);
+		minX = minY = std::numeric_limits<double>::infinity();
+		maxX = maxY = -std::numeric_limits<double>::infinity();
+		gradientRows([&] (size_t) {
+			for (size_t w = 0; w < width; ++w) {
+				minX = std::min(minX, gradX[w]);
+				maxX = std::max(maxX, gradX[w]);
+				minY = std::min(minY, gradY[w]);
+				maxY = std::max(maxY, gradY[w]);
+			}
+		});
 	}
 
-	gradientX = std::move(gradients(0));
-	gradientY = std::move(gradients(1));
+	// Pixels
+	auto normalized = [] (double value, double min, double max) {
+		return (max == min) ? 0 : (value - min) / (max - min) * 255;
+	};
+	pixels.assign(width * height * PIXEL_STRIDE, 0);
+	gradientRows([&] (size_t h) {
+		for (size_t w = 0; w < width; ++w) {
+			float* p = &pixels[(h * width + w) * PIXEL_STRIDE];
+
+			p[RED] = image.get(w, h, 0);
+			p[GREEN] = image.get(w, h, isGray ? 0 : 1);
+			p[BLUE] = image.get(w, h, isGray ? 0 : 2);
+			if (params.NORMALIZE_GRADIENTS) {
+				p[GRAD_X] = normalized(gradX[w], minX, maxX);
+				p[GRAD_Y] = normalized(gradY[w], minY, maxY);
+			} else {
+				p[GRAD_X] = gradX[w];
+				p[GRAD_Y] = gradY[w];
+			}
+		}
+	});
 }
 
 
@@ -67,13 +229,47 @@ double StereoImage::disparityAt(size_t w, size_t h) const {
 }
 
 
+/*************************************************************************
+* > planeCost()                                                          *
+* Returns the window cost of the current plane of pixel (w,h). Costs are *
+* kept in planeCosts, and must be updated with each new plane. A NaN     *
+* cost is unknown: it is computed here, then saved.                      *
+* Costs are kept as floats: a new cost is lower only if it is lower as a *
+* float, otherwise the same plane could replace itself.                  *
+* NOTE: bounds are not checked.                                          *
+*                                                                        *
+* Args:                                                                  *
+*   w (size_t), h (size_t): pixel coordinate                             *
+*                                                                        *
+* Returns:                                                               *
+*   (double): the cost of disparityPlanes(w,h), as in planeCosts         *
+*************************************************************************/
+double StereoImage::planeCost(size_t w, size_t h) {
+
+	float& cost = planeCosts(w, h);
+	if (std::isnan(cost)) {
+		cost = pixelWindowCost(w, h, disparityPlanes.get(w, h));
+	}
+
+	return cost;
+}
+
+
 /**************************************************************
 * > displayGradients()                                        *
 * Visualizes the x,y gradient images (renormalized in 0-255). *
 **************************************************************/
 void StereoImage::displayGradients(void) const {
-	gradientX.display();
-	gradientY.display();
+
+	CImg<double> gradX(width, height, 1, 1), gradY(width, height, 1, 1);
+	for (size_t h = 0; h < height; ++h) {
+		for (size_t w = 0; w < width; ++w) {
+			gradX(w, h) = pixelAt(w, h)[GRAD_X];
+			gradY(w, h) = pixelAt(w, h)[GRAD_Y];
+		}
+	}
+	gradX.display();
+	gradY.display();
 }
 
 
@@ -83,21 +279,26 @@ void StereoImage::displayGradients(void) const {
 * view (image), and q as the corresponding pixel in the other view.        *
 * q has coordinates: (w + disparity(p), h).                                *
 * See the reference paper, PatchMatch Stereo, for the function definition. *
+* The template arguments are params.OUT_OF_BOUNDS and                      *
+* params.PLANES_SATURATION, fixed at compile time. See windowCostFor().    *
 * NOTE: requires a bound instance and an RGB image.                        *
 * NOTE: the result for out-of-bounds coordinates is specified by           *
-* params.OUT_OF_BOUNDS.                                                    *
+* OUT_OF_BOUNDS.                                                           *
+* NOTE: bounds are checked only if NDEBUG is not defined.                  *
 * NOTE: pay attention at implicit conversions int -> size_t.               *
 *                                                                          *
 * Args:                                                                    *
 *   w (size_t), h (size_t): coordinates of the pixel in this image         *
-*   disparity (PlaneFunction): the disparity function                      *
+*   disparity (CompactPlane): the disparity function                       *
 *                                                                          *
 * Returns:                                                                 *
 *   (double): the disparity measure                                        *
 ***************************************************************************/
+template<Params::OutOfBounds OUT_OF_BOUNDS, bool PLANES_SATURATION>
 double StereoImage::pixelDissimilarity(size_t w, size_t h,
-		const PlaneFunction& disparity) const {
+		const CompactPlane& disparity) const {
 	
+#ifndef NDEBUG
 	// checks
 	if (other == nullptr) {
 		throw std::logic_error("pixelDissimilarity(). Instance not bound");
@@ -106,21 +307,18 @@ double StereoImage::pixelDissimilarity(size_t w, size_t h,
 		throw std::range_error("pixelDissimilarity(). Out of bounds (" +
 				to_string(w) + ", " + to_string(h) + ")");
 	}
+#endif // NDEBUG
 
 	// Disparity
 	double d = disparity(w, h);
 
-	if (params.PLANES_SATURATION) { // Plane saturation on/off
+	if (PLANES_SATURATION) { // Plane saturation on/off
 		if (d > params.MAX_D) d = params.MAX_D;
 		if (d < params.MIN_D) d = params.MIN_D;
 	}
 
 	// Coordinates of the other pixel
-	int sign;
-	switch (side) {
-		case LEFT: sign = -1; break;
-		case RIGHT: sign = +1; break;
-	}
+	int sign = (side == LEFT) ? -1 : +1;
 	double qW = w + sign * d;
 
 	// Is (qW, qH) out of the image?
@@ -128,7 +326,7 @@ double StereoImage::pixelDissimilarity(size_t w, size_t h,
 	if (qW < 0 || qW > (other->width-1)) {
 		qIsOut = true;
 
-		switch (params.OUT_OF_BOUNDS) {
+		switch (OUT_OF_BOUNDS) {
 			case Params::OutOfBounds::ZERO_COST:
 				return 0;
 			case Params::OutOfBounds::NAN_COST:
@@ -139,38 +337,40 @@ double StereoImage::pixelDissimilarity(size_t w, size_t h,
 						") in the other view is out of bounds");
 			case Params::OutOfBounds::REPEAT_PIXEL:
 				qIsOut = false;		// false means solved; no 'break;' here
+				// fall through
 			case Params::OutOfBounds::BLACK_PIXEL:
 				if (qW < 0) { qW = 0; }
-				else if (qW >= other->width) { qW = other->width-1; }
+				else if (qW > other->width-1) { qW = other->width-1; }
 		}
 	}
 
 	// Colour and gradient of this pixel
-	double pR = image.get(w,h,0);
-	double pG = image.get(w,h,1);
-	double pB = image.get(w,h,2);
-	double pGrX = gradientX.get(w,h);
-	double pGrY = gradientY.get(w,h);
-
-	// Colour and gradient of the other pixel
-	double qR = other->image.atH(qW,h,0);
-	double qG = other->image.atH(qW,h,1);
-	double qB = other->image.atH(qW,h,2);
-	double qGrX = other->gradientX.atH(qW,h,0);
-	double qGrY = other->gradientY.atH(qW,h,0);
+	const float* p = pixelAt(w, h);
+
+	// Colour and gradient of the other pixel: linear interpolation of the
+	// two pixels around qW
+	size_t qLow = std::floor(qW);
+	size_t qHigh = std::ceil(qW);
+	float x = qW - qLow;
+	const float* q0 = other->pixelAt(qLow, h);
+	const float* q1 = other->pixelAt(qHigh, h);
+
+	float q[PIXEL_CHANNELS];
+	for (size_t c = 0; c < PIXEL_CHANNELS; ++c) {
+		q[c] = q0[c] * (1 - x) + q1[c] * x;
+	}
 
 	// Is (qW, qH) out of the image?
-	if (qIsOut && params.OUT_OF_BOUNDS == Params::OutOfBounds::BLACK_PIXEL) {
-		qR = 0; qG = 0; qB = 0;
-		qGrX = 0; qGrY = 0;
+	if (qIsOut && OUT_OF_BOUNDS == Params::OutOfBounds::BLACK_PIXEL) {
+		std::fill(q, q + PIXEL_CHANNELS, 0);
 	}
 
 	// Function
-	double gradientDist = std::abs(pGrX - qGrX) +
-			std::abs(pGrY - qGrY);  // NOTE: L1
-	double colourDist = std::abs(pR - qR) +
-			std::abs(pG - qG) +
-			std::abs(pB - qB);      // NOTE: L1
+	double gradientDist = std::abs(p[GRAD_X] - q[GRAD_X]) +
+			std::abs(p[GRAD_Y] - q[GRAD_Y]);  // NOTE: L1
+	double colourDist = std::abs(p[RED] - q[RED]) +
+			std::abs(p[GREEN] - q[GREEN]) +
+			std::abs(p[BLUE] - q[BLUE]);      // NOTE: L1
 
 	double res = (1 - params.ALFA) * std::min(colourDist, params.TAU_COL) +
 			params.ALFA * std::min(gradientDist, params.TAU_GRAD);
@@ -185,6 +385,7 @@ double StereoImage::pixelDissimilarity(size_t w, size_t h,
 * paper, PatchMatch Stereo. It returns a weight (0,1] that is higer for    *
 * pixels with similar colour. An idea called adaptive support weight       *
 * function. The two pixels are from this image.                            *
+* NOTE: bounds are checked only if NDEBUG is not defined.                  *
 *                                                                          *
 * Args:                                                                    *
 *   w1 (size_t): width coordinate of the first point.                      *
@@ -198,6 +399,7 @@ double StereoImage::pixelDissimilarity(size_t w, size_t h,
 double StereoImage::adaptiveWeight(size_t w1, size_t h1, size_t w2, size_t h2)
 		const {
 
+#ifndef NDEBUG
 	// checks
 	if (w1 >= width || h1 >= height) {
 		throw std::domain_error("adaptiveWeight(). Out of bounds (" +
@@ -207,106 +409,364 @@ double StereoImage::adaptiveWeight(size_t w1, size_t h1, size_t w2, size_t h2)
 		throw std::domain_error("adaptiveWeight(). Out of bounds (" +
 				to_string(w2) + ", " + to_string(h2) + ")");
 	}
+#endif // NDEBUG
 
-	// Colour of the first point
-	double p1R = image.get(w1,h1,0);
-	double p1G = image.get(w1,h1,1);
-	double p1B = image.get(w1,h1,2);
+	// Colour of the two points
+	const float* p1 = pixelAt(w1, h1);
+	const float* p2 = pixelAt(w2, h2);
 
-	// Colour of the second point
-	double p2R = image.get(w2,h2,0);
-	double p2G = image.get(w2,h2,1);
-	double p2B = image.get(w2,h2,2);
-
-	double colourDist = std::abs(p1R - p2R) +
-			std::abs(p1G - p2G) +
-			std::abs(p1B - p2B);
+	double colourDist = std::abs(p1[RED] - p2[RED]) +
+			std::abs(p1[GREEN] - p2[GREEN]) +
+			std::abs(p1[BLUE] - p2[BLUE]);
 
 	return std::exp(-colourDist/params.GAMMA);
 }
 
 
+/****************************************************************************
+* > windowWeights()                                                         *
+* Computes all the adaptive weights of the window around (w,h), that is     *
+* adaptiveWeight(w, h, iW, iH) for each (iW, iH) in the window. The window  *
+* is the full square of side params.WINDOW_SIZE. The weight of (iW, iH) is  *
+* saved at index: (iH - h + WINDOW_SIZE/2) * WINDOW_SIZE +                  *
+* (iW - w + WINDOW_SIZE/2). Pixels outside this image have weight 0.        *
+* NOTE: bounds for (w,h) are not checked.                                   *
+*                                                                           *
+* Args:                                                                     *
+*   w (size_t), h (size_t): the central pixel                               *
+*   weights (double*): output array of WINDOW_SIZE^2 elements               *
+****************************************************************************/
+void StereoImage::windowWeights(size_t w, size_t h, double* weights) const {
+
+	long half = params.WINDOW_SIZE / 2;
+	for (long dH = -half; dH <= half; ++dH) {
+		for (long dW = -half; dW <= half; ++dW) {
+			long iW = w + dW;
+			long iH = h + dH;
+			double& weight = *(weights++);
+
+			if (iW < 0 || iW >= (long)width || iH < 0 || iH >= (long)height) {
+				weight = 0;
+			} else {
+				weight = adaptiveWeight(w, h, iW, iH);
+			}
+		}
+	}
+}
+
+
 /****************************************************************************
 * > pixelWindowCost()                                                       *
 * Computes the total matching cost for pixel (w,h). The total cost is the   *
 * sum of all matching costs for each pixel in a square window around (w,g). *
 * Each pixel in the window is matched againts a pixel in the other view,    *
 * according to the disparity function 'disparity'.                          *
-* NOTE: Out of bounds pixels are ignored.                                   *
+* This checks the arguments, then runs windowCostFn: the windowCost()       *
+* specialized for the current params.                                       *
+* With a finite bound, the sum stops as soon as the cost can't be lower     *
+* than bound: candidates that can't beat the current cost are rejected      *
+* early. The result is then a value not lower than bound.                   *
 *                                                                           *
 * Args:                                                                     *
 *   w (size_t): width coordinate of the pixel                               *
 *   h (size_t): height coordinate of the pixel                              *
-*   disparity (PlaneFunction): disparity plane                              *
+*   disparity (CompactPlane): disparity plane                               *
+*   bound (double): the cost to beat. Infinity by default                   *
 *                                                                           *
 * Returns:                                                                  *
-*   (double): window matching cost                                          *
+*   (double): window matching cost, or a value >= bound                     *
 ****************************************************************************/
 double StereoImage::pixelWindowCost(size_t w, size_t h,
-		const PlaneFunction& disparity) const {
+		const CompactPlane& disparity, double bound) const {
 	
+	double cost;
+	pixelWindowCosts(w, h, &disparity, 1, bound, &cost);
+	return cost;
+}
+
+
+/**************************************************************************
+* > pixelWindowCosts()                                                    *
+* As pixelWindowCost(), for nPlanes planes of the same pixel at once.     *
+* With a vectorized kernel, all the planes are scored in one pass on the  *
+* window: pixels and weights of (w,h) are loaded once for all of them.    *
+*                                                                         *
+* Args:                                                                   *
+*   w (size_t): width coordinate of the pixel                             *
+*   h (size_t): height coordinate of the pixel                            *
+*   planes (CompactPlane*): the disparity planes                          *
+*   nPlanes (size_t): how many planes. In [1, MAX_WINDOW_PLANES]          *
+*   bound (double): the cost to beat                                      *
+*   costs (double*): output. The cost of each plane, or a value >= bound  *
+**************************************************************************/
+void StereoImage::pixelWindowCosts(size_t w, size_t h,
+		const CompactPlane* planes, size_t nPlanes, double bound,
+		double* costs) const {
+
 	// checks
+	if (other == nullptr) {
+		throw std::logic_error("pixelWindowCost(). Instance not bound");
+	}
 	if (w >= width || h >= height) {
 		throw std::domain_error("pixelWindowCost(). Out of bounds (" +
 				to_string(w) + ", " + to_string(h) + ")");
 	}
+	if (nPlanes == 0 || nPlanes > MAX_WINDOW_PLANES) {
+		throw std::invalid_argument("pixelWindowCosts(). " +
+				to_string(nPlanes) + " planes, at most " +
+				to_string(MAX_WINDOW_PLANES) + " allowed");
+	}
+
+	SPMATCH_COUNT(side, Stats::WINDOW_COSTS, 1);
+	SPMATCH_COUNT(side, Stats::WINDOW_PLANES, nPlanes);
+	(this->*windowCostFn)(w, h, planes, nPlanes, bound, costs);
+}
 
-	// Setting the lenght of the window
-	unsigned halfSideW = params.WINDOW_SIZE / 2;
-	unsigned halfSideH = params.WINDOW_SIZE / 2;
 
-	// Shrink slanted windows?
-	if (params.RESIZE_WINDOWS) {
-		double ncx = disparity.getParams().first(0);  // directional cosine of the
-		double ncy = disparity.getParams().first(1);  // normal
-		double cx = std::sqrt(1 - ncx * ncx);   // directional cosine of the plane
-		double cy = std::sqrt(1 - ncy * ncy);
+/****************************************************************************
+* > windowCost()                                                            *
+* The body of pixelWindowCosts(). The template arguments are the params     *
+* with the same name, fixed at compile time, so that the inner loop has no  *
+* branches on them. See windowCostFor().                                    *
+* NOTE: Out of bounds pixels are ignored.                                   *
+* NOTE: weights are read from weightsCache, if enabled.                     *
+* NOTE: with costTable, the pixel costs of saturated disparities are read   *
+* from the table, interpolated: then the scalar loop is used. Where the     *
+* table gives NaN (near the borders of the other view), the exact cost.     *
+* NOTE: the sum runs on windowKernel, if set, for all the planes at once.   *
+* The scalar loop is the reference implementation, one plane at a time.     *
+* NOTE: with RESIZE_WINDOWS each plane has its own window: the kernel scans *
+* the union of them.                                                        *
+* NOTE: the arguments are not checked.                                      *
+* NOTE: with OutOfBounds::ERROR the bound is ignored, so that errors are    *
+* always detected.                                                          *
+*                                                                           *
+* Args:                                                                     *
+*   w (size_t): width coordinate of the pixel                               *
+*   h (size_t): height coordinate of the pixel                              *
+*   planes (CompactPlane*): disparity planes                                *
+*   nPlanes (size_t): how many planes                                       *
+*   bound (double): the cost to beat                                        *
+*   costs (double*): output. Window matching cost of each plane, or a       *
+*       value >= bound                                                      *
+****************************************************************************/
+template<Params::OutOfBounds OUT_OF_BOUNDS, bool PLANES_SATURATION,
+		bool RESIZE_WINDOWS>
+void StereoImage::windowCost(size_t w, size_t h, const CompactPlane* planes,
+		size_t nPlanes, double bound, double* costs) const {
 
-		halfSideW = std::round(params.WINDOW_SIZE * cx) / 2;
-		halfSideH = std::round(params.WINDOW_SIZE * cy) / 2;
+	if (OUT_OF_BOUNDS == Params::OutOfBounds::ERROR) {
+		bound = std::numeric_limits<double>::infinity();
 	}
 
-	// Setting the extremes of the window
-	size_t minW = (w > halfSideW) ? (w - halfSideW) : 0;
-	size_t maxW = (w + halfSideW >= width) ? (width - 1) : (w + halfSideW);
-	size_t minH = (h > halfSideH) ? (h - halfSideH) : 0;
-	size_t maxH = (h + halfSideH >= height) ? (height - 1) : (h + halfSideH);
+	// The planes, with the extremes of their windows
+	size_t offset = params.WINDOW_SIZE / 2;
+	WindowTask task = { pixels.data(), other->pixels.data(),
+			width, other->width, nullptr, params.WINDOW_SIZE,
+			width, 0, height, 0, nPlanes, {},
+			(side == LEFT) ? -1 : +1, bound };
+	for (size_t k = 0; k < nPlanes; ++k) {
+
+		// Setting the lenght of the window
+		unsigned halfSideW = params.WINDOW_SIZE / 2;
+		unsigned halfSideH = params.WINDOW_SIZE / 2;
+
+		// Shrink slanted windows?
+		if (RESIZE_WINDOWS) {
+			Vector3d normal = planes[k].normal();
+			double ncx = normal(0);  // directional cosine of the normal
+			double ncy = normal(1);
+			double cx = std::sqrt(1 - ncx * ncx);   // directional cosine of the plane
+			double cy = std::sqrt(1 - ncy * ncy);
+
+			halfSideW = std::round(params.WINDOW_SIZE * cx) / 2;
+			halfSideH = std::round(params.WINDOW_SIZE * cy) / 2;
+		}
+
+		// Setting the extremes of the window
+		WindowPlane& window = task.planes[k];
+		window.a = planes[k].a;
+		window.b = planes[k].b;
+		window.c = planes[k].c;
+		window.minW = (w > halfSideW) ? (w - halfSideW) : 0;
+		window.maxW = (w + halfSideW >= width) ? (width - 1) : (w + halfSideW);
+		window.minH = (h > halfSideH) ? (h - halfSideH) : 0;
+		window.maxH = (h + halfSideH >= height) ? (height - 1) : (h + halfSideH);
+
+		task.minW = std::min(task.minW, window.minW);
+		task.maxW = std::max(task.maxW, window.maxW);
+		task.minH = std::min(task.minH, window.minH);
+		task.maxH = std::max(task.maxH, window.maxH);
+	}
 
 	// Scan each pixel in the window
-	double totalCost = 0;
-	int nPixels = 0;
-	for (size_t iW = minW; iW <= maxW; ++iW) {
-		for (size_t iH = minH; iH <= maxH; ++iH) {
+	double totalCost[MAX_WINDOW_PLANES];
+	long nPixels[MAX_WINDOW_PLANES];
+	bool stopped[MAX_WINDOW_PLANES];
+	auto accumulate = [&] (const double* weights) {
+
+		// Vectorized kernel. It gives up only on errors: the scalar loop
+		// below throws them
+		if (windowKernel != nullptr && weights != nullptr && !costTable) {
+			task.weights = &weights[(task.minH + offset - h) * params.WINDOW_SIZE +
+					(task.minW + offset - w)];
+			WindowSum sum = windowKernel(task);
+			if (!sum.outOfBounds) {
+				std::copy(sum.cost, sum.cost + nPlanes, totalCost);
+				std::copy(sum.count, sum.count + nPlanes, nPixels);
+				std::copy(sum.stopped, sum.stopped + nPlanes, stopped);
+				return;
+			}
+		}
+
+		for (size_t k = 0; k < nPlanes; ++k) {
+			const WindowPlane& window = task.planes[k];
+			totalCost[k] = 0;
+			nPixels[k] = 0;
+			stopped[k] = false;
+
+			for (size_t iH = window.minH; iH <= window.maxH; ++iH) {  // row major
+				for (size_t iW = window.minW; iW <= window.maxW; ++iW) {
+
+					// Is this a valid cost?
+					double dissimilarity = std::numeric_limits<double>::quiet_NaN();
+					if (costTable) {
+						double d = planes[k](iW, iH);
+						if (PLANES_SATURATION || (d >= params.MIN_D && d <= params.MAX_D)) {
+							d = std::min<double>(std::max<double>(d, params.MIN_D),
+									params.MAX_D);
+							dissimilarity = costTable->at(iH * width + iW, d,
+									[&] (double dk) {
+										return pixelDissimilarity<OUT_OF_BOUNDS,
+												PLANES_SATURATION>(iW, iH, CompactPlane(0, 0, dk));
+									});
+						}
+					}
+					if (!costTable || std::isnan(dissimilarity)) {
+						dissimilarity = pixelDissimilarity<OUT_OF_BOUNDS,
+								PLANES_SATURATION>(iW, iH, planes[k]);
+					}
+					if (OUT_OF_BOUNDS == Params::OutOfBounds::NAN_COST &&
+							std::isnan(dissimilarity)) {
+						continue;
+					}
 
-			// Is this a valid cost?
-			double dissimilarity = pixelDissimilarity(iW, iH, disparity);
-			if (std::isnan(dissimilarity)) { continue; }
+					// Accumulate the total with the current pixel
+					double weight = (weights != nullptr) ?
+							weights[(iH + offset - h) * params.WINDOW_SIZE +
+									(iW + offset - w)] :
+							adaptiveWeight(w, h, iW, iH);
+					totalCost[k] += weight * dissimilarity;
+					++nPixels[k];
+				}
 
-			// Accumulate the total with the current pixel
-			totalCost += adaptiveWeight(w, h, iW, iH) * dissimilarity;
-			++nPixels;
+				// Can it still win? Costs are not negative: at best, all the
+				// remaining pixels are valid with cost 0
+				size_t remaining = (window.maxH - iH) *
+						(window.maxW - window.minW + 1);
+				if (iH < window.maxH &&
+						totalCost[k] >= bound * (nPixels[k] + remaining)) {
+					stopped[k] = true;
+					break;
+				}
+			}
 		}
+	};
+
+	// Read the weights from the cache, if enabled. The vectorized kernel
+	// needs all of them, anyway
+	if (weightsCache) {
+		auto slot = weightsCache->get(h * width + w);
+		if (slot.isNew()) { windowWeights(w, h, slot.data()); }
+		accumulate(slot.data());
+	} else if (windowKernel != nullptr) {
+		static thread_local std::vector<double> weights;
+		weights.resize(params.WINDOW_SIZE * params.WINDOW_SIZE);
+		windowWeights(w, h, weights.data());
+		accumulate(weights.data());
+	} else {
+		accumulate(nullptr);
 	}
 
-	// Normalizing the cost
-	double total = totalCost / nPixels;
+	for (size_t k = 0; k < nPlanes; ++k) {
 
-	// Check Nan cost due to borders
-	if (nPixels == 0) {
-		if (((side == LEFT && w > (unsigned)params.MAX_D) ||		// positive MAX_D
-				(side == RIGHT && w < (width - params.MAX_D))) &&
-				params.PLANES_SATURATION) { // this is an error only if we
-			                              // always saturate
-			throw std::logic_error("pixelWindowCost(). The window of pixel (" +
-					to_string(w) + ", " + to_string(h) +
-					") shouldn't fall completely outside\n" +
-					"Plane: " + sStr(disparityPlanes.get(w, h)));
-		} else {
-			return 300; // NOTE: pixel on the border: can't compute disparity
+		// Rejected early
+		if (stopped[k]) {
+			costs[k] = bound;
+			continue;
+		}
+
+		// Check Nan cost due to borders
+		if (nPixels[k] == 0) {
+			if (((side == LEFT && w > (unsigned)params.MAX_D) ||		// positive MAX_D
+					(side == RIGHT && w < (width - params.MAX_D))) &&
+					PLANES_SATURATION) {        // this is an error only if we
+				                              // always saturate
+				throw std::logic_error("pixelWindowCost(). The window of pixel (" +
+						to_string(w) + ", " + to_string(h) +
+						") shouldn't fall completely outside\n" +
+						"Plane: " + sStr(disparityPlanes.get(w, h)));
+			} else {
+				costs[k] = 300; // NOTE: pixel on the border: can't compute disparity
+				continue;
+			}
 		}
+
+		// Normalizing the cost
+		costs[k] = totalCost[k] / nPixels[k];
 	}
-	
-	return total;
+}
+
+
+// The other two flags of windowCostFor(). See below
+template<Params::OutOfBounds OUT_OF_BOUNDS>
+StereoImage::WindowCostFn StereoImage::windowCostFor(bool saturation,
+		bool resize) {
+
+	if (saturation) {
+		return resize ? &StereoImage::windowCost<OUT_OF_BOUNDS, true, true> :
+				&StereoImage::windowCost<OUT_OF_BOUNDS, true, false>;
+	} else {
+		return resize ? &StereoImage::windowCost<OUT_OF_BOUNDS, false, true> :
+				&StereoImage::windowCost<OUT_OF_BOUNDS, false, false>;
+	}
+}
+
+
+/**************************************************************************
+* > windowCostFor()                                                       *
+* Selects the instance of windowCost() for the given params. There is one *
+* instance for each combination.                                          *
+*                                                                         *
+* Args:                                                                   *
+*   outOfBounds (OutOfBounds): params.OUT_OF_BOUNDS                       *
+*   saturation (bool): params.PLANES_SATURATION                           *
+*   resize (bool): params.RESIZE_WINDOWS                                  *
+*                                                                         *
+* Returns:                                                                *
+*   (WindowCostFn): the window cost function                              *
+**************************************************************************/
+StereoImage::WindowCostFn StereoImage::windowCostFor(
+		Params::OutOfBounds outOfBounds, bool saturation, bool resize) {
+
+	switch (outOfBounds) {
+		case Params::OutOfBounds::REPEAT_PIXEL:
+			return windowCostFor<Params::OutOfBounds::REPEAT_PIXEL>(saturation,
+					resize);
+		case Params::OutOfBounds::BLACK_PIXEL:
+			return windowCostFor<Params::OutOfBounds::BLACK_PIXEL>(saturation,
+					resize);
+		case Params::OutOfBounds::ZERO_COST:
+			return windowCostFor<Params::OutOfBounds::ZERO_COST>(saturation,
+					resize);
+		case Params::OutOfBounds::ERROR:
+			return windowCostFor<Params::OutOfBounds::ERROR>(saturation, resize);
+		case Params::OutOfBounds::NAN_COST:
+			return windowCostFor<Params::OutOfBounds::NAN_COST>(saturation,
+					resize);
+	}
+
+	throw std::invalid_argument("windowCostFor(). Unknown OutOfBounds");
 }
 
 
@@ -330,6 +790,55 @@ Image StereoImage::getDisparityMap(void) const {
 }
 
 
+/*******************************************************************
+* > getPlanesMap()                                                 *
+* Produces an Image with the coefficients of disparityPlanes.      *
+*                                                                  *
+* Returns:                                                         *
+*   (Image): three channels: a, b, c of the plane a*x + b*y + c of *
+*       each pixel                                                 *
+*******************************************************************/
+Image StereoImage::getPlanesMap(void) const {
+
+	Image planes(width, height, 3);
+	for (size_t w = 0; w < width; ++w) {
+		for (size_t h = 0; h < height; ++h) {
+			const CompactPlane& plane = disparityPlanes.get(w, h);
+			planes(w, h, 0) = plane.a;
+			planes(w, h, 1) = plane.b;
+			planes(w, h, 2) = plane.c;
+		}
+	}
+
+	return planes;
+}
+
+
+/*********************************************************************
+* > getCostsMap()                                                    *
+* Produces an Image with the window cost of the plane of each pixel. *
+* Known costs come from planeCosts; the unknown ones (as those of    *
+* the planes filled by the post processing) are computed here, but   *
+* not saved.                                                         *
+*                                                                    *
+* Returns:                                                           *
+*   (Image): the cost for each pixel, as a grayscale image           *
+*********************************************************************/
+Image StereoImage::getCostsMap(void) const {
+
+	Image costs(width, height, 1);
+	for (size_t w = 0; w < width; ++w) {
+		for (size_t h = 0; h < height; ++h) {
+			float cost = planeCosts.get(w, h);
+			costs(w, h) = std::isnan(cost) ?
+					pixelWindowCost(w, h, disparityPlanes.get(w, h)) : cost;
+		}
+	}
+
+	return costs;
+}
+
+
 /****************************************************************************
 * > bind()                                                                  *
 * Associate the current instance to the other one and vice-versa.           *
@@ -371,168 +880,622 @@ void StereoImage::unbind(void) {
 }
 
 
+/***************************************************************************
+* > setFrameOrigin()                                                       *
+* Places this image in a bigger frame, e.g. as a tile: the random streams  *
+* of each pixel (see seekRandom()) are those of the same pixel of the      *
+* frame, so the random planes of a tile are those of the whole frame. The  *
+* coarser levels of the pyramid (see downscaled()) keep their own streams. *
+*                                                                          *
+* Args:                                                                    *
+*   w0 (size_t), h0 (size_t): the pixel (0,0) of this image in the frame   *
+*   frameWidth (size_t): the width of the frame                            *
+***************************************************************************/
+void StereoImage::setFrameOrigin(size_t w0, size_t h0, size_t frameWidth) {
+
+	// checks
+	if (w0 + width > frameWidth) {
+		throw std::invalid_argument("setFrameOrigin(). Out of the frame");
+	}
+
+	originW = w0;
+	originH = h0;
+	this->frameWidth = frameWidth;
+}
+
+
 /************************************************************************
 * > setRandomDisparities()                                              *
 * Set all 'disparityPlanes' to random linear functions. The range of    *
 * disparity values in the central pixel of each plane is given by the   *
 * parameters [params.MIN_D, params.MAX_D]. The angle of the plane is at *
-* most params.MAX_SLOPE.                                                *
+* most params.MAX_SLOPE. All the costs become unknown.                  *
+* Each pixel draws from its own stream: see seekRandom().               *
 ************************************************************************/
 void StereoImage::setRandomDisparities(void) {
 
 	for (size_t w = 0; w < width; ++w) {
 		for (size_t h = 0; h < height; ++h) {
-			disparityPlanes(w, h).setRandomFunction(w, h,
-					params.MIN_D, params.MAX_D, 0, params.MAX_SLOPE);
+			seekRandom(w, h, INIT_STREAM, 0);
+			planeCosts(w, h) = std::numeric_limits<float>::quiet_NaN();
+			disparityPlanes(w, h) = randomPlane(w, h);
+		}
+	}
+}
 
-			// Force planar windows if requested
-			if (params.CONST_DISPARITIES) {
-				disparityPlanes(w, h).setPlane({0,0,-1}, disparityPlanes(w, h)(w, h));
-			}
+
+/******************************************************************
+* > setPlanes()                                                   *
+* Sets all 'disparityPlanes' and their costs to the output of the *
+* GPU backend. See gpuMatch().                                    *
+*                                                                 *
+* Args:                                                           *
+*   view (GpuView): the output of gpuMatch() for this view        *
+******************************************************************/
+void StereoImage::setPlanes(const GpuView& view) {
+
+	if (view.planes.size() != 3 * width * height ||
+			view.costs.size() != width * height) {
+		throw std::invalid_argument("setPlanes(). Inconsistent sizes");
+	}
+
+	for (size_t h = 0; h < height; ++h) {
+		for (size_t w = 0; w < width; ++w) {
+			size_t i = h * width + w;
+			disparityPlanes(w, h) = CompactPlane(view.planes[3 * i],
+					view.planes[3 * i + 1], view.planes[3 * i + 2]);
+			planeCosts(w, h) = view.costs[i];
 		}
 	}
 }
 
 
 /****************************************************************************
-* > pixelSpatialPropagation()                                               *
-* Spatial propagation step for a single pixel. If the plane of a spatial    *
-* neighbor of p = (w,h) has a lower cost than the current plane of p, that  *
-* plane is assigned to p. If iteration is an even number, the neighbors are *
-* the left and upper pixels.                                                *
-* NOTE: bounds are not checked                                              *
+* > setAggregatedDisparities()                                              *
+* Sets all 'disparityPlanes' to constant planes, chosen in a cost volume:   *
+* for each integer disparity in [params.MIN_D, params.MAX_D], the cost of   *
+* each pixel (as in pixelDissimilarity(), the maximum if out of the other   *
+* view) is aggregated by a guided filter, with the gray image as a guide,   *
+* radius WINDOW_SIZE / 2 and regularization params.GUIDED_EPS. Each pixel   *
+* takes the disparity of lower aggregated cost. All the costs become        *
+* unknown. A fast initialization, and with no iterations a preview.         *
+* The disparities are split between the threads of the pool.                *
+* NOTE: requires a bound instance.                                          *
 *                                                                           *
 * Args:                                                                     *
-*   w (size_t), h (size_t): coordinates of the pixel to check               *
-*   iteration (unsigned): the iteration number                              *
-*                                                                           *
-* Returns:                                                                  *
-*   (bool): true if the plane of p has been modified                        *
+*   pool (ThreadPool): the threads to use                                   *
 ****************************************************************************/
-bool StereoImage::pixelSpatialPropagation(size_t w, size_t h,
-		unsigned iteration) {
+void StereoImage::setAggregatedDisparities(ThreadPool& pool) {
 
-	// Direction
-	int direction = (iteration % 2 == 0) ? -1 : 1;
-
-	// Do the neighbors exist?
-	bool hasHorizontalPixel = (direction == -1) ? (w > 0) : (w < width-1);
-	bool hasVerticalPixel = (direction == -1) ? (h > 0) : (h < height-1);
+	// checks
+	if (other == nullptr) {
+		throw std::logic_error("setAggregatedDisparities(). Instance not bound");
+	}
 
-	// Neighbors
-	size_t horzW = w + direction;  // modular arithmetic
-	size_t vertH = h + direction;
+	size_t n = width * height;
+	unsigned radius = params.WINDOW_SIZE / 2;
+	int sign = (side == LEFT) ? -1 : +1;
+	double maxCost = (1 - params.ALFA) * params.TAU_COL +
+			params.ALFA * params.TAU_GRAD;
+
+	// The guide, its means and variances
+	std::vector<float> guide(n), guide2(n), meanI, varI;
+	for (size_t i = 0; i < n; ++i) {
+		const float* p = &pixels[i * PIXEL_STRIDE];
+		guide[i] = (p[RED] + p[GREEN] + p[BLUE]) / (3 * 255.0f);
+		guide2[i] = guide[i] * guide[i];
+	}
+	boxFilter(guide, width, height, radius, meanI);
+	boxFilter(guide2, width, height, radius, varI);
+	for (size_t i = 0; i < n; ++i) {
+		varI[i] -= meanI[i] * meanI[i];
+	}
 
-	// 
-	bool modified = false;
-	double thisCost = pixelWindowCost(w, h, disparityPlanes.get(w, h));
+	// The best disparity for a subset of disparities: 'group' of 'groups'
+	struct Best {
+		std::vector<float> costs;
+		std::vector<int> disparities;
+	};
+	unsigned groups = std::min<int>(pool.size(), params.MAX_D - params.MIN_D + 1);
+	std::vector<Best> best(groups);
+
+	pool.parallelFor(0, groups, [&] (size_t group) {
+		Best& b = best[group];
+		b.costs.assign(n, std::numeric_limits<float>::infinity());
+		b.disparities.assign(n, params.MIN_D);
+
+		std::vector<float> cost(n), product(n), meanP, meanIP;
+		std::vector<float> coeffA(n), coeffB(n), meanA, meanB;
+		for (int d = params.MIN_D + group; d <= params.MAX_D; d += groups) {
+
+			// The slice of the cost volume
+			for (size_t h = 0; h < height; ++h) {
+				for (size_t w = 0; w < width; ++w) {
+					size_t i = h * width + w;
+					long qW = long(w) + sign * d;
+					if (qW < 0 || qW >= long(other->width)) {
+						cost[i] = maxCost;
+					} else {
+						const float* p = pixelAt(w, h);
+						const float* q = other->pixelAt(qW, h);
+						double gradientDist = std::abs(p[GRAD_X] - q[GRAD_X]) +
+								std::abs(p[GRAD_Y] - q[GRAD_Y]);
+						double colourDist = std::abs(p[RED] - q[RED]) +
+								std::abs(p[GREEN] - q[GREEN]) +
+								std::abs(p[BLUE] - q[BLUE]);
+						cost[i] = (1 - params.ALFA) *
+								std::min(colourDist, params.TAU_COL) +
+								params.ALFA * std::min(gradientDist, params.TAU_GRAD);
+					}
+					product[i] = guide[i] * cost[i];
+				}
+			}
 
-	// Horizontal
-	if (hasHorizontalPixel) {
-		auto&& horzPlane = disparityPlanes.get(horzW, h);
-		double horzCost = pixelWindowCost(w, h, horzPlane);
-		if (horzCost < thisCost) {
-			disparityPlanes(w, h) = horzPlane;
-			modified = true;
+			// Guided filter: cost ~ a * guide + b, in each window
+			boxFilter(cost, width, height, radius, meanP);
+			boxFilter(product, width, height, radius, meanIP);
+			for (size_t i = 0; i < n; ++i) {
+				coeffA[i] = (meanIP[i] - meanI[i] * meanP[i]) /
+						(varI[i] + params.GUIDED_EPS);
+				coeffB[i] = meanP[i] - coeffA[i] * meanI[i];
+			}
+			boxFilter(coeffA, width, height, radius, meanA);
+			boxFilter(coeffB, width, height, radius, meanB);
+
+			for (size_t i = 0; i < n; ++i) {
+				float filtered = meanA[i] * guide[i] + meanB[i];
+				if (filtered < b.costs[i]) {
+					b.costs[i] = filtered;
+					b.disparities[i] = d;
+				}
+			}
 		}
-	}
-
-	// Vertical
-	if (hasVerticalPixel) {
-		auto&& vertPlane = disparityPlanes.get(w, vertH);
-		double vertCost = pixelWindowCost(w, h, vertPlane);
-		if (vertCost < thisCost) {
-			disparityPlanes(w, h) = vertPlane;
-			modified = true;
+	});
+
+	// Merge the groups. Ties go to the lower disparity
+	for (size_t i = 0; i < n; ++i) {
+		size_t g = 0;
+		for (size_t k = 1; k < groups; ++k) {
+			if (best[k].costs[i] < best[g].costs[i] ||
+					(best[k].costs[i] == best[g].costs[i] &&
+					best[k].disparities[i] < best[g].disparities[i])) {
+				g = k;
+			}
 		}
+		planeCosts(i % width, i / width) = std::numeric_limits<float>::quiet_NaN();
+		disparityPlanes(i % width, i / width) =
+				CompactPlane(0, 0, best[g].disparities[i]);
 	}
+}
 
-	return modified;
+
+/**********************************************************************
+* > randomPlane()                                                     *
+* A random plane for pixel (w,h): see setRandomDisparities().         *
+*                                                                     *
+* Args:                                                               *
+*   w (size_t), h (size_t): the pixel                                 *
+*                                                                     *
+* Returns:                                                            *
+*   (CompactPlane): the plane                                         *
+**********************************************************************/
+CompactPlane StereoImage::randomPlane(size_t w, size_t h) const {
+
+	PlaneFunction plane;
+	plane.setRandomFunction(w, h,
+			params.MIN_D, params.MAX_D, 0, params.MAX_SLOPE);
+
+	// Force planar windows if requested
+	if (params.CONST_DISPARITIES) {
+		plane.setPlane({0,0,-1}, plane(w, h));
+	}
+	return CompactPlane(plane);
 }
 
 
-/*****************************************************************************
-* > pixelViewPropagation                                                     *
-* View propagation step for a single pixel. It checks whether some pixels in *
-* the other view have the current pixel p as a matching point. If any of     *
-* those pixels' planes have lower cost with p, that plane is assigned to p.  *
-* NOTE: the cost is proportional to the image width                          *
-* NOTE: the plane of the other view is not transformed into this view        *
-* NOTE: bounds for (w,h) are not checked                                     *
-*                                                                            *
-* Args:                                                                      *
-*   w (size_t), h (size_t): coordinates of the pixel to check                *
-*                                                                            *
-* Returns:                                                                   *
-*   (bool): true if the plane of (w,h) has been modified                     *
-*****************************************************************************/
-bool StereoImage::pixelViewPropagation(size_t w, size_t h) {
+/**************************************************************************
+* > loadFrame()                                                           *
+* Replaces the image with the next frame of a video, keeping all the      *
+* buffers: image, pixels and weights cache. The planes are not changed:   *
+* they are the initial planes of the new frame. Their costs, and          *
+* the cached weights, become unknown.                                     *
+* NOTE: the new frame must have the same size. If not, this throws an     *
+*   invalid_argument and the instance is no more usable.                  *
+*                                                                         *
+* Args:                                                                   *
+*   imgPath (string): the path of the new frame                           *
+**************************************************************************/
+void StereoImage::loadFrame(const string& imgPath) {
 
-	// check
-	if (other == nullptr) {
-		throw std::logic_error("pixelViewPropagation(). Instance not bound");
+	image.load(imgPath);
+	if (image.size(0) != width || image.size(1) != height) {
+		throw std::invalid_argument("loadFrame(). The frame " + imgPath +
+				" has a different size");
 	}
 
-	bool modified = false;
+	frameChanged();
+}
 
-	// Scan the horizontal (epipolar) line
-	for (size_t oW = 0; oW < width; ++oW) {
 
-		// Other plane disparity
-		auto&& otherPlane = other->disparityPlanes.get(oW, h);
-		int oDisparity = std::lround(otherPlane(oW, h));
-		
-		if (params.PLANES_SATURATION) { // Plane saturation on/off
-			if (oDisparity > params.MAX_D) oDisparity = params.MAX_D;
-			if (oDisparity < params.MIN_D) oDisparity = params.MIN_D;
-		}
-
-		// Find a plane that matches the current pixel
-		int sign = (other->side == Side::LEFT) ? -1 : +1;
-		size_t oDispW = oW + sign * oDisparity;
-		if (oDispW == w) {
-
-			// Test plane
-			double otherCost = pixelWindowCost(w, h, otherPlane);
-			double thisCost = pixelWindowCost(w, h, disparityPlanes.get(w, h));
-			if (otherCost < thisCost) {
-				disparityPlanes(w, h) = otherPlane;
-				modified = true;
-			}
-		}
+/**********************************************************************
+* > loadFrame()                                                       *
+* As loadFrame(imgPath), with the frame in memory (copied).           *
+*                                                                     *
+* Args:                                                               *
+*   frame (ImageBuffer): the new frame                                *
+**********************************************************************/
+void StereoImage::loadFrame(const ImageBuffer& frame) {
+
+	if (frame.width != width || frame.height != height) {
+		throw std::invalid_argument("loadFrame(). The frame has size " +
+				to_string(frame.width) + "x" + to_string(frame.height) +
+				", not " + to_string(width) + "x" + to_string(height));
 	}
 
-	return modified;
+	image.load(frame);
+	frameChanged();
 }
 
 
-/******************************************************************************
+/********************************************************************
+* > frameChanged()                                                  *
+* Updates everything derived from the image after loadFrame(): the  *
+* gradients and the pixels are computed again; the plane costs, the *
+* cached weights and costs, and the view candidates become unknown. *
+********************************************************************/
+void StereoImage::frameChanged(void) {
+
+	packPixels();
+	++frame;
+
+	for (size_t i = 0; i < planeCosts.size(); ++i) {
+		planeCosts(i) = std::numeric_limits<float>::quiet_NaN();
+	}
+	if (weightsCache) {
+		weightsCache->clear();
+	}
+	if (costTable) {
+		costTable->clear();
+	}
+	clearViewCandidates();
+}
+
+
+/***********************************************************************
+* > mixRandomPlanes()                                                  *
+* Replaces each plane with a random one (as in setRandomDisparities()) *
+* with probability 'fraction'. Used to add new candidates to planes    *
+* coming from a previous frame. Each pixel draws from its own stream   *
+* (see seekRandom()), with a new key for each frame.                   *
+*                                                                      *
+* Args:                                                                *
+*   fraction (double): probability of each replacement, in [0, 1]      *
+***********************************************************************/
+void StereoImage::mixRandomPlanes(double fraction) {
+
+	if (fraction <= 0) { return; }
+
+	auto& engine = RandomDevice::getGenerator().engine;
+	std::bernoulli_distribution replace(std::min(fraction, 1.0));
+
+	for (size_t w = 0; w < width; ++w) {
+		for (size_t h = 0; h < height; ++h) {
+			seekRandom(w, h, MIX_STREAM, 0);
+			if (replace(engine)) {
+				disparityPlanes(w, h) = randomPlane(w, h);
+				planeCosts(w, h) = std::numeric_limits<float>::quiet_NaN();
+			}
+		}
+	}
+}
+
+
+/****************************************************************************
+* > downscaled()                                                            *
+* Returns a new StereoImage of the same side, from this image at half the   *
+* resolution (rounded up). Planes are not copied. See upsamplePlanes().     *
+*                                                                           *
+* Returns:                                                                  *
+*   (StereoImage): the image at the coarser level of the pyramid            *
+****************************************************************************/
+StereoImage StereoImage::downscaled(void) const {
+	return StereoImage(image.resized((width + 1) / 2, (height + 1) / 2), side);
+}
+
+
+/******************************************************************************
+* > upsamplePlanes()                                                          *
+* Initializes the planes from those of 'coarse', the same view at a lower     *
+* resolution: each pixel takes the plane of the coarse pixel that contains    *
+* its centre. Disparities scale with the resolution, so the plane is          *
+* rewritten in the coordinates of this image, and scaled as the width.        *
+* Costs are unknown.                                                          *
+*                                                                             *
+* Args:                                                                       *
+*   coarse (StereoImage): the same view, at a lower resolution                *
+******************************************************************************/
+void StereoImage::upsamplePlanes(const StereoImage& coarse) {
+
+	// checks
+	if (coarse.side != side) {
+		throw std::invalid_argument("upsamplePlanes(). Different views");
+	}
+	if (coarse.width > width || coarse.height > height) {
+		throw std::invalid_argument("upsamplePlanes(). Not a coarser image");
+	}
+
+	// Coordinates of the centres: x' = (x + 0.5) * sx - 0.5
+	double sx = double(coarse.width) / width;
+	double sy = double(coarse.height) / height;
+
+	for (size_t w = 0; w < width; ++w) {
+		for (size_t h = 0; h < height; ++h) {
+			size_t cW = std::min(size_t((w + 0.5) * sx), coarse.width - 1);
+			size_t cH = std::min(size_t((h + 0.5) * sy), coarse.height - 1);
+			const CompactPlane& p = coarse.disparityPlanes.get(cW, cH);
+
+			// d(x,y) = (a * x' + b * y' + c) / sx
+			double a = p.a;
+			double b = p.b * sy / sx;
+			double c = (p.a * (0.5 * sx - 0.5) + p.b * (0.5 * sy - 0.5) + p.c) / sx;
+
+			disparityPlanes(w, h) = CompactPlane(a, b, c);
+			planeCosts(w, h) = std::numeric_limits<float>::quiet_NaN();
+		}
+	}
+}
+
+
+/****************************************************************************
+* > pixelSpatialPropagation()                                               *
+* Spatial propagation step for a single pixel. If the plane of a spatial    *
+* neighbor of p = (w,h) has a lower cost than the current plane of p, that  *
+* plane is assigned to p. If iteration is an even number, the neighbors are *
+* the left and upper pixels.                                                *
+* NOTE: bounds are not checked                                              *
+*                                                                           *
+* Args:                                                                     *
+*   w (size_t), h (size_t): coordinates of the pixel to check               *
+*   iteration (unsigned): the iteration number                              *
+*                                                                           *
+* Returns:                                                                  *
+*   (bool): true if the plane of p has been modified                        *
+****************************************************************************/
+bool StereoImage::pixelSpatialPropagation(size_t w, size_t h,
+		unsigned iteration) {
+
+	// Direction
+	int direction = (iteration % 2 == 0) ? -1 : 1;
+
+	// Do the neighbors exist?
+	bool hasHorizontalPixel = (direction == -1) ? (w > 0) : (w < width-1);
+	bool hasVerticalPixel = (direction == -1) ? (h > 0) : (h < height-1);
+
+	// Neighbors
+	size_t horzW = w + direction;  // modular arithmetic
+	size_t vertH = h + direction;
+
+	// 
+	bool modified = false;
+	double thisCost = planeCost(w, h);
+
+	// Horizontal
+	if (hasHorizontalPixel) {
+		auto&& horzPlane = disparityPlanes.get(horzW, h);
+		double horzCost = pixelWindowCost(w, h, horzPlane, thisCost);
+		if (float(horzCost) < thisCost) {
+			disparityPlanes(w, h) = horzPlane;
+			modified = true;
+			thisCost = planeCosts(w, h) = horzCost;
+		}
+	}
+
+	// Vertical
+	if (hasVerticalPixel) {
+		auto&& vertPlane = disparityPlanes.get(w, vertH);
+		double vertCost = pixelWindowCost(w, h, vertPlane, thisCost);
+		if (float(vertCost) < thisCost) {
+			disparityPlanes(w, h) = vertPlane;
+			modified = true;
+			thisCost = planeCosts(w, h) = vertCost;
+		}
+	}
+
+	return modified;
+}
+
+
+/*************************************************************************
+* > viewTarget()                                                         *
+* Returns the column of this view where the plane of pixel (oW,h) of the *
+* other view is matched, that is: oW +- the rounded disparity at (oW,h). *
+* NOTE: requires a bound instance. Bounds are not checked.               *
+*                                                                        *
+* Args:                                                                  *
+*   oW (size_t), h (size_t): coordinates of the pixel in the other view  *
+*                                                                        *
+* Returns:                                                               *
+*   (long): the matching column. It may fall outside this image.         *
+*************************************************************************/
+long StereoImage::viewTarget(size_t oW, size_t h) const {
+
+	// Other plane disparity
+	auto&& otherPlane = other->disparityPlanes.get(oW, h);
+	long oDisparity = std::lround(otherPlane(oW, h));
+	
+	if (params.PLANES_SATURATION) { // Plane saturation on/off
+		if (oDisparity > params.MAX_D) oDisparity = params.MAX_D;
+		if (oDisparity < params.MIN_D) oDisparity = params.MIN_D;
+	}
+
+	int sign = (other->side == Side::LEFT) ? -1 : +1;
+	return (long)oW + sign * oDisparity;
+}
+
+
+/****************************************************************************
+* > indexViewCandidates()                                                   *
+* Builds the index of row h for the view propagation: for each column w     *
+* of this view, the list of columns of the other view whose planes match    *
+* w (see viewTarget()). Lists are in increasing order. pixelViewPropagation *
+* then reads the list instead of scanning the whole row.                    *
+* NOTE: the index must be rebuilt if the row h of the other view changes.   *
+*   See clearViewCandidates().                                              *
+*                                                                           *
+* Args:                                                                     *
+*   h (size_t): the row to index                                            *
+****************************************************************************/
+void StereoImage::indexViewCandidates(size_t h) {
+
+	// check
+	if (other == nullptr) {
+		throw std::logic_error("indexViewCandidates(). Instance not bound");
+	}
+
+	unsigned* start = &candidatesStart[h * (width + 1)];
+	unsigned* columns = &candidates[h * width];
+
+	// Count the planes that land on each column. start[w+1] counts for w
+	std::fill(start, start + width + 1, 0);
+	for (size_t oW = 0; oW < width; ++oW) {
+		long target = viewTarget(oW, h);
+		if (target >= 0 && target < (long)width) {
+			++start[target + 1];
+		}
+	}
+
+	// Offsets of each list
+	for (size_t w = 0; w < width; ++w) {
+		start[w + 1] += start[w];
+	}
+
+	// Fill the lists in order. start[w] is moved to the end of the list of
+	// w; then it is restored to the beginning
+	for (size_t oW = 0; oW < width; ++oW) {
+		long target = viewTarget(oW, h);
+		if (target >= 0 && target < (long)width) {
+			columns[start[target]++] = oW;
+		}
+	}
+	for (size_t w = width; w > 0; --w) {
+		start[w] = start[w - 1];
+	}
+	start[0] = 0;
+
+	indexedRows[h] = true;
+}
+
+
+/*************************************************************
+* > clearViewCandidates()                                    *
+* Invalidates the index of all rows. pixelViewPropagation()  *
+* falls back to scanning the rows.                           *
+*************************************************************/
+void StereoImage::clearViewCandidates(void) {
+	std::fill(indexedRows.begin(), indexedRows.end(), false);
+}
+
+
+/*****************************************************************************
+* > pixelViewPropagation                                                     *
+* View propagation step for a single pixel. It checks whether some pixels in *
+* the other view have the current pixel p as a matching point. If any of     *
+* those pixels' planes have lower cost with p, that plane is assigned to p.  *
+* NOTE: if row h has been indexed (see indexViewCandidates()), only the      *
+*   matching pixels are read. Otherwise, the cost is proportional to the     *
+*   image width                                                              *
+* NOTE: the plane of the other view is not transformed into this view        *
+* NOTE: bounds for (w,h) are not checked                                     *
+*                                                                            *
+* Args:                                                                      *
+*   w (size_t), h (size_t): coordinates of the pixel to check                *
+*                                                                            *
+* Returns:                                                                   *
+*   (bool): true if the plane of (w,h) has been modified                     *
+*****************************************************************************/
+bool StereoImage::pixelViewPropagation(size_t w, size_t h) {
+
+	// check
+	if (other == nullptr) {
+		throw std::logic_error("pixelViewPropagation(). Instance not bound");
+	}
+
+	bool modified = false;
+	double thisCost = planeCost(w, h);
+
+	// Test the plane of (oW, h)
+	auto testPlane = [&] (size_t oW) {
+		auto&& otherPlane = other->disparityPlanes.get(oW, h);
+		double otherCost = pixelWindowCost(w, h, otherPlane, thisCost);
+		if (float(otherCost) < thisCost) {
+			disparityPlanes(w, h) = otherPlane;
+			modified = true;
+			thisCost = planeCosts(w, h) = otherCost;
+		}
+	};
+
+	// Matching planes from the index
+	if (indexedRows[h]) {
+		const unsigned* start = &candidatesStart[h * (width + 1)];
+		const unsigned* columns = &candidates[h * width];
+		for (unsigned i = start[w]; i < start[w + 1]; ++i) {
+			testPlane(columns[i]);
+		}
+		return modified;
+	}
+
+	// Scan the horizontal (epipolar) line
+	for (size_t oW = 0; oW < width; ++oW) {
+		if (viewTarget(oW, h) == (long)w) {
+			testPlane(oW);
+		}
+	}
+
+	return modified;
+}
+
+
+/******************************************************************************
 * > planeRefinement()                                                         *
 * This method tries new random planes for pixel (w,h). Initially the plane    *
 * may be far from the original one, but in the next iterations the            *
 * modifications become smaller and smaller. At each step, a plane is accepted *
 * only if the new one has a lower cost than the previous one.                 *
 * NOTE: bounds for (w,h) are not checked.                                     *
-* Important NOTE: the cost of this operation is variable.                     *
-* The number of planes tested follows a geometric distribution                *
-* with probability ~ 0.45 in the worst case.                                  *
+* Planes are drawn by a PlaneSampler, directly within the slope limit: the    *
+* cost of this operation is fixed.                                            *
+* Each step tries REFINE_CANDIDATES planes, scored in one pass on the window, *
+* and keeps the best one (at most MAX_WINDOW_PLANES: otherwise this throws an *
+* invalid_argument). The samples come from the stream of this pixel and       *
+* iteration: see seekRandom().                                                *
 *                                                                             *
 * Args:                                                                       *
 *   w (size_t), h (size_t): coordinates of the plane to refine                *
+*   iteration (unsigned): the iteration number                                *
 *                                                                             *
 * Returns:                                                                    *
 *   (bool): true if the plane has changed                                     *
 ******************************************************************************/
-bool StereoImage::planeRefinement(size_t w, size_t h) {
+bool StereoImage::planeRefinement(size_t w, size_t h, unsigned iteration) {
 	
 	bool modified = false;
 	
 	// Set the initial ranges. Initally, the maximum variation.
-	PlaneFunction& plane = disparityPlanes(w, h);
+	CompactPlane& plane = disparityPlanes(w, h);
 	double deltaZ = (params.MAX_D - params.MIN_D) / 2;
 	double deltaAng = 89;		// < 90° in any direction
 	
-	double thisCost = pixelWindowCost(w, h, disparityPlanes.get(w, h));
+	double thisCost = planeCost(w, h);
+
+	PlaneSampler sampler(plane, std::cos(params.MAX_SLOPE));
+	seekRandom(w, h, REFINE_STREAM, iteration);
+	auto& engine = RandomDevice::getGenerator().engine;
+	size_t nCandidates = params.REFINE_CANDIDATES;
+	if (nCandidates == 0 || nCandidates > MAX_WINDOW_PLANES) {
+		throw std::invalid_argument("planeRefinement(). " +
+				to_string(nCandidates) + " candidates, at most " +
+				to_string(MAX_WINDOW_PLANES) + " allowed");
+	}
 
 	// Try different planes. Stop with a threshold
 	while (deltaZ > 0.1) {
@@ -544,18 +1507,22 @@ bool StereoImage::planeRefinement(size_t w, size_t h) {
 		if (maxZ > params.MAX_D) { maxZ = params.MAX_D; }
 		if (minZ < params.MIN_D) { minZ = params.MIN_D; }
 
-		// Sample a new plane until we get a slope in the desired range
-		PlaneFunction sampledPlane;
-		do {
-			sampledPlane = plane.getNeighbourFunction(w, h, minZ, maxZ, deltaAng);
-		} while (std::abs(sampledPlane.getParams().first(2)) <
-				std::cos(params.MAX_SLOPE));
-
-		double sampledCost = pixelWindowCost(w, h, sampledPlane);
-		if (sampledCost < thisCost) {
-			plane = sampledPlane;  // this is a ref: modifies disparityPlanes
+		// Sample the candidates and score them together
+		CompactPlane sampled[MAX_WINDOW_PLANES];
+		double sampledCosts[MAX_WINDOW_PLANES];
+		for (size_t k = 0; k < nCandidates; ++k) {
+			sampled[k] = sampler.sample(engine, w, h, minZ, maxZ, deltaAng);
+		}
+		pixelWindowCosts(w, h, sampled, nCandidates, thisCost, sampledCosts);
+		SPMATCH_COUNT(side, Stats::REFINEMENT_SAMPLES, nCandidates);
+
+		size_t best = std::min_element(sampledCosts,
+				sampledCosts + nCandidates) - sampledCosts;
+		if (float(sampledCosts[best]) < thisCost) {
+			plane = sampled[best];
+			sampler.setPlane(sampled[best]);
 			modified = true;
-			thisCost = sampledCost;
+			thisCost = planeCosts(w, h) = sampledCosts[best];
 		}
 
 		// Half range
@@ -567,12 +1534,193 @@ bool StereoImage::planeRefinement(size_t w, size_t h) {
 }
 
 
+/**************************************************************************
+* > processPixel()                                                        *
+* The three steps of an iteration for pixel (w,h): spatial propagation,   *
+* view propagation and plane refinement. With SPMATCH_STATS, each step is *
+* timed, and counted if it changes the plane. See Stats.                  *
+* With the active pixels (see resetActivePixels()), an inactive pixel is  *
+* skipped, and a changed one is marked in changedPixels.                  *
+* NOTE: bounds for (w,h) are not checked.                                 *
+*                                                                         *
+* Args:                                                                   *
+*   w (size_t), h (size_t): coordinates of the pixel                      *
+*   iteration (unsigned): the iteration number                            *
+**************************************************************************/
+void StereoImage::processPixel(size_t w, size_t h, unsigned iteration) {
+
+	bool tracking = !activePixels.empty();
+	if (tracking && !isActive(w, h, iteration)) { return; }
+
+#ifdef SPMATCH_STATS
+	typedef std::chrono::steady_clock Clock;
+	auto nanos = [] (Clock::time_point from, Clock::time_point to) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				to - from).count();
+	};
+
+	auto t0 = Clock::now();
+	bool spatial = pixelSpatialPropagation(w, h, iteration);
+	auto t1 = Clock::now();
+	bool view = pixelViewPropagation(w, h);
+	auto t2 = Clock::now();
+	bool refined = planeRefinement(w, h, iteration);
+	auto t3 = Clock::now();
+
+	Stats::add(side, Stats::PIXELS, 1);
+	Stats::add(side, Stats::SPATIAL_ACCEPTED, spatial);
+	Stats::add(side, Stats::VIEW_ACCEPTED, view);
+	Stats::add(side, Stats::REFINEMENT_ACCEPTED, refined);
+	Stats::add(side, Stats::SPATIAL_NS, nanos(t0, t1));
+	Stats::add(side, Stats::VIEW_NS, nanos(t1, t2));
+	Stats::add(side, Stats::REFINEMENT_NS, nanos(t2, t3));
+#else
+	bool spatial = pixelSpatialPropagation(w, h, iteration);
+	bool view = pixelViewPropagation(w, h);
+	bool refined = planeRefinement(w, h, iteration);
+#endif
+
+	if (tracking && (spatial || view || refined)) {
+		changedPixels[h * width + w] = true;
+	}
+}
+
+
+/*************************************************************************
+* > isActive()                                                           *
+* Whether pixel (w,h) should be processed in this iteration: if it was   *
+* activated by updateActivePixels(), or if one of the neighbors read by  *
+* its spatial propagation has changed earlier in this sweep.             *
+* NOTE: bounds for (w,h) are not checked.                                *
+*                                                                        *
+* Args:                                                                  *
+*   w (size_t), h (size_t): coordinates of the pixel                     *
+*   iteration (unsigned): the iteration number                           *
+*                                                                        *
+* Returns:                                                               *
+*   (bool): true if the pixel is active                                  *
+*************************************************************************/
+bool StereoImage::isActive(size_t w, size_t h, unsigned iteration) const {
+
+	size_t i = h * width + w;
+	if (activePixels[i]) { return true; }
+
+	// The neighbors of pixelSpatialPropagation()
+	if (iteration % 2 == 0) {
+		return (w > 0 && changedPixels[i - 1]) ||
+				(h > 0 && changedPixels[i - width]);
+	} else {
+		return (w < width - 1 && changedPixels[i + 1]) ||
+				(h < height - 1 && changedPixels[i + width]);
+	}
+}
+
+
+/*********************************************************************
+* > resetActivePixels()                                              *
+* Starts tracking the changed pixels (params.CONVERGENCE and         *
+* params.ACTIVE_PIXELS): all pixels are active, none has changed.    *
+*********************************************************************/
+void StereoImage::resetActivePixels(void) {
+
+	activePixels.assign(width * height, true);
+	changedPixels.assign(width * height, false);
+}
+
+
+/************************************************************************
+* > updateActivePixels()                                                *
+* Selects the pixels of the next iteration, from the changes of the     *
+* last one: a pixel is active if its plane or the plane of one of its 4 *
+* neighbors has changed, or if a changed plane of the other view now    *
+* lands on it (a new candidate of its view propagation).                *
+* NOTE: call this for both views before clearChangedPixels().           *
+************************************************************************/
+void StereoImage::updateActivePixels(void) {
+
+	// check
+	if (other == nullptr || other->changedPixels.empty()) {
+		throw std::logic_error("updateActivePixels(). No changes tracked in the "
+				"other view");
+	}
+
+	std::fill(activePixels.begin(), activePixels.end(), false);
+	for (size_t h = 0; h < height; ++h) {
+		for (size_t w = 0; w < width; ++w) {
+			size_t i = h * width + w;
+
+			// This view
+			if (changedPixels[i]) {
+				activePixels[i] = true;
+				if (w > 0) { activePixels[i - 1] = true; }
+				if (w < width - 1) { activePixels[i + 1] = true; }
+				if (h > 0) { activePixels[i - width] = true; }
+				if (h < height - 1) { activePixels[i + width] = true; }
+			}
+
+			// The other view, at column w
+			if (other->changedPixels[i]) {
+				long target = viewTarget(w, h);
+				if (target >= 0 && target < (long)width) {
+					activePixels[h * width + target] = true;
+				}
+			}
+		}
+	}
+}
+
+
+/*****************************************************
+* > clearChangedPixels()                             *
+* Forgets the changes: used after each iteration.    *
+*****************************************************/
+void StereoImage::clearChangedPixels(void) {
+	std::fill(changedPixels.begin(), changedPixels.end(), false);
+}
+
+
+/****************************************************************
+* > changedFraction()                                           *
+* Returns:                                                      *
+*   (double): the fraction of pixels changed since the last     *
+*       clearChangedPixels(). 1 if the changes are not tracked  *
+****************************************************************/
+double StereoImage::changedFraction(void) const {
+
+	if (changedPixels.empty()) { return 1; }
+
+	size_t changed = std::count(changedPixels.begin(), changedPixels.end(),
+			true);
+	return double(changed) / changedPixels.size();
+}
+
+
+/****************************************************************
+* > toGpuView()                                                 *
+* Returns:                                                      *
+*   (GpuView): the input of the GPU backend: the pixels. See    *
+*       gpuMatch()                                              *
+****************************************************************/
+GpuView StereoImage::toGpuView(void) const {
+
+	static_assert(int(GpuView::RED) == RED && int(GpuView::GREEN) == GREEN &&
+			int(GpuView::BLUE) == BLUE && int(GpuView::GRAD_X) == GRAD_X &&
+			int(GpuView::GRAD_Y) == GRAD_Y, "GpuView: different pixels layout");
+
+	GpuView view;
+	view.pixels = pixels.data();
+	view.pixelStride = PIXEL_STRIDE;
+	return view;
+}
+
+
 /*************************************************************************
 * > getInvalidPixelsMap()                                                *
 * Returns a black/white image: invalid pixels are marked as white; valid *
 * pixels have 0 value (black).                                           *
 * Invalidated pixels (planes) are the coordinates in which left/right    *
-* disparities do not match (they differ by > 1).                         *
+* disparities do not match (they differ by > 1). The disparities are     *
+* read from the planes: no disparity map is allocated.                   *
 *                                                                        *
 * Returns:                                                               *
 *   (Image): a map of the valid pixels for this image                    *
@@ -587,30 +1735,20 @@ Image StereoImage::getInvalidPixelsMap(void) const {
 	// Initialize the map with all valid pixels
 	Image invalidMap(width, height, 1, 0);
 
-	// Get the disparities
-	Image disparity = getDisparityMap();
-	Image oDisparity = other->getDisparityMap();
-
 	// Iterate on this image
 	for (size_t w = 0; w < width; ++w) {
 		for (size_t h = 0; h < height; ++h) {
 
 			// Coordinates of the matching pixel
-			int sign;
-			switch (side) {
-				case LEFT: sign = -1; break;
-				case RIGHT: sign = +1; break;
-			}
-			double d = disparity.get(w,h);
-			double oWD = w + sign * d;
-			if (oWD < 0 || oWD >= other->width) {  // If it is projected outside
+			double d = disparityAt(w, h);
+			long oW = matchingColumn(w, d);
+			if (oW < 0) {  // If it is projected outside
 				invalidMap(w,h) = 255;
 				continue;
 			}
-			size_t oW = std::lround(oWD);
 
 			// Compare the other pixel dispatity
-			double oD = oDisparity.get(oW,h);
+			double oD = other->disparityAt(oW, h);
 			if (std::abs(d - oD) > 1) {
 				invalidMap(w,h) = 255;
 			}
@@ -621,12 +1759,60 @@ Image StereoImage::getInvalidPixelsMap(void) const {
 }
 
 
+/****************************************************************************
+* > seekRandom()                                                            *
+* Selects the stream of RandomDevice for pixel (w,h): the key is the seed   *
+* of this instance, the counter is the pixel (in the frame: see             *
+* setFrameOrigin()), the round, the frame, the stream and the side. Each    *
+* pixel, iteration and use draws the same numbers on any thread: with a     *
+* given schedule, the results don't depend on the number of threads. The    *
+* schedules differ in the order of the updates, so in the results.          *
+*                                                                           *
+* Args:                                                                     *
+*   w (size_t), h (size_t): the pixel                                       *
+*   stream (RandomStream): the use of the numbers                           *
+*   round (unsigned): e.g. the iteration                                    *
+****************************************************************************/
+void StereoImage::seekRandom(size_t w, size_t h, RandomStream stream,
+		unsigned round) const {
+	RandomDevice::seek(randomSeed,
+			uint32_t((h + originH) * frameWidth + w + originW), round,
+			(uint32_t(frame) << 8) | (uint32_t(stream) << 1) | uint32_t(side));
+}
+
+
+/*************************************************************************
+* > matchingColumn()                                                     *
+* The pixel of the other view matched by disparity d at column w: w -+ d *
+* (left/right view), rounded. See getInvalidPixelsMap().                 *
+* NOTE: requires a bound instance.                                       *
+*                                                                        *
+* Args:                                                                  *
+*   w (size_t): a column of this view                                    *
+*   d (double): a disparity                                              *
+*                                                                        *
+* Returns:                                                               *
+*   (long): the column in the other view, or -1 if it falls outside      *
+*************************************************************************/
+long StereoImage::matchingColumn(size_t w, double d) const {
+
+	int sign = (side == LEFT) ? -1 : +1;
+	double oWD = w + sign * d;
+	long oW = std::lround(oWD);
+	if (oWD < 0 || oW >= (long)other->width) {
+		return -1;
+	}
+	return oW;
+}
+
+
 /*****************************************************************************
 * > fillInvalidPlanes()                                                      *
 * Computes the set of invalid planes through consistency checks on the       *
 * left/right pair. Then updates the plane of invalidated pixels. The chosen  *
 * plane is the one having lower disparity among the left/right valid pixels. *
 * (Background fill)                                                          *
+* The costs of the new planes become unknown.                                *
 *                                                                            *
 * Args:                                                                      *
 *   invalid (Image): map of valid and invalid pixels.                        *
@@ -652,6 +1838,7 @@ void StereoImage::fillInvalidPlanes(const Image& invalid) {
 
 			// Should I fill this?
 			if (invalid.get(w,h)) {
+				planeCosts(w, h) = std::numeric_limits<float>::quiet_NaN();
 
 				// Find the next valid, if necessary and if has one
 				if (((increment > 0) ? (w >= wValidN) : (w <= wValidN)) && hasNext) {
@@ -691,71 +1878,232 @@ void StereoImage::fillInvalidPlanes(const Image& invalid) {
 }
 
 
+// The colour levels of each channel, for Median::HISTOGRAM
+static const unsigned MEDIAN_COLOUR_LEVELS = 4;
+
+
 /**************************************************************************
 * > wMedianFilterAtDisparity()                                            *
 * Runs a weighted median filter on the pixels of 'disp', marked in 'map'. *
 * 'disp' is a grayscale image. Marked pixels are white                    *
 * (or non black, i.e. != 0) in 'map'. The filter uses the window          *
 * and weights given by params.WINDOW_SIZE and adaptiveWeight().           *
+* With params.MEDIAN == HISTOGRAM, the median is approximated with the    *
+* quantized disparities and colours: see histogramMedianRow().            *
+* Rows are filtered in parallel, if a pool is given.                      *
 *                                                                         *
 * Args:                                                                   *
 *   disp (Image): the disparity map of 'this' image                       *
 *   map (Image): the map of the pixels to process.                        *
+*   pool (ThreadPool*): the threads to use. nullptr: this thread only     *
 *                                                                         *
 * Returns:                                                                *
 *   (Image): the filtered disparity map                                   *
 **************************************************************************/
 Image StereoImage::wMedianFilterAtDisparity(const Image& disp,
-		const Image& map) const {
+		const Image& map, ThreadPool* pool) const {
 
-	// Definitions
 	Image out(width, height, 1);
-	std::vector<double> values;
-	std::vector<double> weights;
+	bool histogram = (params.MEDIAN == Params::Median::HISTOGRAM);
+
+	// Quantized disparities and colours, for the histograms. Reused by the
+	// next frames. NOTE: references, as the rows are filtered by other threads
+	static thread_local std::vector<unsigned short> binsBuffer;
+	static thread_local std::vector<unsigned char> coloursBuffer;
+	std::vector<unsigned short>& bins = binsBuffer;
+	std::vector<unsigned char>& colours = coloursBuffer;
+	if (histogram) {
+		if (params.MEDIAN_BINS == 0 || params.MEDIAN_BINS > 65536) {
+			throw std::invalid_argument("wMedianFilterAtDisparity(). " +
+					string("MEDIAN_BINS must be in [1, 65536]"));
+		}
+		double step = std::max(params.MAX_D - params.MIN_D, 1) /
+				double(params.MEDIAN_BINS);
+		bins.resize(width * height);
+		colours.resize(width * height);
+		for (size_t h = 0; h < height; ++h) {
+			for (size_t w = 0; w < width; ++w) {
+				double bin = std::floor((disp.get(w,h) - params.MIN_D) / step);
+				bins[h * width + w] = std::min<double>(std::max(bin, 0.0),
+						params.MEDIAN_BINS - 1);
+
+				const float* p = pixelAt(w, h);
+				unsigned colour = 0;
+				for (size_t c: { RED, GREEN, BLUE }) {
+					unsigned level = std::max(p[c], 0.0f) * MEDIAN_COLOUR_LEVELS / 256;
+					colour = colour * MEDIAN_COLOUR_LEVELS +
+							std::min(level, MEDIAN_COLOUR_LEVELS - 1);
+				}
+				colours[h * width + w] = colour;
+			}
+		}
+	}
 
-	// Scan the whole image
-	for (size_t w = 0; w < width; ++w) {
+	// Filter each row
+	auto filterRow = [&] (size_t h) {
+		if (histogram) {
+			histogramMedianRow(disp, map, h, bins, colours, out);
+		} else {
+			wMedianFilterRow(disp, map, h, out);
+		}
+	};
+	if (pool) {
+		pool->parallelFor(0, height, filterRow);
+	} else {
 		for (size_t h = 0; h < height; ++h) {
+			filterRow(h);
+		}
+	}
+
+	return out;
+}
+
+
+/**************************************************************************
+* > wMedianFilterRow()                                                    *
+* The exact filter of wMedianFilterAtDisparity(), on row h: the weights   *
+* of the whole window are sorted for each marked pixel.                   *
+*                                                                         *
+* Args:                                                                   *
+*   disp (Image), map (Image): as in wMedianFilterAtDisparity()           *
+*   h (size_t): the row to filter                                         *
+*   out (Image): the filtered disparity map. Only row h is written        *
+**************************************************************************/
+void StereoImage::wMedianFilterRow(const Image& disp, const Image& map,
+		size_t h, Image& out) const {
+
+	// Definitions. Reused by the next rows of this thread
+	static thread_local std::vector<double> values;
+	static thread_local std::vector<double> weights;
+
+	// Scan the whole row
+	for (size_t w = 0; w < width; ++w) {
 
-			// If this pixel should be filtered
-			if (map.get(w,h)) {
-
-				// Selecting a squared window around (w,h). See pixelWindowCost()
-				unsigned halfSideW = params.WINDOW_SIZE / 2;
-				unsigned halfSideH = params.WINDOW_SIZE / 2;
-				size_t minW = (w > halfSideW) ? (w - halfSideW) : 0;
-				size_t maxW = (w + halfSideW >= width) ? (width - 1) : (w + halfSideW);
-				size_t minH = (h > halfSideH) ? (h - halfSideH) : 0;
-				size_t maxH = (h + halfSideH >= height) ? (height - 1) : (h + halfSideH);
-					// NOTE: not using a resized window for simplicity
-				
-				// Accumulate the pixels values within the window
-				weights.clear();
-				values.clear();
+		// If this pixel should be filtered
+		if (map.get(w,h)) {
+
+			// Selecting a squared window around (w,h). See pixelWindowCost()
+			unsigned halfSideW = params.WINDOW_SIZE / 2;
+			unsigned halfSideH = params.WINDOW_SIZE / 2;
+			size_t minW = (w > halfSideW) ? (w - halfSideW) : 0;
+			size_t maxW = (w + halfSideW >= width) ? (width - 1) : (w + halfSideW);
+			size_t minH = (h > halfSideH) ? (h - halfSideH) : 0;
+			size_t maxH = (h + halfSideH >= height) ? (height - 1) : (h + halfSideH);
+				// NOTE: not using a resized window for simplicity
+			
+			// Accumulate the pixels values within the window
+			weights.clear();
+			values.clear();
+			if (weightsCache) {
+				auto slot = weightsCache->get(h * width + w);
+				if (slot.isNew()) { windowWeights(w, h, slot.data()); }
+				for (size_t iW = minW; iW <= maxW; ++iW) {
+					for (size_t iH = minH; iH <= maxH; ++iH) {
+						weights.push_back(slot.data()[(iH + halfSideH - h) *
+								params.WINDOW_SIZE + (iW + halfSideW - w)]);
+						values.push_back(disp.get(iW,iH));
+					}
+				}
+			} else {
 				for (size_t iW = minW; iW <= maxW; ++iW) {
 					for (size_t iH = minH; iH <= maxH; ++iH) {
 						weights.push_back(adaptiveWeight(w, h, iW, iH));
 						values.push_back(disp.get(iW,iH));
 					}
 				}
+			}
 
-				// Normalize the weights
-				double wSum = 0;
-				for (const double& w: weights) { wSum += w; }
-				for (double& w: weights) { w /= wSum; }
+			// Normalize the weights
+			double wSum = 0;
+			for (const double& w: weights) { wSum += w; }
+			for (double& w: weights) { w /= wSum; }
 
-				// Apply the filter
-				out(w,h) = weightedMedian(values, weights);
+			// Apply the filter
+			out(w,h) = weightedMedian(values, weights);
 
-			} else {
+		} else {
 
-				// Just copy
-				out(w,h) = disp.get(w,h);
-			}
+			// Just copy
+			out(w,h) = disp.get(w,h);
 		}
 	}
+}
 
-	return out;
+
+/****************************************************************************
+* > histogramMedianRow()                                                    *
+* The approximated filter of wMedianFilterAtDisparity(), on row h. The      *
+* window slides along the row in a JointHistogram, from a marked pixel to   *
+* the next one: so each pixel enters and leaves it once, and the median     *
+* costs the same for any window size. Disparities are quantized into        *
+* params.MEDIAN_BINS bins in [MIN_D, MAX_D], and the result is the centre   *
+* of a bin. The colours, into MEDIAN_COLOUR_LEVELS levels for each channel: *
+* each pixel weights as the mean colour of its bin, in the window.          *
+*                                                                           *
+* Args:                                                                     *
+*   disp (Image), map (Image): as in wMedianFilterAtDisparity()             *
+*   h (size_t): the row to filter                                           *
+*   bins (vector<unsigned short>): the disparity bin of each (w,h), by row  *
+*   colours (vector<unsigned char>): the colour bin of each (w,h), by row   *
+*   out (Image): the filtered disparity map. Only row h is written          *
+****************************************************************************/
+void StereoImage::histogramMedianRow(const Image& disp, const Image& map,
+		size_t h, const std::vector<unsigned short>& bins,
+		const std::vector<unsigned char>& colours, Image& out) const {
+
+	// Copy the unmarked pixels
+	bool marked = false;
+	for (size_t w = 0; w < width; ++w) {
+		out(w,h) = disp.get(w,h);
+		marked = marked || map.get(w,h);
+	}
+	if (!marked) { return; }
+
+	// The rows of the window. See wMedianFilterRow()
+	unsigned halfSide = params.WINDOW_SIZE / 2;
+	size_t minH = (h > halfSide) ? (h - halfSide) : 0;
+	size_t maxH = (h + halfSide >= height) ? (height - 1) : (h + halfSide);
+
+	const unsigned colourBins = MEDIAN_COLOUR_LEVELS * MEDIAN_COLOUR_LEVELS *
+			MEDIAN_COLOUR_LEVELS;
+	static thread_local JointHistogram histogram(colourBins, params.MEDIAN_BINS);
+	histogram.reset(colourBins, params.MEDIAN_BINS);
+	auto addColumn = [&] (size_t iW) {
+		for (size_t iH = minH; iH <= maxH; ++iH) {
+			size_t i = iH * width + iW;
+			histogram.add(colours[i], bins[i], pixelAt(iW, iH));
+		}
+	};
+	auto removeColumn = [&] (size_t iW) {
+		for (size_t iH = minH; iH <= maxH; ++iH) {
+			size_t i = iH * width + iW;
+			histogram.remove(colours[i], bins[i], pixelAt(iW, iH));
+		}
+	};
+
+	// Columns [first, last) are in the histogram
+	double step = std::max(params.MAX_D - params.MIN_D, 1) /
+			double(params.MEDIAN_BINS);
+	size_t first = 0, last = 0;
+	for (size_t w = 0; w < width; ++w) {
+		if (!map.get(w,h)) { continue; }
+
+		// Slide the window to w
+		size_t minW = (w > halfSide) ? (w - halfSide) : 0;
+		size_t maxW = (w + halfSide >= width) ? (width - 1) : (w + halfSide);
+		while (first < minW && first < last) {
+			removeColumn(first++);
+		}
+		if (first < minW) {
+			first = last = minW;
+		}
+		while (last <= maxW) {
+			addColumn(last++);
+		}
+
+		size_t bin = histogram.median(pixelAt(w, h), params.GAMMA);
+		out(w,h) = params.MIN_D + (bin + 0.5) * step;
+	}
 }
 
 
@@ -767,29 +2115,211 @@ Image StereoImage::wMedianFilterAtDisparity(const Image& disp,
 * calls fillInvalidPlanes(), then it calls wMedianFilterAtDisparity()  *
 * on those pixels.                                                     *
 *                                                                      *
+* Args:                                                                *
+*   pool (ThreadPool*): the threads of the filter. nullptr: this one   *
+*                                                                      *
 * Returns:                                                             *
 *   (Image): The disparity map                                         *
 ***********************************************************************/
-Image StereoImage::processFinalDisparityMap(void) {
+Image StereoImage::processFinalDisparityMap(ThreadPool* pool) {
 
 	// Find the invalid pixels
 	Image invalid = getInvalidPixelsMap();
 
+	return processFinalDisparityMap(invalid, pool);
+}
+
+
+/************************************************************************
+* > processFinalDisparityMap()                                          *
+* As processFinalDisparityMap(), with a given map of invalid pixels.    *
+* Only this view is modified and read, so the two views of a pair can   *
+* be processed at the same time, if both maps have been computed first. *
+*                                                                       *
+* Args:                                                                 *
+*   invalid (Image): map of valid and invalid pixels.                   *
+*                    (see getInvalidPixelsMap())                        *
+*   pool (ThreadPool*): the threads of the filter. nullptr: this one    *
+*                                                                       *
+* Returns:                                                              *
+*   (Image): The disparity map                                          *
+************************************************************************/
+Image StereoImage::processFinalDisparityMap(const Image& invalid,
+		ThreadPool* pool) {
+
 	// Fill them
 	fillInvalidPlanes(invalid);
 
 	// Weighted median filter on invalid pixels
-	Image disparity = wMedianFilterAtDisparity(getDisparityMap(), invalid);
+	for (size_t w = 0; w < width; ++w) {
+		for (size_t h = 0; h < height; ++h) {
+			disparityMap(w, h) = disparityAt(w, h);
+		}
+	}
+	return wMedianFilterAtDisparity(disparityMap, invalid, pool);
+}
+
+
+/*****************************************************************************
+* The fused post processing (see StereoImagePair::processViewsFused()) runs  *
+* on rows: the consistency check and the fill of row h only read row h of    *
+* the two views. For each row, mapDisparityRow() of both views, then         *
+* checkRow() of both, then fillRow() of both. So the rows can be processed   *
+* in any order, by bands on different threads; then the median filter, on    *
+* the filled maps: see filterFinalDisparityMap().                            *
+* The result is the same as processFinalDisparityMap() with the invalid      *
+* maps of both views computed first, as in processViewsInParallel(): but     *
+* the two disparity maps are computed once, and reused by both checks.       *
+*****************************************************************************/
+
+/**********************************************************
+* > mapDisparityRow()                                     *
+* Writes row h of disparityMap, from the current planes.  *
+*                                                         *
+* Args:                                                   *
+*   h (size_t): the row                                   *
+**********************************************************/
+void StereoImage::mapDisparityRow(size_t h) {
+
+	for (size_t w = 0; w < width; ++w) {
+		disparityMap(w, h) = disparityAt(w, h);
+	}
+}
+
+
+/***************************************************************************
+* > checkRow()                                                             *
+* Consistency check of row h, as getInvalidPixelsMap(), from the           *
+* disparityMap of both views: writes row h of invalidMap. Also of          *
+* confidenceMap: 1 - |d - d'|, where d' is the disparity of the other view *
+* at the sub-pixel match w -+ d, interpolated linearly between its two     *
+* neighbours. Clamped to [0, 1]; 0 for the invalid pixels.                 *
+* NOTE: row h of both maps must be mapped first. See mapDisparityRow()     *
+*                                                                          *
+* Args:                                                                    *
+*   h (size_t): the row                                                    *
+***************************************************************************/
+void StereoImage::checkRow(size_t h) {
+
+	// check
+	if (other == nullptr) {
+		throw std::logic_error("checkRow(). Instance not bound");
+	}
+
+	int sign = (side == LEFT) ? -1 : +1;
+	const Image& oDisparity = other->disparityMap;
+	for (size_t w = 0; w < width; ++w) {
+		double d = disparityMap.get(w, h);
+		long oW = matchingColumn(w, d);
+		bool invalid = (oW < 0 || std::abs(d - oDisparity.get(oW, h)) > 1);
+		invalidMap(w, h) = invalid ? 255 : 0;
+		if (invalid) {
+			confidenceMap(w, h) = 0;
+			continue;
+		}
+
+		// Sub-pixel match
+		double oWD = std::min(std::max(w + sign * d, 0.0), other->width - 1.0);
+		size_t oW0 = std::min(size_t(oWD), other->width - 2);
+		double t = oWD - oW0;
+		double oD = (other->width > 1) ? ((1 - t) * oDisparity.get(oW0, h) +
+				t * oDisparity.get(oW0 + 1, h)) : oDisparity.get(0, h);
+		confidenceMap(w, h) = std::max(0.0, 1 - std::abs(d - oD));
+	}
+}
+
+
+/****************************************************************************
+* > fillRow()                                                               *
+* Background fill of row h, as fillInvalidPlanes() with invalidMap. The     *
+* nearest valid pixels on both sides of each column are indexed first, in   *
+* two scans: then each invalid pixel is filled independently. The planes of *
+* the valid pixels don't change. Row h of disparityMap is mapped again.     *
+*                                                                           *
+* Args:                                                                     *
+*   h (size_t): the row                                                     *
+****************************************************************************/
+void StereoImage::fillRow(size_t h) {
+
+	// Nearest valid column before and after each w; -1 if none
+	static thread_local std::vector<long> nearest;
+	nearest.resize(2 * width);
+	long* before = &nearest[0];
+	long* after = &nearest[width];
+	long valid = -1;
+	for (size_t w = 0; w < width; ++w) {
+		before[w] = valid;
+		if (!invalidMap.get(w, h)) { valid = w; }
+	}
+	valid = -1;
+	for (size_t w = width; w-- > 0; ) {
+		after[w] = valid;
+		if (!invalidMap.get(w, h)) { valid = w; }
+	}
+
+	// LEFT view is filled right to left: the last valid pixel of the scan
+	// is after w, the next one before. The opposite for the RIGHT view
+	const long* last = (side == LEFT) ? after : before;
+	const long* next = (side == LEFT) ? before : after;
+	for (size_t w = 0; w < width; ++w) {
+		if (!invalidMap.get(w, h)) { continue; }
+		planeCosts(w, h) = std::numeric_limits<float>::quiet_NaN();
+
+		// The lower disparity of the two planes
+		if (last[w] >= 0) {
+			disparityPlanes(w, h) = disparityPlanes.get(last[w], h);
+		}
+		if (next[w] >= 0) {
+			const CompactPlane& nextPlane = disparityPlanes.get(next[w], h);
+			if (last[w] < 0 || disparityPlanes.get(w, h)(w, h) > nextPlane(w, h)) {
+				disparityPlanes(w, h) = nextPlane;
+			}
+		}
+	}
+
+	mapDisparityRow(h);
+}
+
 
-	return disparity;
+/**********************************************************************
+* > filterFinalDisparityMap()                                         *
+* The last step of the fused post processing: the weighted median of  *
+* disparityMap at the pixels of invalidMap, as in                     *
+* processFinalDisparityMap(). All the rows must be filled first. See  *
+* fillRow().                                                          *
+*                                                                     *
+* Args:                                                               *
+*   pool (ThreadPool*): the threads of the filter. nullptr: this one  *
+*                                                                     *
+* Returns:                                                            *
+*   (Image): The disparity map                                        *
+**********************************************************************/
+Image StereoImage::filterFinalDisparityMap(ThreadPool* pool) {
+	return wMedianFilterAtDisparity(disparityMap, invalidMap, pool);
 }
 
 
 // > class StereoImagePair
 
+/*******************************************************************
+* > poolSize()                                                     *
+* Returns:                                                         *
+*   (unsigned): the total number of threads, from params.THREADS   *
+*******************************************************************/
+static unsigned poolSize(void) {
+
+	if (params.THREADS > 0) {
+		return params.THREADS;
+	}
+	unsigned hardware = std::thread::hardware_concurrency();
+	return (hardware > 0) ? hardware : 1;
+}
+
+
 /******************************************************
 * > StereoImagePair()                                 *
-* Constructor.                                        *
+* Constructor. With params.PARALLEL_VIEWS, the        *
+* threads are split between the two views.            *
 *                                                     *
 * Args:                                               *
 *   leftImgPath (string): path of the left RGB view   *
@@ -797,10 +2327,24 @@ Image StereoImage::processFinalDisparityMap(void) {
 ******************************************************/
 StereoImagePair::StereoImagePair(const string& leftImgPath,
 		const string& rightImgPath):
-		leftImg(leftImgPath, StereoImage::LEFT),
-		rightImg(rightImgPath, StereoImage::RIGHT),
+		StereoImagePair(StereoImage(leftImgPath, StereoImage::LEFT),
+				StereoImage(rightImgPath, StereoImage::RIGHT)) {}
+
+
+/******************************************************
+* > StereoImagePair()                                 *
+* Constructor. As above, from two unbound views.      *
+*                                                     *
+* Args:                                               *
+*   left (StereoImage&&): the left view. Moved        *
+*   right (StereoImage&&): the right view. Moved      *
+******************************************************/
+StereoImagePair::StereoImagePair(StereoImage&& left, StereoImage&& right):
+		leftImg(std::move(left)),
+		rightImg(std::move(right)),
 		width(leftImg.size().first),
-		height(leftImg.size().second) {
+		height(leftImg.size().second),
+		pool(params.PARALLEL_VIEWS ? (poolSize() + 1) / 2 : poolSize()) {
 		
 	leftImg.bind(&rightImg);
 
@@ -809,45 +2353,504 @@ StereoImagePair::StereoImagePair(const string& leftImgPath,
 				"StereoImagePair(). " +
 				"Left and right images must have the same dimension.");
 	}
+
+	if (params.PARALLEL_VIEWS) {
+		rightPool.reset(new ThreadPool((poolSize() > 1) ? poolSize() / 2 : 1));
+	}
+}
+
+
+/********************************************************************
+* > RowSync::waitRow()                                              *
+* Waits until the other view has completed the r-th row of its      *
+* sweep (if 'other' is set). Rows are counted in the sweep order.   *
+*                                                                   *
+* Args:                                                             *
+*   r (size_t): the row of this sweep that is going to be processed *
+********************************************************************/
+void StereoImagePair::RowSync::waitRow(size_t r) const {
+	if (other != nullptr) {
+		other->waitFor(base + r + 1);
+	}
+}
+
+
+/**************************************************************************
+* > sweepView()                                                           *
+* Runs spatial propagation, view propagation and plane refinement on each *
+* pixel of 'image', for one iteration. With a single thread, the pixels   *
+* are processed in row major order. Otherwise, the order is given by      *
+* params.SCHEDULE: see sweepWavefront() and sweepRedBlack().              *
+* If 'sync' is given, each row of the sweep is processed after the same   *
+* row of the other view, and it is marked as done at the end.             *
+* With SPMATCH_STATS, the sweep is recorded. See Stats::endSweep().       *
+*                                                                         *
+* Args:                                                                   *
+*   image (StereoImage&): one of the two views                            *
+*   iteration (unsigned): the iteration number                            *
+*   pool (ThreadPool&): the threads to use                                *
+*   sync (RowSync*): optional synchronization with the other view         *
+**************************************************************************/
+void StereoImagePair::sweepView(StereoImage& image, unsigned iteration,
+		ThreadPool& pool, const RowSync* sync) {
+
+#ifdef SPMATCH_STATS
+	auto start = std::chrono::steady_clock::now();
+#endif
+
+	if (params.SCHEDULE == Params::Schedule::RED_BLACK) {
+		sweepRedBlack(image, iteration, pool, sync);
+	} else if (pool.size() > 1) {
+		sweepWavefront(image, iteration, pool, sync);
+	} else {
+		sweepSequential(image, iteration, sync);
+	}
+
+#ifdef SPMATCH_STATS
+	std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - start;
+	Stats::endSweep(image.getSide(), iteration, width, height, elapsed.count());
+#endif
 }
 
 
 /************************************************************************
-* > computeDisparity()                                                  *
-* Computes the disparity map of the two images using the PatchMatch     *
-* Stereo algorithm. In even iterations we proceed left to right, top to *
-* bottom; in odd iterations, in the opposite direction. See the         *
-* reference paper for more.                                             *
+* > sweepSequential()                                                   *
+* Single thread sweep. In even iterations we proceed left to right, top *
+* to bottom; in odd iterations, in the opposite direction.              *
 *                                                                       *
-* Returns:                                                              *
-*   (pair<Image,Image>): the left and right disparity maps              *
+* Args:                                                                 *
+*   image (StereoImage&): one of the two views                          *
+*   iteration (unsigned): the iteration number                          *
+*   sync (RowSync*): optional synchronization with the other view       *
 ************************************************************************/
-pair<Image,Image> StereoImagePair::computeDisparity(void) {
+void StereoImagePair::sweepSequential(StereoImage& image, unsigned iteration,
+		const RowSync* sync) {
+
+	// Select the direction
+	int increment = (iteration % 2 == 0) ? 1 : -1;
+	size_t wFirst, wLast, hFirst, hLast;
+	if (increment > 0) {  // start from 0
+		wFirst = 0;
+		hFirst = 0;
+		wLast = width - 1;
+		hLast = height - 1;
+	} else {   // start from the end
+		wFirst = width - 1;
+		hFirst = height - 1;
+		wLast = 0;
+		hLast = 0;
+	}
+
+	// For each pixel: row major order.
+	//		NOTE: whole image, not ignoring lateral bands
+	for (size_t h = hFirst, r = 0; true; h += increment, ++r) {
+		if (params.LOG >= 2) { logMsg("(_,"+to_string(h)+")", 2, ' ', true); }
+		if (sync) { sync->waitRow(r); }
+		image.indexViewCandidates(h);
+
+		for (size_t w = wFirst; true; w += increment) {
+			if (params.LOG >= 3) {
+				logMsg("("+to_string(w)+","+to_string(h)+")", 3, ' ');
+			}
+
+			// Spatial propagation, view propagation, plane refinement
+			image.processPixel(w, h, iteration);
+
+			if (w == wLast) break;
+		}
+
+		if (sync) { sync->doneRow(r); }
+		if (h == hLast) break;
+	}
+	image.clearViewCandidates();
+	logMsg("", 2);
+}
+
+
+/****************************************************************************
+* > sweepWavefront()                                                        *
+* Parallel sweep along anti-diagonals. The spatial propagation of pixel     *
+* (w,h) reads (w-1,h) and (w,h-1) in even iterations, (w+1,h) and (w,h+1)   *
+* in odd iterations. All of them are on the previous diagonal, so the       *
+* pixels of a diagonal are independent and each one sees the same updated   *
+* neighbors as in the sequential sweep. Diagonals are processed in order.   *
+* A row is done with the diagonal of its last pixel.                        *
+*                                                                           *
+* Args:                                                                     *
+*   image (StereoImage&): one of the two views                              *
+*   iteration (unsigned): the iteration number                              *
+*   pool (ThreadPool&): the threads to use                                  *
+*   sync (RowSync*): optional synchronization with the other view           *
+****************************************************************************/
+void StereoImagePair::sweepWavefront(StereoImage& image, unsigned iteration,
+		ThreadPool& pool, const RowSync* sync) {
+
+	size_t nDiagonals = width + height - 1;
+	bool forward = (iteration % 2 == 0);
+
+	for (size_t i = 0; i < nDiagonals; ++i) {
+		if (params.LOG >= 2) { logMsg("(_,"+to_string(i)+")", 2, ' ', true); }
+
+		// Pixels with w + h == diag
+		size_t diag = forward ? i : (nDiagonals - 1 - i);
+		size_t wMin = (diag >= height) ? (diag - height + 1) : 0;
+		size_t wMax = (diag < width) ? diag : (width - 1);
+
+		// Wait for the last row of this diagonal, in the sweep order
+		if (sync) {
+			sync->waitRow(forward ? (diag - wMin) : (height - 1 - (diag - wMax)));
+		}
+
+		// Index the new row: first pixel is (0, h) forward, (width-1, h) backward
+		if (forward && diag < height) {
+			image.indexViewCandidates(diag);
+		} else if (!forward && diag >= width - 1) {
+			image.indexViewCandidates(diag - (width - 1));
+		}
+
+		pool.parallelFor(wMin, wMax + 1, [&] (size_t w) {
+			image.processPixel(w, diag - w, iteration);
+		});
+
+		// Completed row: last pixel is (width-1, h) forward, (0, h) backward
+		if (sync) {
+			if (forward && diag >= width - 1) {
+				sync->doneRow(diag - (width - 1));
+			} else if (!forward && diag < height) {
+				sync->doneRow(height - 1 - diag);
+			}
+		}
+	}
+	image.clearViewCandidates();
+	logMsg("", 2);
+}
+
+
+/****************************************************************************
+* > sweepRedBlack()                                                         *
+* Parallel sweep with checkerboard order. Pixels with even w + h ("red")    *
+* are processed first, in parallel, then the odd ones ("black"). The        *
+* spatial neighbors of a pixel are always of the other colour, so they are  *
+* not modified while it is processed. Rows are assigned to threads, in the  *
+* direction of the iteration.                                               *
+*                                                                           *
+* Args:                                                                     *
+*   image (StereoImage&): one of the two views                              *
+*   iteration (unsigned): the iteration number                              *
+*   pool (ThreadPool&): the threads to use                                  *
+*   sync (RowSync*): optional synchronization with the other view           *
+****************************************************************************/
+void StereoImagePair::sweepRedBlack(StereoImage& image, unsigned iteration,
+		ThreadPool& pool, const RowSync* sync) {
+
+	bool forward = (iteration % 2 == 0);
+
+	for (size_t colour = 0; colour < 2; ++colour) {
+		logMsg("(colour "+to_string(colour)+")", 2, ' ', true);
+
+		pool.parallelFor(0, height, [&] (size_t r) {
+			size_t h = forward ? r : (height - 1 - r);
+			if (colour == 0) {
+				if (sync) { sync->waitRow(r); }
+				image.indexViewCandidates(h);
+			}
+
+			for (size_t w = (h + colour) % 2; w < width; w += 2) {
+				image.processPixel(w, h, iteration);
+			}
+
+			if (sync && colour == 1) { sync->doneRow(r); }
+		});
+	}
+	image.clearViewCandidates();
+	logMsg("", 2);
+}
+
+
+/****************************************************************************
+* > iterateInParallel()                                                     *
+* Runs all the iterations on the two views at the same time: the left view  *
+* on this thread, the right one on a new thread. The view propagation of    *
+* row h only reads row h of the other view. So, in each iteration, a row of *
+* the right view is processed after the same row of the left view; and each *
+* iteration of the left view starts after the previous iteration of the     *
+* right view. The planes read are the same as in the sequential order.      *
+*                                                                           *
+* Args:                                                                     *
+*   first (unsigned): the number of the first iteration                     *
+*   count (unsigned): the number of iterations                              *
+****************************************************************************/
+void StereoImagePair::iterateInParallel(unsigned first, unsigned count) {
+
+	ProgressCounter leftProgress(height);
+	ProgressCounter rightProgress(height);
+	std::atomic<bool> rightFailed(false);
+
+	// The right view
+	auto rightTask = asyncWithParams([&] {
+		try {
+			for (unsigned k = 0; k < count; ++k) {
+				RowSync sync { &rightProgress, &leftProgress, k * height };
+				sweepView(rightImg, first + k, *rightPool, &sync);
+			}
+		} catch (...) {
+			rightFailed = true;
+			rightProgress.abort();
+			throw;
+		}
+	});
+
+	// The left view
+	try {
+		for (unsigned k = 0; k < count; ++k) {
+			rightProgress.waitFor(k * height);
+			logMsg("Iteration #"+to_string(first+k+1), 1);
+
+			RowSync sync { &leftProgress, nullptr, k * height };
+			sweepView(leftImg, first + k, pool, &sync);
+		}
+	} catch (...) {
+		bool causedByRight = rightFailed;
+		leftProgress.abort();
+		if (causedByRight) {
+			rightTask.get();    // rethrows the error of the right view
+		}
+		rightTask.wait();
+		throw;
+	}
+
+	rightTask.get();
+}
+
+
+/*********************************************************************
+* > postProcess()                                                    *
+* Post processing of the two views, after the iterations: with       *
+* params.FUSED_POSTPROCESS, see processViewsFused(); otherwise, with *
+* params.PARALLEL_VIEWS, processViewsInParallel(), or processViews() *
+*                                                                    *
+* Returns:                                                           *
+*   (pair<Image,Image>): the left and right disparity maps           *
+*********************************************************************/
+pair<Image,Image> StereoImagePair::postProcess(void) {
+
+	if (params.FUSED_POSTPROCESS) {
+		return processViewsFused();
+	}
+	return params.PARALLEL_VIEWS ? processViewsInParallel() : processViews();
+}
+
+
+/***********************************************************************
+* > processViews()                                                     *
+* Post processing of the two views: the left one, then the right one.  *
+* NOTE: the consistency check of the right view reads the left planes  *
+*   after they have been filled.                                       *
+*                                                                      *
+* Returns:                                                             *
+*   (pair<Image,Image>): the left and right disparity maps             *
+***********************************************************************/
+pair<Image,Image> StereoImagePair::processViews(void) {
+
+	Image leftDisp = leftImg.processFinalDisparityMap(&pool);
+	Image rightDisp = rightImg.processFinalDisparityMap(&pool);
+
+	return std::make_pair(std::move(leftDisp), std::move(rightDisp));
+}
+
+
+/*************************************************************************
+* > processViewsInParallel()                                             *
+* Post processing of the two views at the same time. Both consistency    *
+* checks are computed first, on the unfilled planes; then each view is   *
+* filled and filtered on its own thread.                                 *
+*                                                                        *
+* Returns:                                                               *
+*   (pair<Image,Image>): the left and right disparity maps               *
+*************************************************************************/
+pair<Image,Image> StereoImagePair::processViewsInParallel(void) {
+
+	// Invalid pixels
+	auto rightInvalidTask = asyncWithParams(
+			[this] { return rightImg.getInvalidPixelsMap(); });
+	Image leftInvalid = leftImg.getInvalidPixelsMap();
+	Image rightInvalid = rightInvalidTask.get();
+
+	// Fill and filter
+	auto rightDispTask = asyncWithParams(
+			[this, &rightInvalid] {
+				return rightImg.processFinalDisparityMap(rightInvalid,
+						rightPool.get());
+			});
+	Image leftDisp = leftImg.processFinalDisparityMap(leftInvalid, &pool);
+	Image rightDisp = rightDispTask.get();
+
+	return std::make_pair(std::move(leftDisp), std::move(rightDisp));
+}
+
+
+/*********************************************************************
+* > postProcessRow()                                                 *
+* The fused post processing of row h, on both views: see the comment *
+* before StereoImage::mapDisparityRow().                             *
+*                                                                    *
+* Args:                                                              *
+*   h (size_t): the row                                              *
+*********************************************************************/
+void StereoImagePair::postProcessRow(size_t h) {
+
+	leftImg.mapDisparityRow(h);
+	rightImg.mapDisparityRow(h);
+	leftImg.checkRow(h);
+	rightImg.checkRow(h);
+	leftImg.fillRow(h);
+	rightImg.fillRow(h);
+}
+
+
+/**************************************************************************
+* > processViewsFused()                                                   *
+* Post processing of the two views in a single pass over the rows, by     *
+* bands of rows in parallel (see ThreadPool::parallelFor()): disparities, *
+* symmetric consistency check and confidence, background fill. Then the   *
+* weighted median of each view, the two at the same time with             *
+* params.PARALLEL_VIEWS. The same result as processViewsInParallel().     *
+* The confidence maps are kept: see getConfidenceMaps().                  *
+*                                                                         *
+* Returns:                                                                *
+*   (pair<Image,Image>): the left and right disparity maps                *
+**************************************************************************/
+pair<Image,Image> StereoImagePair::processViewsFused(void) {
+
+	pool.parallelFor(0, height, [this] (size_t h) { postProcessRow(h); });
+
+	// Weighted median
+	if (rightPool) {
+		auto rightDispTask = asyncWithParams([this] {
+			return rightImg.filterFinalDisparityMap(rightPool.get());
+		});
+		Image leftDisp = leftImg.filterFinalDisparityMap(&pool);
+		Image rightDisp = rightDispTask.get();
+		return std::make_pair(std::move(leftDisp), std::move(rightDisp));
+	}
+
+	Image leftDisp = leftImg.filterFinalDisparityMap(&pool);
+	Image rightDisp = rightImg.filterFinalDisparityMap(&pool);
+	return std::make_pair(std::move(leftDisp), std::move(rightDisp));
+}
+
+
+/****************************************************************************
+* > initializePlanes()                                                      *
+* Initial planes of the two views. With one level, they are random, or      *
+* from a cost volume with params.COST_VOLUME (see setAggregatedDisparities).*
+* With more levels, a pair at half the resolution is initialized in the same*
+* way (levels - 1), then runs params.ITERATIONS iterations; its planes,     *
+* scaled, are the initial planes here. The disparity range of the coarser   *
+* levels is scaled too, in params, and restored at the end. The caches of   *
+* this level are released while the coarser ones run: the levels share the  *
+* caps of params.                                                           *
+* The pyramid stops early if the coarser level would be smaller than the    *
+* matching window.                                                          *
+*                                                                           *
+* Args:                                                                     *
+*   levels (unsigned): levels of the pyramid, this one included             *
+*                                                                           *
+* Returns:                                                                  *
+*   (bool): true if the planes come from a coarser level                    *
+****************************************************************************/
+bool StereoImagePair::initializePlanes(unsigned levels) {
 
 	// Random Initialization
-	logMsg("Random Initialization", 1, ' ');
-	leftImg.setRandomDisparities();
-	rightImg.setRandomDisparities();
-	logMsg("done", 1);
+	size_t coarseWidth = (width + 1) / 2;
+	size_t coarseHeight = (height + 1) / 2;
+	if (levels <= 1 || coarseWidth < params.WINDOW_SIZE ||
+			coarseHeight < params.WINDOW_SIZE) {
+		if (params.COST_VOLUME) {
+			logMsg("Cost volume initialization", 1, ' ');
+			leftImg.setAggregatedDisparities(pool);
+			rightImg.setAggregatedDisparities(pool);
+			logMsg("done", 1);
+			return false;
+		}
+		logMsg("Random Initialization", 1, ' ');
+		leftImg.setRandomDisparities();
+		rightImg.setRandomDisparities();
+		logMsg("done", 1);
+		return false;
+	}
+
+	// The coarser level, with its disparity range
+	Params fineParams = params;
+	double scale = double(coarseWidth) / width;
+	params.MIN_D = std::floor(fineParams.MIN_D * scale);
+	params.MAX_D = std::ceil(fineParams.MAX_D * scale);
+
+	leftImg.releaseCaches();
+	rightImg.releaseCaches();
+
+	try {
+		StereoImagePair coarse(leftImg.downscaled(), rightImg.downscaled());
+		coarse.initializePlanes(levels - 1);
+
+		logMsg("Level " + to_string(coarseWidth) + "x" +
+				to_string(coarseHeight), 1);
+		coarse.iterate(fineParams.ITERATIONS);
+
+		params = fineParams;
+		leftImg.upsamplePlanes(coarse.leftImg);
+		rightImg.upsamplePlanes(coarse.rightImg);
+	} catch (...) {
+		params = fineParams;
+		leftImg.allocateCaches();
+		rightImg.allocateCaches();
+		throw;
+	}
+	leftImg.allocateCaches();
+	rightImg.allocateCaches();
+
+	return true;
+}
 
-	// For each iteration
-	for (unsigned i = 0; i < params.ITERATIONS; ++i) {
-		logMsg("Iteration #"+to_string(i+1), 1);
 
-		// Select the direction
-		int increment = (i % 2 == 0) ? 1 : -1;
-		size_t wFirst, wLast, hFirst, hLast;
-		if (increment > 0) {  // start from 0
-			wFirst = 0;
-			hFirst = 0;
-			wLast = width - 1;
-			hLast = height - 1;
-		} else {   // start from the end
-			wFirst = width - 1;
-			hFirst = height - 1;
-			wLast = 0;
-			hLast = 0;
+/**********************************************************************
+* > iterate()                                                         *
+* Runs the iterations of PatchMatch Stereo on the current planes.     *
+* Each iteration sweeps the left, then the right view. See            *
+* sweepView(). With params.PARALLEL_VIEWS, the two views are          *
+* processed at the same time. See iterateInParallel().                *
+* With params.CONVERGENCE or params.ACTIVE_PIXELS, the changed pixels *
+* are tracked, and checked after each iteration. See hasConverged().  *
+*                                                                     *
+* Args:                                                               *
+*   iterations (unsigned): the maximum number of iterations           *
+**********************************************************************/
+void StereoImagePair::iterate(unsigned iterations) {
+
+	bool tracking = params.CONVERGENCE > 0 || params.ACTIVE_PIXELS;
+	if (tracking) {
+		leftImg.resetActivePixels();
+		rightImg.resetActivePixels();
+	}
+
+	// Both images together
+	if (params.PARALLEL_VIEWS) {
+		logMsg("Processing both images", 1);
+		if (!tracking) {
+			iterateInParallel(0, iterations);
+		}
+		for (unsigned i = 0; tracking && i < iterations; ++i) {
+			if (i > 0 && hasConverged()) { break; }
+			iterateInParallel(i, 1);
 		}
+		return;
+	}
+
+	// For each iteration
+	for (unsigned i = 0; i < iterations; ++i) {
+		if (tracking && i > 0 && hasConverged()) { break; }
+		logMsg("Iteration #"+to_string(i+1), 1);
 
 		// For each of the two images
 		auto image = &leftImg;
@@ -855,36 +2858,220 @@ pair<Image,Image> StereoImagePair::computeDisparity(void) {
 			logMsg(string("Processing the ") +
 					((image == &leftImg) ? "left " : "right ") + "image" , 1);
 
-			// For each pixel: row major order.
-			//		NOTE: whole image, not ignoring lateral bands
-			for (size_t h = hFirst; true; h += increment) {
-				logMsg("(_,"+to_string(h)+")", 2, ' ', true);
+			sweepView(*image, i, pool);
+		}
+	}
+}
 
-				for (size_t w = wFirst; true; w += increment) {
-					logMsg("("+to_string(w)+","+to_string(h)+")", 3, ' ');
 
-					// Spatial propagation
-					image->pixelSpatialPropagation(w, h, i);
+/**********************************************************************
+* > hasConverged()                                                    *
+* Checks the changes of the last iteration. If the fraction of the    *
+* changed planes, in the two views, is below params.CONVERGENCE, the  *
+* iterations can stop. Otherwise, this prepares the next iteration:   *
+* the active pixels are selected (with params.ACTIVE_PIXELS) and the  *
+* changes are cleared.                                                *
+*                                                                     *
+* Returns:                                                            *
+*   (bool): true if converged                                         *
+**********************************************************************/
+bool StereoImagePair::hasConverged(void) {
+
+	double changed = (leftImg.changedFraction() +
+			rightImg.changedFraction()) / 2;
+	logMsg("Changed planes: " + to_string(100 * changed) + "%", 1);
+	if (changed < params.CONVERGENCE) {
+		logMsg("Converged", 1);
+		return true;
+	}
 
-					// View propagation
-					image->pixelViewPropagation(w, h);
-					
-					// Plane refinement
-					image->planeRefinement(w, h);
+	if (params.ACTIVE_PIXELS) {
+		leftImg.updateActivePixels();
+		rightImg.updateActivePixels();
+	}
+	leftImg.clearChangedPixels();
+	rightImg.clearChangedPixels();
 
-					if (w == wLast) break;
-				}
-				if (h == hLast) break;
-			}
-			logMsg("", 2);
-		}
+	return false;
+}
+
+
+/************************************************************************
+* > computeDisparity()                                                  *
+* Computes the disparity map of the two images using the PatchMatch     *
+* Stereo algorithm. Each iteration sweeps the left, then the right      *
+* view. See sweepView() for the order of the pixels and the reference   *
+* paper for more.                                                       *
+* With params.PARALLEL_VIEWS, the two views are processed at the same   *
+* time. See iterateInParallel() and processViewsInParallel().           *
+* With params.FUSED_POSTPROCESS, see processViewsFused().               *
+* With params.PYRAMID_LEVELS > 1, the planes are initialized from the   *
+* coarser levels, and this level runs params.FINE_ITERATIONS            *
+* iterations. See initializePlanes().                                   *
+* With params.GPU, see computeOnGpu().                                  *
+*                                                                       *
+* Returns:                                                              *
+*   (pair<Image,Image>): the left and right disparity maps              *
+************************************************************************/
+pair<Image,Image> StereoImagePair::computeDisparity(void) {
+
+	if (params.GPU) {
+		return computeOnGpu();
 	}
 
+	bool fromCoarse = initializePlanes(params.PYRAMID_LEVELS);
+	iterate(fromCoarse ? params.FINE_ITERATIONS : params.ITERATIONS);
+
 	// Post processing
 	logMsg("Post processing" , 1);
-	Image leftDisp = leftImg.processFinalDisparityMap();
-	Image rightDisp = rightImg.processFinalDisparityMap();
+	return postProcess();
+}
+
+
+/****************************************************************************
+* > computeOnGpu()                                                          *
+* As computeDisparity(), on the GPU backend: random initialization,         *
+* params.ITERATIONS iterations and the consistency checks run on the        *
+* device (see gpuMatch()); the planes are copied back into the two views,   *
+* and filled and filtered here.                                             *
+* Throws a runtime_error without the backend, and an invalid_argument for   *
+* the options that are only on the CPU: the pyramid, the cost volume, the   *
+* convergence, the active pixels and OutOfBounds other than NAN_COST.       *
+*                                                                           *
+* Returns:                                                                  *
+*   (pair<Image,Image>): the left and right disparity maps                  *
+****************************************************************************/
+pair<Image,Image> StereoImagePair::computeOnGpu(void) {
+
+	// checks
+	if (!gpuAvailable()) {
+		throw std::runtime_error("computeOnGpu(). No GPU backend: built " +
+				string("without SPMATCH_CUDA, or no CUDA device"));
+	}
+	if (params.PYRAMID_LEVELS > 1 || params.COST_VOLUME ||
+			params.CONVERGENCE > 0 || params.ACTIVE_PIXELS ||
+			params.OUT_OF_BOUNDS != Params::OutOfBounds::NAN_COST) {
+		throw std::invalid_argument("computeOnGpu(). The pyramid, the cost " +
+				string("volume, the convergence, the active pixels and ") +
+				"OUT_OF_BOUNDS != NAN_COST are not supported by the GPU");
+	}
 
-	// Return both disparity maps
-	return std::make_pair(leftDisp, rightDisp);
+	logMsg("GPU iterations", 1, ' ');
+	GpuView left = leftImg.toGpuView();
+	GpuView right = rightImg.toGpuView();
+	gpuMatch(width, height, left, right);
+	leftImg.setPlanes(left);
+	rightImg.setPlanes(right);
+	logMsg("done", 1);
+
+	// Post processing, with the consistency checks of the device
+	auto toImage = [this] (const GpuView& view) {
+		Image invalid(width, height, 1, 0);
+		for (size_t h = 0; h < height; ++h) {
+			for (size_t w = 0; w < width; ++w) {
+				invalid(w, h) = view.invalid[h * width + w];
+			}
+		}
+		return invalid;
+	};
+	logMsg("Post processing" , 1);
+	Image leftDisp = leftImg.processFinalDisparityMap(toImage(left), &pool);
+	Image rightDisp = rightImg.processFinalDisparityMap(toImage(right), &pool);
+
+	return std::make_pair(std::move(leftDisp), std::move(rightDisp));
+}
+
+
+/****************************************************************
+* > getPlanesMaps()                                             *
+* Returns:                                                      *
+*   (pair<Image,Image>): the current planes of the left and the *
+*       right view. See StereoImage::getPlanesMap()             *
+****************************************************************/
+pair<Image,Image> StereoImagePair::getPlanesMaps(void) const {
+	return { leftImg.getPlanesMap(), rightImg.getPlanesMap() };
+}
+
+
+/*****************************************************************
+* > getConfidenceMaps()                                          *
+* Returns:                                                       *
+*   (pair<Image,Image>): the confidence of the disparities of    *
+*       the left and right view, in [0, 1], from the last fused  *
+*       post processing (0 before). See StereoImage::checkRow()  *
+*****************************************************************/
+pair<Image,Image> StereoImagePair::getConfidenceMaps(void) const {
+	return { leftImg.getConfidenceMap(), rightImg.getConfidenceMap() };
+}
+
+
+/****************************************************************
+* > getCostsMaps()                                              *
+* Returns:                                                      *
+*   (pair<Image,Image>): the costs of the current planes of the *
+*       left and the right view. See StereoImage::getCostsMap() *
+****************************************************************/
+pair<Image,Image> StereoImagePair::getCostsMaps(void) const {
+	return { leftImg.getCostsMap(), rightImg.getCostsMap() };
+}
+
+
+/*************************************************************************
+* > loadFrame()                                                          *
+* Loads the next frame of a stereo video in the two views, reusing their *
+* buffers. The planes of the previous frame are kept, as the initial     *
+* planes of computeDisparityFromPrevious().                              *
+*                                                                        *
+* Args:                                                                  *
+*   leftImgPath (string): path of the left view of the frame             *
+*   rightImgPath (string): path of the right view of the frame           *
+*************************************************************************/
+void StereoImagePair::loadFrame(const string& leftImgPath,
+		const string& rightImgPath) {
+
+	leftImg.loadFrame(leftImgPath);
+	rightImg.loadFrame(rightImgPath);
+}
+
+
+/*********************************************************************
+* > loadFrame()                                                      *
+* As loadFrame(leftImgPath, rightImgPath), with the views in memory. *
+*                                                                    *
+* Args:                                                              *
+*   left (ImageBuffer): the left view of the frame                   *
+*   right (ImageBuffer): the right view of the frame                 *
+*********************************************************************/
+void StereoImagePair::loadFrame(const ImageBuffer& left,
+		const ImageBuffer& right) {
+
+	leftImg.loadFrame(left);
+	rightImg.loadFrame(right);
+}
+
+
+/*************************************************************************
+* > computeDisparityFromPrevious()                                       *
+* As computeDisparity(), for the next frame of a video: the planes of    *
+* the previous frame are the initialization, with a fraction             *
+* params.TEMPORAL_RANDOM of random planes mixed in. Then it runs         *
+* params.TEMPORAL_ITERATIONS iterations. See loadFrame().                *
+* NOTE: the planes of the previous frame are those after the post        *
+*   processing: the invalid ones have been filled.                       *
+*                                                                        *
+* Returns:                                                               *
+*   (pair<Image,Image>): the left and right disparity maps               *
+*************************************************************************/
+pair<Image,Image> StereoImagePair::computeDisparityFromPrevious(void) {
+
+	logMsg("Warm start", 1, ' ');
+	leftImg.mixRandomPlanes(params.TEMPORAL_RANDOM);
+	rightImg.mixRandomPlanes(params.TEMPORAL_RANDOM);
+	logMsg("done", 1);
+
+	iterate(params.TEMPORAL_ITERATIONS);
+
+	// Post processing
+	logMsg("Post processing" , 1);
+	return postProcess();
 }
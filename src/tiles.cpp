@@ -0,0 +1,391 @@
+#include "tiles.hpp"
+
+#include <atomic>
+#include <future>
+#include <algorithm>
+#include <cstdlib>
+
+#include "params.hpp"
+#include "log.hpp"
+#include "parallel.hpp"
+#include "remote.hpp"
+
+
+using std::to_string;
+
+
+namespace {
+
+	// The frame at 'path', as 8 bit pixels. See loadImage()
+	DecodedImage loadFrame(const string& path) {
+		DecodedImage frame;
+		loadImage(path, frame);
+		return frame;
+	}
+}
+
+
+// > class TiledStereo
+
+/*************************************************************************
+* > TiledStereo()                                                        *
+* Constructor. Loads the two frames as 8 bit images (see loadImage()).   *
+* No tile is matched here: see computeDisparity().                       *
+*                                                                        *
+* Args:                                                                  *
+*   leftImgPath (string): path of the left RGB view                      *
+*   rightImgPath (string): path of the right RGB view                    *
+*   keepPlanes (bool): whether to stitch the planes and the costs too.   *
+*       See getPlanesMap()                                               *
+*************************************************************************/
+TiledStereo::TiledStereo(const string& leftImgPath,
+		const string& rightImgPath, bool keepPlanes):
+		leftFrame(loadFrame(leftImgPath)),
+		rightFrame(loadFrame(rightImgPath)),
+		width(leftFrame.width),
+		height(leftFrame.height),
+		keepPlanes(keepPlanes) {
+
+	// checks
+	if (rightFrame.width != width || rightFrame.height != height ||
+			rightFrame.channels != leftFrame.channels) {
+		throw std::invalid_argument(string() + "TiledStereo(). " +
+				"Left and right images must have the same dimension.");
+	}
+	if (params.TILE_SIZE == 0) {
+		throw std::invalid_argument("TiledStereo(). TILE_SIZE is 0");
+	}
+}
+
+
+/****************************************************************************
+* > tiles()                                                                 *
+* The tiles of the frame, in row major order. The cores are squares of      *
+* params.TILE_SIZE pixels (smaller at the right and bottom borders) and     *
+* cover the frame. The halo is what the matching of a core pixel reads: the *
+* window, WINDOW_SIZE / 2 pixels on each side; horizontally, the disparity  *
+* range too, so that the pixels matching the core are in the other view of  *
+* the tile. The halos are clipped at the borders of the frame.              *
+*                                                                           *
+* Returns:                                                                  *
+*   (vector<Tile>): all the tiles                                           *
+****************************************************************************/
+std::vector<TiledStereo::Tile> TiledStereo::tiles(void) const {
+
+	size_t side = params.TILE_SIZE;
+	size_t haloY = params.WINDOW_SIZE / 2;
+	size_t haloX = haloY + std::max(std::abs(params.MIN_D),
+			std::abs(params.MAX_D));
+
+	std::vector<Tile> all;
+	for (size_t y0 = 0; y0 < height; y0 += side) {
+		for (size_t x0 = 0; x0 < width; x0 += side) {
+			Tile tile;
+			tile.x0 = x0;
+			tile.y0 = y0;
+			tile.x1 = std::min(x0 + side, width);
+			tile.y1 = std::min(y0 + side, height);
+			tile.hx0 = (x0 > haloX) ? (x0 - haloX) : 0;
+			tile.hy0 = (y0 > haloY) ? (y0 - haloY) : 0;
+			tile.hx1 = std::min(tile.x1 + haloX, width);
+			tile.hy1 = std::min(tile.y1 + haloY, height);
+			all.push_back(tile);
+		}
+	}
+
+	return all;
+}
+
+
+/*************************************************************************
+* > region()                                                             *
+* Args:                                                                  *
+*   frame (DecodedImage): one of the frames                              *
+*   tile (Tile): a tile                                                  *
+*                                                                        *
+* Returns:                                                               *
+*   (ImageBuffer): the tile and its halo in the frame, without copies    *
+*************************************************************************/
+ImageBuffer TiledStereo::region(const DecodedImage& frame,
+		const Tile& tile) const {
+
+	ImageBuffer buffer = frame.buffer();
+	buffer.data += (tile.hy0 * buffer.rowStride) + tile.hx0 * buffer.channels;
+	buffer.width = tile.hx1 - tile.hx0;
+	buffer.height = tile.hy1 - tile.hy0;
+	return buffer;
+}
+
+
+/***************************************************************************
+* > computeTile()                                                          *
+* Matches a tile: both views, cropped to the halo, are a StereoImagePair   *
+* (see StereoImagePair::computeDisparity(), with the post processing),     *
+* here or on a remote worker (see remoteCompute()), with the random        *
+* streams of the frame (see setFrameOrigin()). The result is               *
+* stitched into the output: see stitchTile().                              *
+* Tiles with different cores can be computed at the same time.             *
+*                                                                          *
+* Args:                                                                    *
+*   tile (Tile): the tile                                                  *
+*   worker (string*): the address of the worker. nullptr: here             *
+***************************************************************************/
+void TiledStereo::computeTile(const Tile& tile, const string* worker) {
+
+	size_t tileWidth = tile.hx1 - tile.hx0;
+	size_t tileHeight = tile.hy1 - tile.hy0;
+
+	ImageBuffer left = region(leftFrame, tile);
+	ImageBuffer right = region(rightFrame, tile);
+
+	// Remote
+	if (worker != nullptr) {
+		RemoteResult result = remoteCompute(*worker, left, right, keepPlanes,
+				tile.hx0, tile.hy0, width);
+
+		auto maps = [&] (const std::vector<float>* views, size_t channels) {
+			return pair<Image,Image>(
+					toImage(views[0], tileWidth, tileHeight, channels),
+					toImage(views[1], tileWidth, tileHeight, channels));
+		};
+		if (keepPlanes) {
+			pair<Image,Image> tilePlanes = maps(result.planes, 3);
+			pair<Image,Image> tileCosts = maps(result.costs, 1);
+			stitchTile(tile, maps(result.disparities, 1), &tilePlanes,
+					&tileCosts);
+		} else {
+			stitchTile(tile, maps(result.disparities, 1), nullptr, nullptr);
+		}
+		return;
+	}
+
+	// Here
+	StereoImage leftView(Image(left), StereoImage::LEFT);
+	StereoImage rightView(Image(right), StereoImage::RIGHT);
+	leftView.setFrameOrigin(tile.hx0, tile.hy0, width);
+	rightView.setFrameOrigin(tile.hx0, tile.hy0, width);
+	StereoImagePair stereo(std::move(leftView), std::move(rightView));
+
+	pair<Image,Image> tileDisp = stereo.computeDisparity();
+	if (keepPlanes) {
+		pair<Image,Image> tilePlanes = stereo.getPlanesMaps();
+		pair<Image,Image> tileCosts = stereo.getCostsMaps();
+		stitchTile(tile, tileDisp, &tilePlanes, &tileCosts);
+	} else {
+		stitchTile(tile, tileDisp, nullptr, nullptr);
+	}
+}
+
+
+/***************************************************************************
+* > stitchTile()                                                           *
+* Copies the maps of the core of a tile to those of the frame: the         *
+* disparities, and with keepPlanes the planes, rewritten in frame          *
+* coordinates, and their costs.                                            *
+*                                                                          *
+* Args:                                                                    *
+*   tile (Tile): the tile                                                  *
+*   tileDisp (pair<Image,Image>): the left and right disparity maps of the *
+*       tile, with its halo                                                *
+*   tilePlanes (pair<Image,Image>*), tileCosts (pair<Image,Image>*): the   *
+*       same for the planes and the costs. Only with keepPlanes            *
+***************************************************************************/
+void TiledStereo::stitchTile(const Tile& tile,
+		const pair<Image,Image>& tileDisp, const pair<Image,Image>* tilePlanes,
+		const pair<Image,Image>* tileCosts) {
+
+	for (size_t h = tile.y0; h < tile.y1; ++h) {
+		for (size_t w = tile.x0; w < tile.x1; ++w) {
+			size_t tW = w - tile.hx0, tH = h - tile.hy0;
+			disparities[0].set(w, h, 0, tileDisp.first.get(tW, tH));
+			disparities[1].set(w, h, 0, tileDisp.second.get(tW, tH));
+		}
+	}
+
+	if (!keepPlanes) { return; }
+
+	// a*x + b*y + c in the tile is a*x' + b*y' + c', with
+	// x' = x + hx0, y' = y + hy0 in the frame
+	for (size_t h = tile.y0; h < tile.y1; ++h) {
+		for (size_t w = tile.x0; w < tile.x1; ++w) {
+			size_t tW = w - tile.hx0, tH = h - tile.hy0;
+			for (unsigned v = 0; v < 2; ++v) {
+				const Image& in = (v == 0) ? tilePlanes->first :
+						tilePlanes->second;
+				double a = in.get(tW, tH, 0), b = in.get(tW, tH, 1);
+				planes[v].set(w, h, 0, a);
+				planes[v].set(w, h, 1, b);
+				planes[v].set(w, h, 2,
+						in.get(tW, tH, 2) - a * tile.hx0 - b * tile.hy0);
+			}
+			costs[0].set(w, h, 0, tileCosts->first.get(tW, tH));
+			costs[1].set(w, h, 0, tileCosts->second.get(tW, tH));
+		}
+	}
+}
+
+
+/****************************************************************************
+* > newMap()                                                                *
+* A map of the frame, for the results: mapped onto the RAW file of the      *
+* output with this suffix (see setOutput()), or in memory.                  *
+*                                                                           *
+* Args:                                                                     *
+*   channels (size_t): channels of the map                                  *
+*   suffix (string): as in the output files, e.g. "L" or "R_planes"         *
+*                                                                           *
+* Returns:                                                                  *
+*   (FloatMap): the map, all 0                                              *
+****************************************************************************/
+FloatMap TiledStereo::newMap(size_t channels, const string& suffix) const {
+
+	if (outputName.empty()) {
+		return FloatMap(width, height, channels);
+	}
+	return FloatMap(width, height, channels,
+			outputName + suffix + outputExtension(OutputFormat::RAW));
+}
+
+
+/****************************************************************************
+* > computeDisparity()                                                      *
+* Computes the disparity maps of the frame, one tile at a time: see         *
+* computeTile(). With params.TILE_JOBS > 1, that many tiles are matched at  *
+* the same time, and the threads (params.THREADS) are split between them.   *
+* With remote workers (see setWorkers()), each of them is a job instead,    *
+* and takes the next tile when it is done with the previous one.            *
+* The maps are stitched in float32, and with setOutput() written in their   *
+* RAW files as each tile is done: see getDisparityMap().                    *
+* NOTE: each tile has its own random planes and, with                       *
+*   params.NORMALIZE_GRADIENTS, its own gradient normalization: the         *
+*   disparities differ from those of the whole frame, most visibly at the   *
+*   borders between the cores.                                              *
+****************************************************************************/
+void TiledStereo::computeDisparity(void) {
+
+	std::vector<Tile> all = tiles();
+	const char* sides[] = { "L", "R" };
+	for (unsigned v = 0; v < 2; ++v) {
+		disparities[v] = newMap(1, sides[v]);
+		if (keepPlanes) {
+			planes[v] = newMap(3, string(sides[v]) + "_planes");
+			costs[v] = newMap(1, string(sides[v]) + "_costs");
+		}
+	}
+
+	unsigned threads = params.THREADS;
+	if (threads == 0) {
+		threads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	unsigned jobs = workers.empty() ? std::max(params.TILE_JOBS, 1u) :
+			workers.size();
+	jobs = std::min<size_t>(jobs, all.size());
+
+	// Each job takes the next tile, until none is left
+	std::atomic<size_t> next(0);
+	auto job = [&] (unsigned j) {
+		params.THREADS = std::max(threads / jobs, 1u);
+		for (size_t t = next++; t < all.size(); t = next++) {
+			logMsg("Tile " + to_string(t + 1) + "/" + to_string(all.size()) +
+					" [" + to_string(all[t].x0) + ", " + to_string(all[t].x1) +
+					") x [" + to_string(all[t].y0) + ", " + to_string(all[t].y1) +
+					")", 1);
+			try {
+				computeTile(all[t], workers.empty() ? nullptr : &workers[j]);
+			} catch (...) {
+				next = all.size();     // the other jobs stop too
+				throw;
+			}
+		}
+	};
+
+	std::vector<std::future<void>> running;
+	for (unsigned j = 1; j < jobs; ++j) {
+		running.push_back(asyncWithParams([&job, j] { job(j); }));
+	}
+	std::exception_ptr error;
+	Params callerParams = params;
+	try {
+		job(0);
+	} catch (...) {
+		error = std::current_exception();
+	}
+	params = callerParams;
+	for (auto& task: running) {
+		try {
+			task.get();
+		} catch (...) {
+			if (!error) { error = std::current_exception(); }
+		}
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+
+/***********************************************************************
+* > setWorkers()                                                       *
+* Sets the remote workers of the next computeDisparity(). See          *
+* serveWorker().                                                       *
+*                                                                      *
+* Args:                                                                *
+*   addresses (vector<string>): the workers, as "<host>:<port>".       *
+*       Empty: the tiles are matched here                              *
+***********************************************************************/
+void TiledStereo::setWorkers(const std::vector<string>& addresses) {
+	workers = addresses;
+}
+
+
+/*****************************************************************
+* > setOutput()                                                  *
+* Makes computeDisparity() write the maps in place, in RAW files *
+* (see OutputFormat): <name>L.raw, <name>R.raw, and with         *
+* keepPlanes <name>L_planes.raw, <name>L_costs.raw and the same  *
+* for R. The whole maps are never in memory.                     *
+*                                                                *
+* Args:                                                          *
+*   name (string): the path of the files, without the suffixes.  *
+*       Empty: the maps are kept in memory                       *
+*****************************************************************/
+void TiledStereo::setOutput(const string& name) {
+	outputName = name;
+}
+
+
+/*******************************************************************
+* > getPlanesMap()                                                 *
+* Args:                                                            *
+*   side (Side): the view                                          *
+*                                                                  *
+* Returns:                                                         *
+*   (FloatMap): the planes of the view (as                         *
+*       StereoImage::getPlanesMap()) in frame coordinates,         *
+*       stitched from the cores of the tiles                       *
+*******************************************************************/
+const FloatMap& TiledStereo::getPlanesMap(StereoImage::Side side) const {
+
+	if (!keepPlanes) {
+		throw std::logic_error("getPlanesMap(). Planes not kept");
+	}
+	return planes[side];
+}
+
+
+/*******************************************************************
+* > getCostsMap()                                                  *
+* Args:                                                            *
+*   side (Side): the view                                          *
+*                                                                  *
+* Returns:                                                         *
+*   (FloatMap): the costs of the planes of the view, as            *
+*       getPlanesMap()                                             *
+*******************************************************************/
+const FloatMap& TiledStereo::getCostsMap(StereoImage::Side side) const {
+
+	if (!keepPlanes) {
+		throw std::logic_error("getCostsMap(). Planes not kept");
+	}
+	return costs[side];
+}